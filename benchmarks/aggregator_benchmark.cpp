@@ -0,0 +1,111 @@
+#include <map>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "roo_monitoring/compaction.h"
+
+namespace roo_monitoring {
+namespace {
+
+// Number of output entries produced per compacted vault file.
+const int kGroupCount = kRangeElementCount / 4;
+
+// The map-indexed aggregator that Aggregator used to be; kept as a baseline.
+class MapAggregator {
+ public:
+  void clear() {
+    data_.clear();
+    index_.clear();
+  }
+
+  void add(const Sample& input) {
+    int idx;
+    auto pos = index_.find(input.stream_id());
+    if (pos == index_.end()) {
+      idx = data_.size();
+      data_.emplace_back();
+      index_.insert(std::make_pair(input.stream_id(), idx));
+    } else {
+      idx = pos->second;
+    }
+    Entry& output = data_[idx];
+    output.weighted_total += (input.avg_value() * input.fill());
+    output.weight += input.fill();
+    if (output.min_value > input.min_value()) {
+      output.min_value = input.min_value();
+    }
+    if (output.max_value < input.max_value()) {
+      output.max_value = input.max_value();
+    }
+  }
+
+  size_t size() const { return data_.size(); }
+
+ private:
+  struct Entry {
+    uint32_t weighted_total = 0;
+    uint16_t weight = 0;
+    uint16_t min_value = 0xFFFF;
+    uint16_t max_value = 0;
+  };
+
+  std::vector<Entry> data_;
+  std::map<uint64_t, int> index_;
+};
+
+// Returns four input entries, each with the specified number of streams.
+std::vector<std::vector<Sample>> makeInput(int stream_count) {
+  std::vector<std::vector<Sample>> result(4);
+  for (int i = 0; i < 4; ++i) {
+    for (int s = 0; s < stream_count; ++s) {
+      result[i].emplace_back(s * 7919, 1000 + i * s, 1000, 2000, 0x2000);
+    }
+  }
+  return result;
+}
+
+template <typename AggregatorType>
+void BM_Aggregate(benchmark::State& state) {
+  std::vector<std::vector<Sample>> input = makeInput(state.range(0));
+  AggregatorType aggregator;
+  for (auto _ : state) {
+    for (int group = 0; group < kGroupCount; ++group) {
+      for (const auto& entry : input) {
+        for (const Sample& sample : entry) {
+          aggregator.add(sample);
+        }
+      }
+      benchmark::DoNotOptimize(&aggregator);
+      aggregator.clear();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kGroupCount * 4 *
+                          state.range(0));
+}
+
+// Aggregates four-entry groups with addGroup(): column-wise if all entries
+// hold the same streams (arg 1 == 0), or through the general path if one of
+// them misses a stream (arg 1 == 1).
+void BM_AggregateGroup(benchmark::State& state) {
+  std::vector<std::vector<Sample>> input = makeInput(state.range(0));
+  std::vector<Sample> group[4];
+  for (int i = 0; i < 4; ++i) group[i] = input[i];
+  if (state.range(1) == 1) group[3].pop_back();
+  Aggregator aggregator;
+  for (auto _ : state) {
+    for (int g = 0; g < kGroupCount; ++g) {
+      aggregator.addGroup(group);
+      benchmark::DoNotOptimize(&aggregator);
+      aggregator.clear();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kGroupCount * 4 *
+                          state.range(0));
+}
+
+BENCHMARK_TEMPLATE(BM_Aggregate, MapAggregator)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Aggregate, Aggregator)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_AggregateGroup)->ArgsProduct({{10, 100, 1000}, {0, 1}});
+
+}  // namespace
+}  // namespace roo_monitoring
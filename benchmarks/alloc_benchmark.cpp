@@ -0,0 +1,127 @@
+// Counts heap allocations on the flush (compaction) and query paths.
+//
+// Replaces the global operator new, so that every allocation made by the
+// library (and by the filesystem it runs on) is counted. Reports the count
+// per flushed range, or per scanned range, as the `allocs_per_range`
+// counter.
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+
+namespace {
+
+std::atomic<uint64_t> allocation_count(0);
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  void* result = malloc(size == 0 ? 1 : size);
+  if (result == nullptr) throw std::bad_alloc();
+  return result;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+namespace roo_monitoring {
+namespace {
+
+const int kStreamCount = 16;
+const int kRanges = 4;
+
+// Writes `ranges` full ranges of kStreamCount streams, plus one step, so that
+// all of them are historical.
+void writeRanges(Writer& writer, int ranges) {
+  int64_t increment = timestamp_increment(1, writer.collection().resolution());
+  for (int64_t i = 0; i <= ranges * kRangeElementCount; ++i) {
+    WriteTransaction tx(&writer);
+    for (int s = 0; s < kStreamCount; ++s) {
+      tx.write(i * increment, s * 7919, (float)s);
+    }
+  }
+  writer.sync();
+}
+
+// Path construction alone; should not allocate.
+void BM_VaultFilePath(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  VaultFileRef ref = VaultFileRef::Lookup(0, collection.resolution());
+  FilePath path;
+  uint64_t allocations = allocation_count.load();
+  for (auto _ : state) {
+    collection.getVaultFilePath(ref, &path);
+    path.append(".cursor");
+    benchmark::DoNotOptimize(path.c_str());
+    ref = ref.next();
+  }
+  state.counters["allocs_per_path"] =
+      (double)(allocation_count.load() - allocations) / state.iterations();
+}
+
+// Allocations made by flushAll(), per flushed range (including compaction of
+// all levels).
+void BM_FlushAllocations(benchmark::State& state) {
+  uint64_t allocations = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    roo_io::fakefs::FakeFs fake_fs;
+    roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+    Collection collection(fs, "bench");
+    std::unique_ptr<Writer> writer(new Writer(&collection));
+    writeRanges(*writer, kRanges);
+    uint64_t start = allocation_count.load();
+    state.ResumeTiming();
+
+    writer->flushAll();
+
+    state.PauseTiming();
+    allocations += allocation_count.load() - start;
+    writer.reset();
+    state.ResumeTiming();
+  }
+  state.counters["allocs_per_range"] =
+      (double)allocations / (state.iterations() * kRanges);
+}
+
+// Allocations made by a VaultIterator scan, per vault file.
+void BM_ScanAllocations(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  {
+    Writer writer(&collection);
+    writeRanges(writer, kRanges);
+    writer.flushAll();
+  }
+  std::vector<Sample> samples;
+  samples.reserve(kStreamCount);
+  uint64_t start = allocation_count.load();
+  for (auto _ : state) {
+    VaultIterator it(&collection, 0, collection.resolution());
+    for (int64_t i = 0; i < kRanges * kRangeElementCount; ++i) {
+      it.next(&samples);
+    }
+  }
+  state.counters["allocs_per_range"] =
+      (double)(allocation_count.load() - start) /
+      (state.iterations() * kRanges);
+}
+
+BENCHMARK(BM_VaultFilePath);
+BENCHMARK(BM_FlushAllocations);
+BENCHMARK(BM_ScanAllocations);
+
+}  // namespace
+}  // namespace roo_monitoring
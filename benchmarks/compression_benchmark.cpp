@@ -0,0 +1,115 @@
+// Vault compression benchmarks, on synthetic but realistic sensor traces:
+// quantized temperature and humidity readings drifting over the day, power
+// readings switching between a few levels, and on/off states.
+//
+// Reports the stored bytes per sample as the `bytes_per_sample` counter, and
+// the decode throughput (samples per second), with vault compression
+// disabled (arg 0) or enabled (arg 1), at the base level and two levels up
+// (where the samples are aggregates, with distinct min and max).
+
+#include <math.h>
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+namespace {
+
+const int kFileCount = 4;
+const int kStreamCount = 16;
+
+// Deterministic pseudo-random numbers, uniform in [-1, 1).
+class Noise {
+ public:
+  explicit Noise(uint32_t seed) : state_(seed) {}
+
+  float next() {
+    state_ = state_ * 1664525 + 1013904223;
+    return (float)(state_ >> 8) / (1 << 23) - 1.0f;
+  }
+
+ private:
+  uint32_t state_;
+};
+
+float quantize(float value, float step) { return roundf(value / step) * step; }
+
+// Value of the stream at the specified step.
+float traceValue(int stream, int64_t step, Noise& noise, float* level) {
+  // One simulated day per 4096 steps.
+  float phase = 2 * M_PI * (step + 97 * stream) / 4096.0f;
+  switch (stream % 4) {
+    case 0:  // Temperature, in 0.1 degree steps.
+      return quantize(21 + 3 * sinf(phase) + 0.05f * noise.next(), 0.1f);
+    case 1:  // Relative humidity, in 0.5% steps.
+      return quantize(45 + 10 * sinf(phase + 1) + 0.5f * noise.next(), 0.5f);
+    case 2:  // Power, in 0.1 W steps, switching between idle and on.
+      if (noise.next() > 0.98f) *level = (*level < 50 ? 120 : 5);
+      return quantize(*level + noise.next(), 0.1f);
+    default:  // On/off state.
+      if (noise.next() > 0.99f) *level = 1 - *level;
+      return *level;
+  }
+}
+
+// Writes kFileCount + 1 ranges of the traces, and compacts them at all
+// levels.
+void populate(Collection& collection) {
+  Writer writer(&collection);
+  int64_t increment = timestamp_increment(1, collection.resolution());
+  Noise noise(12345);
+  std::vector<float> levels(kStreamCount, 0);
+  for (int64_t i = 0; i <= (kFileCount + 1) * kRangeElementCount; ++i) {
+    WriteTransaction tx(&writer);
+    for (int s = 0; s < kStreamCount; ++s) {
+      tx.write(i * increment, 0x9E3779B97F4A7C15ULL * (s + 1),
+               traceValue(s, i, noise, &levels[s]));
+    }
+  }
+  writer.flushAll();
+}
+
+// Reads all samples of the specified level of the collection, except for
+// the first range (whose files have no stream dictionaries). Returns the
+// number of samples read.
+size_t readAll(const Collection& collection, Resolution resolution,
+               VaultReadStats* stats) {
+  VaultFileRef first = VaultFileRef::Lookup(0, collection.resolution());
+  int64_t start = first.next().timestamp();
+  int64_t end = first.advance(kFileCount + 1).timestamp();
+  int64_t step = timestamp_increment(1, resolution);
+  VaultIterator it(&collection, start, resolution);
+  std::vector<Sample> samples;
+  size_t count = 0;
+  for (int64_t t = start; t < end; t += step) {
+    it.next(&samples);
+    count += samples.size();
+    benchmark::DoNotOptimize(samples.data());
+  }
+  if (stats != nullptr) *stats = it.stats();
+  return count;
+}
+
+void BM_DecodeSensorTraces(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  if (state.range(0) == 1) collection.enableVaultCompression();
+  populate(collection);
+  Resolution resolution = Resolution(collection.resolution() + state.range(1));
+  VaultReadStats stats;
+  size_t count = readAll(collection, resolution, &stats);
+  for (auto _ : state) {
+    readAll(collection, resolution, nullptr);
+  }
+  state.counters["bytes_per_sample"] = (double)stats.bytes_read / count;
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+BENCHMARK(BM_DecodeSensorTraces)->ArgsProduct({{0, 1}, {0, 2}});
+
+}  // namespace
+}  // namespace roo_monitoring
@@ -0,0 +1,98 @@
+// Cost of decoding vault samples, per sample: per-field reads through
+// roo_io (the stream path), and batch decoding of mapped bytes, with and
+// without SIMD instructions. Streams are numbered densely, so that stream
+// IDs take one or two bytes, as is typical.
+
+#include <algorithm>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_io/data/multipass_input_stream_reader.h"
+#include "roo_io/data/output_stream_writer.h"
+#include "roo_monitoring/sample_decoder.h"
+
+namespace roo_monitoring {
+namespace {
+
+const char* kPath = "/samples";
+
+// Returns `count` samples in the vault file encoding.
+std::vector<uint8_t> encodeSamples(int count) {
+  std::vector<uint8_t> result;
+  for (int i = 0; i < count; ++i) {
+    uint64_t stream_id = i;
+    while (stream_id >= 0x80) {
+      result.push_back((stream_id & 0x7F) | 0x80);
+      stream_id >>= 7;
+    }
+    result.push_back(stream_id);
+    for (int v : {i * 3, i * 2, i * 5, 0x2000}) {
+      result.push_back((v >> 8) & 0xFF);
+      result.push_back(v & 0xFF);
+    }
+  }
+  return result;
+}
+
+void BM_DecodeStream(benchmark::State& state) {
+  int count = state.range(0);
+  std::vector<uint8_t> data = encodeSamples(count);
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  roo_io::Mount mount = fs.mount();
+  {
+    auto writer =
+        roo_io::OpenDataFileForWrite(mount, kPath, roo_io::kTruncateIfExists);
+    writer.writeByteArray((const roo_io::byte*)data.data(), data.size());
+    writer.close();
+  }
+  roo_io::MultipassInputStreamReader reader(mount.fopen(kPath));
+  SampleBatch batch;
+  for (auto _ : state) {
+    reader.seek(0);
+    for (int i = 0; i < count; ++i) {
+      int j = i % kSampleBatchSize;
+      batch.stream_id[j] = reader.readVarU64();
+      batch.avg[j] = reader.readBeU16();
+      batch.min[j] = reader.readBeU16();
+      batch.max[j] = reader.readBeU16();
+      batch.fill[j] = reader.readBeU16();
+    }
+    benchmark::DoNotOptimize(&batch);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+template <const uint8_t* (*Decode)(const uint8_t*, const uint8_t*, int,
+                                   SampleBatch*)>
+void BM_DecodeBatch(benchmark::State& state) {
+  int count = state.range(0);
+  std::vector<uint8_t> data = encodeSamples(count);
+  const uint8_t* end = data.data() + data.size();
+  SampleBatch batch;
+  for (auto _ : state) {
+    const uint8_t* p = data.data();
+    for (int i = 0; i < count; i += kSampleBatchSize) {
+      p = Decode(p, end, std::min(count - i, kSampleBatchSize), &batch);
+    }
+    benchmark::DoNotOptimize(p);
+    benchmark::DoNotOptimize(&batch);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  state.counters["vectorized"] =
+      Decode == DecodeSampleBatch && SampleBatchDecodingIsVectorized();
+}
+
+BENCHMARK(BM_DecodeStream)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_DecodeBatch, DecodeSampleBatchScalar)
+    ->Arg(16)
+    ->Arg(256)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_DecodeBatch, DecodeSampleBatch)
+    ->Arg(16)
+    ->Arg(256)
+    ->Arg(4096);
+
+}  // namespace
+}  // namespace roo_monitoring
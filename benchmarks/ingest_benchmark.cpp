@@ -0,0 +1,60 @@
+#include <atomic>
+#include <memory>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+namespace {
+
+roo_io::fakefs::FakeFs* fake_fs;
+roo_io::fakefs::FakeReferenceFs* fs;
+Collection* collection;
+Writer* writer;
+IngestQueue* queue;
+
+// Advanced by the consumer; read by the producers.
+std::atomic<int64_t> clock_ms;
+
+// Every thread pushes samples; thread 0 additionally acts as the consumer,
+// draining the queue into the writer every 64 pushes. Reports pushes per
+// second, and the drop count.
+void BM_IngestQueuePush(benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    fake_fs = new roo_io::fakefs::FakeFs();
+    fs = new roo_io::fakefs::FakeReferenceFs(*fake_fs);
+    collection = new Collection(*fs, "bench");
+    writer = new Writer(collection, LogCommitPolicy::BufferedBytes(4096));
+    queue = new IngestQueue(state.range(0), IngestQueue::kDropNewest);
+    clock_ms = 0;
+  }
+  uint64_t stream_id = state.thread_index();
+  int64_t i = 0;
+  for (auto _ : state) {
+    queue->push(clock_ms.load(std::memory_order_relaxed), stream_id, 1.0f);
+    if (state.thread_index() == 0 && (++i % 64) == 0) {
+      queue->drain(writer);
+      clock_ms.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    queue->drain(writer);
+    state.counters["dropped"] = queue->dropped();
+    delete queue;
+    delete writer;
+    delete collection;
+    delete fs;
+    delete fake_fs;
+  }
+}
+
+BENCHMARK(BM_IngestQueuePush)
+    ->Arg(1024)
+    ->Arg(16384)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace roo_monitoring
@@ -0,0 +1,78 @@
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+namespace {
+
+const int kStreamCount = 16;
+
+LogCommitPolicy policyFor(int arg) {
+  switch (arg) {
+    case 0:
+      return LogCommitPolicy::EveryTransaction();
+    case 1:
+      return LogCommitPolicy::BufferedBytes(4096);
+    case 2:
+      return LogCommitPolicy::Delay(1000);
+    default:
+      return LogCommitPolicy::Manual();
+  }
+}
+
+// Measures write transactions per second, each writing kStreamCount streams,
+// under the commit policies: 0 = every transaction, 1 = 4 KB buffered,
+// 2 = 1 s delay, 3 = manual (with Writer::sync() every 1024 transactions).
+void BM_WriteTransaction(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  Writer writer(&collection, policyFor(state.range(0)));
+  int64_t step = timestamp_increment(1, collection.resolution());
+  int64_t timestamp = 0;
+  for (auto _ : state) {
+    {
+      WriteTransaction tx(&writer);
+      for (int s = 0; s < kStreamCount; ++s) {
+        tx.write(timestamp, s * 7919, s);
+      }
+    }
+    timestamp += step;
+    if ((timestamp / step) % 1024 == 0) writer.sync();
+  }
+  writer.sync();
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Like BM_WriteTransaction, but writes all streams with a single
+// writeBatch() call.
+void BM_WriteBatch(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  Writer writer(&collection, policyFor(state.range(0)));
+  int64_t step = timestamp_increment(1, collection.resolution());
+  int64_t timestamp = 0;
+  uint64_t stream_ids[kStreamCount];
+  float values[kStreamCount];
+  for (int s = 0; s < kStreamCount; ++s) {
+    stream_ids[s] = s * 7919;
+    values[s] = s;
+  }
+  for (auto _ : state) {
+    {
+      WriteTransaction tx(&writer);
+      tx.writeBatch(timestamp, stream_ids, values, kStreamCount);
+    }
+    timestamp += step;
+    if ((timestamp / step) % 1024 == 0) writer.sync();
+  }
+  writer.sync();
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_WriteTransaction)->Arg(0)->Arg(1)->Arg(2)->Arg(3);
+BENCHMARK(BM_WriteBatch)->Arg(0)->Arg(1)->Arg(2)->Arg(3);
+
+}  // namespace
+}  // namespace roo_monitoring
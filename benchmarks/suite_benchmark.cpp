@@ -0,0 +1,287 @@
+// End-to-end benchmarks of the write, flush, compaction, and query paths.
+//
+// Every benchmark takes the filesystem backend as its first argument: 0 is
+// the in-memory fake filesystem; 1 is a real local directory, given by the
+// ROO_MONITORING_BENCH_DIR environment variable (default: /tmp). The latter
+// is only registered when built with -DROO_MONITORING_BENCH_REAL_FS.
+//
+// Besides time, the benchmarks report the bytes written per sample, as
+// counters. To record results for tracking over time, run with:
+//
+//   bazel run -c opt //benchmarks:suite_benchmark -- \
+//       --benchmark_out=suite.json --benchmark_out_format=json
+
+#include <stdlib.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+#include "roo_monitoring/vault_cache.h"
+
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+#include "roo_io/fs/posix/posix_filesystem.h"
+#endif
+
+namespace roo_monitoring {
+namespace {
+
+enum Backend { kFakeFs = 0, kRealDir = 1 };
+
+// Provides a fresh, empty filesystem for a benchmark run.
+class BenchFs {
+ public:
+  explicit BenchFs(int backend)
+      : backend_(backend),
+        fake_(new roo_io::fakefs::FakeReferenceFs(fake_fs_)) {
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+    if (backend_ == kRealDir) {
+      const char* dir = getenv("ROO_MONITORING_BENCH_DIR");
+      real_.reset(new roo_io::PosixFilesystem(dir != nullptr ? dir : "/tmp"));
+      clear();
+    }
+#endif
+  }
+
+  ~BenchFs() { clear(); }
+
+  roo_io::Filesystem& fs() {
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+    if (backend_ == kRealDir) return *real_;
+#endif
+    return *fake_;
+  }
+
+  // Returns the total size of the files under the specified directory.
+  uint64_t bytes(const String& dir) {
+    roo_io::Mount mount = fs().mount();
+    return walk(mount, std::string(dir.c_str()), false);
+  }
+
+ private:
+  void clear() {
+    if (backend_ != kRealDir) return;
+    roo_io::Mount mount = fs().mount();
+    walk(mount, kMonitoringBasePath, true);
+    mount.rmdir(kMonitoringBasePath);
+  }
+
+  // Sums up file sizes under path, optionally deleting them.
+  uint64_t walk(roo_io::Mount& mount, const std::string& path, bool remove) {
+    uint64_t total = 0;
+    std::vector<std::string> subdirs;
+    {
+      roo_io::Directory dir = mount.opendir(path.c_str());
+      if (!dir.isOpen()) return 0;
+      while (dir.read()) {
+        std::string name = dir.entry().name();
+        if (name == "." || name == "..") continue;
+        std::string child = path + "/" + name;
+        if (dir.entry().isDirectory()) {
+          subdirs.push_back(child);
+          continue;
+        }
+        total += mount.stat(child.c_str()).size();
+        if (remove) mount.remove(child.c_str());
+      }
+    }
+    for (const std::string& subdir : subdirs) {
+      total += walk(mount, subdir, remove);
+      if (remove) mount.rmdir(subdir.c_str());
+    }
+    return total;
+  }
+
+  int backend_;
+  roo_io::fakefs::FakeFs fake_fs_;
+  std::unique_ptr<roo_io::fakefs::FakeReferenceFs> fake_;
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+  std::unique_ptr<roo_io::PosixFilesystem> real_;
+#endif
+};
+
+String collectionDir(const Collection& collection) {
+  String result = kMonitoringBasePath;
+  result += "/";
+  result += collection.name();
+  return result;
+}
+
+String logDir(const Collection& collection) {
+  String result = collectionDir(collection);
+  result += "/";
+  result += kLogSubPath;
+  return result;
+}
+
+// Writes `steps` consecutive steps of `stream_count` streams, starting at
+// the specified step, and commits them.
+void writeSteps(Writer& writer, int64_t first_step, int64_t steps,
+                int stream_count) {
+  int64_t increment = timestamp_increment(1, writer.collection().resolution());
+  for (int64_t i = first_step; i < first_step + steps; ++i) {
+    WriteTransaction tx(&writer);
+    for (int s = 0; s < stream_count; ++s) {
+      tx.write(i * increment, s * 7919, (float)((i + s) % 100));
+    }
+  }
+  writer.sync();
+}
+
+// Write throughput, by stream count. Reports log bytes per sample.
+void BM_Write(benchmark::State& state) {
+  BenchFs bench_fs(state.range(0));
+  int stream_count = state.range(1);
+  Collection collection(bench_fs.fs(), "bench");
+  uint64_t samples = 0;
+  {
+    Writer writer(&collection, LogCommitPolicy::BufferedBytes(4096));
+    int64_t increment = timestamp_increment(1, collection.resolution());
+    int64_t timestamp = 0;
+    for (auto _ : state) {
+      WriteTransaction tx(&writer);
+      for (int s = 0; s < stream_count; ++s) {
+        tx.write(timestamp, s * 7919, s);
+      }
+      timestamp += increment;
+    }
+    samples = state.iterations() * stream_count;
+  }
+  state.SetItemsProcessed(samples);
+  state.counters["log_bytes_per_sample"] =
+      (double)bench_fs.bytes(logDir(collection)) / samples;
+}
+
+const int kFlushedRanges = 4;
+
+// Latency of flushAll() over kFlushedRanges ranges of logged data, by stream
+// count, with level-by-level or fused compaction. Reports vault bytes (all
+// levels) per logged sample, and files opened per range.
+void flushAll(benchmark::State& state, bool fused) {
+  int stream_count = state.range(1);
+  int64_t steps = kFlushedRanges * kRangeElementCount;
+  uint64_t vault_bytes = 0;
+  uint64_t files_opened = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    BenchFs bench_fs(state.range(0));
+    Collection collection(bench_fs.fs(), "bench");
+    std::unique_ptr<Writer> writer(new Writer(&collection));
+    if (fused) writer->enableFusedCompaction();
+    // One more step, so that the last range is historical.
+    writeSteps(*writer, 0, steps + 1, stream_count);
+    state.ResumeTiming();
+
+    writer->flushAll();
+
+    state.PauseTiming();
+    // Vault files of all levels, but not the remaining (hot) log file.
+    vault_bytes = bench_fs.bytes(collectionDir(collection)) -
+                  bench_fs.bytes(logDir(collection));
+    files_opened += writer->stats().files_opened;
+    writer.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * steps * stream_count);
+  state.counters["vault_bytes_per_sample"] =
+      (double)vault_bytes / (steps * stream_count);
+  state.counters["files_opened_per_range"] =
+      (double)files_opened / (state.iterations() * kFlushedRanges);
+}
+
+void BM_FlushAll(benchmark::State& state) { flushAll(state, false); }
+
+// The first range is still compacted level by level; the others are not.
+void BM_FlushAllFused(benchmark::State& state) { flushAll(state, true); }
+
+// Cost of a single flush step at the specified level, for a single range
+// of 64 streams: level 0 writes the log data into the base vault file; level
+// N compacts level N-1 into level N.
+void BM_FlushLevel(benchmark::State& state) {
+  int level = state.range(1);
+  for (auto _ : state) {
+    state.PauseTiming();
+    BenchFs bench_fs(state.range(0));
+    Collection collection(bench_fs.fs(), "bench");
+    std::unique_ptr<Writer> writer(new Writer(&collection));
+    writeSteps(*writer, 0, kRangeElementCount + 1, 64);
+    for (int i = 0; i < level; ++i) writer->flushSome();
+    state.ResumeTiming();
+
+    writer->flushSome();
+
+    state.PauseTiming();
+    writer.reset();
+    state.ResumeTiming();
+  }
+}
+
+// VaultIterator scan throughput over kFlushedRanges base-level vault files,
+// by stream count. With a vault cache, repeated scans (e.g. dashboard
+// refreshes) are served from decoded files.
+void scan(benchmark::State& state, bool cached) {
+  BenchFs bench_fs(state.range(0));
+  int stream_count = state.range(1);
+  Collection collection(bench_fs.fs(), "bench");
+  if (cached) collection.enableVaultCache(16 << 20);
+  int64_t steps = kFlushedRanges * kRangeElementCount;
+  {
+    Writer writer(&collection);
+    writeSteps(writer, 0, steps + 1, stream_count);
+    writer.flushAll();
+  }
+  std::vector<Sample> samples;
+  size_t total = 0;
+  for (auto _ : state) {
+    VaultIterator it(&collection, 0, collection.resolution());
+    for (int64_t i = 0; i < steps; ++i) {
+      it.next(&samples);
+      total += samples.size();
+    }
+  }
+  benchmark::DoNotOptimize(total);
+  state.SetItemsProcessed(state.iterations() * steps * stream_count);
+  if (cached) {
+    state.counters["cache_hit_rate"] = collection.vault_cache()->hit_rate();
+  }
+}
+
+void BM_Scan(benchmark::State& state) { scan(state, false); }
+
+void BM_ScanCached(benchmark::State& state) { scan(state, true); }
+
+void backends(benchmark::internal::Benchmark* b,
+              const std::vector<int64_t>& args) {
+  std::vector<int> backends = {kFakeFs};
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+  backends.push_back(kRealDir);
+#endif
+  for (int backend : backends) {
+    for (int64_t arg : args) b->Args({backend, arg});
+  }
+}
+
+BENCHMARK(BM_Write)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {1, 10, 100, 1000});
+});
+BENCHMARK(BM_FlushAll)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {1, 10, 100});
+});
+BENCHMARK(BM_FlushAllFused)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {1, 10, 100});
+});
+BENCHMARK(BM_FlushLevel)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {0, 1, 2, 3, 4});
+});
+BENCHMARK(BM_Scan)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {1, 10, 100});
+});
+BENCHMARK(BM_ScanCached)->Apply([](benchmark::internal::Benchmark* b) {
+  backends(b, {1, 10, 100});
+});
+
+}  // namespace
+}  // namespace roo_monitoring
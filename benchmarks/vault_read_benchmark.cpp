@@ -0,0 +1,189 @@
+// Vault read benchmarks. The mapped vs stream scan benchmarks read from a
+// real local directory, given by the ROO_MONITORING_BENCH_DIR environment
+// variable (default: /tmp), and are only registered when built with
+// -DROO_MONITORING_BENCH_REAL_FS.
+
+#include <stdlib.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "fakefs_reference.h"
+#include "roo_monitoring.h"
+#include "roo_monitoring/compaction.h"
+
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+#include "roo_io/fs/posix/posix_filesystem.h"
+#endif
+
+namespace roo_monitoring {
+namespace {
+
+const int kFileCount = 4;
+const int kQueriedStreams = 4;
+
+// Populates a collection with kFileCount finished vault files, each holding
+// `stream_count` streams reporting at every step.
+void populate(Collection& collection, int stream_count) {
+  VaultFileRef ref = VaultFileRef::Lookup(0, collection.resolution());
+  for (int f = 0; f < kFileCount; ++f) {
+    VaultWriter writer(&collection, ref.advance(f));
+    writer.openNew();
+    std::vector<LogSample> data;
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      data.clear();
+      for (int s = 0; s < stream_count; ++s) {
+        data.emplace_back(s * 7919, i + s);
+      }
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+}
+
+int64_t rangeEnd(const Collection& collection) {
+  return VaultFileRef::Lookup(0, collection.resolution())
+      .advance(kFileCount)
+      .timestamp();
+}
+
+std::vector<uint64_t> queriedStreams() {
+  std::vector<uint64_t> result;
+  for (int s = 0; s < kQueriedStreams; ++s) result.push_back(s * 7919);
+  return result;
+}
+
+void BM_VaultIteratorNext(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  populate(collection, state.range(0));
+  int64_t end = rangeEnd(collection);
+  int64_t step = timestamp_increment(1, collection.resolution());
+  std::vector<uint64_t> streams = queriedStreams();
+  std::vector<uint16_t> avg(kFileCount * kRangeElementCount * streams.size());
+  std::vector<Sample> samples;
+  for (auto _ : state) {
+    VaultIterator it(&collection, 0, collection.resolution());
+    size_t n = 0;
+    for (int64_t t = 0; t < end; t += step, ++n) {
+      it.next(&samples);
+      for (const Sample& sample : samples) {
+        for (size_t s = 0; s < streams.size(); ++s) {
+          if (sample.stream_id() == streams[s]) {
+            avg[s * kFileCount * kRangeElementCount + n] = sample.avg_value();
+          }
+        }
+      }
+    }
+    benchmark::DoNotOptimize(avg.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kFileCount *
+                          kRangeElementCount);
+}
+
+// Same as BM_VaultIteratorNext, but with the iterator restricted to the
+// queried streams, so that the samples of others are skipped over.
+void BM_VaultIteratorNextFiltered(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  populate(collection, state.range(0));
+  int64_t end = rangeEnd(collection);
+  int64_t step = timestamp_increment(1, collection.resolution());
+  std::vector<uint64_t> streams = queriedStreams();
+  std::vector<uint16_t> avg(kFileCount * kRangeElementCount * streams.size());
+  std::vector<Sample> samples;
+  for (auto _ : state) {
+    VaultIterator it(&collection, 0, collection.resolution(), streams);
+    size_t n = 0;
+    for (int64_t t = 0; t < end; t += step, ++n) {
+      it.next(&samples);
+      for (const Sample& sample : samples) {
+        for (size_t s = 0; s < streams.size(); ++s) {
+          if (sample.stream_id() == streams[s]) {
+            avg[s * kFileCount * kRangeElementCount + n] = sample.avg_value();
+          }
+        }
+      }
+    }
+    benchmark::DoNotOptimize(avg.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kFileCount *
+                          kRangeElementCount);
+}
+
+void BM_VaultIteratorReadRange(benchmark::State& state) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "bench");
+  populate(collection, state.range(0));
+  int64_t end = rangeEnd(collection);
+  SampleColumns columns(queriedStreams(), kFileCount * kRangeElementCount);
+  for (auto _ : state) {
+    VaultIterator it(&collection, 0, collection.resolution());
+    it.readRange(end, &columns);
+    benchmark::DoNotOptimize(columns.avg(0));
+  }
+  state.SetItemsProcessed(state.iterations() * kFileCount *
+                          kRangeElementCount);
+}
+
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+
+// Removes the files written by populate(), and their (then empty)
+// directories.
+void depopulate(Collection& collection) {
+  roo_io::Mount mount = collection.fs().mount();
+  VaultFileRef ref = VaultFileRef::Lookup(0, collection.resolution());
+  std::string path;
+  for (int f = 0; f < kFileCount; ++f) {
+    FilePath file;
+    collection.getVaultFilePath(ref.advance(f), &file);
+    mount.remove(file.c_str());
+    path = file.c_str();
+  }
+  for (size_t i = path.rfind('/'); i != 0 && i != std::string::npos;
+       i = path.rfind('/')) {
+    path.resize(i);
+    mount.rmdir(path.c_str());
+  }
+}
+
+// Decodes all entries of the finished vault files, with mapped reads
+// disabled (arg 0) or enabled (arg 1). Reports the decoded bytes per second.
+void BM_VaultScan(benchmark::State& state) {
+  const char* dir = getenv("ROO_MONITORING_BENCH_DIR");
+  if (dir == nullptr) dir = "/tmp";
+  roo_io::PosixFilesystem fs(dir);
+  Collection collection(fs, "bench");
+  if (state.range(0) == 1) collection.enableMappedReads(dir);
+  populate(collection, state.range(1));
+  VaultFileRef first = VaultFileRef::Lookup(0, collection.resolution());
+  VaultFileReader reader(&collection);
+  std::vector<Sample> samples;
+  for (auto _ : state) {
+    for (int f = 0; f < kFileCount; ++f) {
+      reader.open(first.advance(f), 0, 0);
+      while (!reader.past_eof() && reader.next(&samples)) {
+        benchmark::DoNotOptimize(samples.data());
+      }
+    }
+  }
+  state.SetBytesProcessed(reader.stats().bytes_read);
+  depopulate(collection);
+}
+
+#endif  // ROO_MONITORING_BENCH_REAL_FS
+
+BENCHMARK(BM_VaultIteratorNext)->Arg(8)->Arg(64)->Arg(256);
+BENCHMARK(BM_VaultIteratorNextFiltered)->Arg(8)->Arg(64)->Arg(256);
+BENCHMARK(BM_VaultIteratorReadRange)->Arg(8)->Arg(64)->Arg(256);
+#ifdef ROO_MONITORING_BENCH_REAL_FS
+BENCHMARK(BM_VaultScan)->ArgsProduct({{0, 1}, {8, 64, 256}});
+#endif
+
+}  // namespace
+}  // namespace roo_monitoring
@@ -9,30 +9,97 @@
 #include <set>
 
 #include "roo_io/fs/filesystem.h"
+#include "roo_monitoring/columns.h"
 #include "roo_monitoring/common.h"
+#include "roo_monitoring/ingest.h"
 #include "roo_monitoring/log.h"
+#include "roo_monitoring/query.h"
 #include "roo_monitoring/resolution.h"
 #include "roo_monitoring/sample.h"
+#include "roo_monitoring/stats.h"
+#include "roo_monitoring/stream_filter.h"
 #include "roo_monitoring/transform.h"
 #include "roo_monitoring/vault.h"
 
 namespace roo_monitoring {
 
+class DecodedVaultFile;
+class Manifest;
+class VaultCache;
+
 /// Collection of timeseries sharing transform and source resolution.
 ///
 /// Group streams that are commonly queried/plotted together.
 class Collection {
  public:
+  /// Creates a collection stored in `/monitoring/<name>`. A name too long
+  /// for the file paths to fit in `FilePath` is truncated, and suffixed with
+  /// its hash.
   Collection(roo_io::Filesystem& fs, String name,
              Resolution resolution = kResolution_1024_ms);
 
+  ~Collection();
+
   roo_io::Filesystem& fs() const { return fs_; }
   const String& name() const { return name_; }
   Resolution resolution() const { return resolution_; }
   const Transform& transform() const { return transform_; }
 
+  /// Sets `path` to the path of the specified vault file. Does not allocate.
+  void getVaultFilePath(const VaultFileRef& ref, FilePath* path) const;
+
+  /// Same as above, but sets a `String`, allocating.
   void getVaultFilePath(const VaultFileRef& ref, String* path) const;
 
+  /// Enables caching of decoded vault files read by `VaultIterator`s, using
+  /// at most max_bytes of memory. Replaces any previous cache.
+  ///
+  /// Useful when the same time windows are queried repeatedly, e.g. by
+  /// periodically refreshed dashboards.
+  void enableVaultCache(size_t max_bytes);
+
+  /// Returns the vault cache, or nullptr if not enabled. Include
+  /// "roo_monitoring/vault_cache.h" to use it.
+  VaultCache* vault_cache() const { return vault_cache_.get(); }
+
+  /// Enables the persistent manifest of the collection's files (see
+  /// `Manifest`), loading it, or building it if it does not exist yet.
+  ///
+  /// Must be called before any `Writer` is created for the collection.
+  roo_io::Status enableManifest();
+
+  /// Returns the manifest, or nullptr if not enabled. Include
+  /// "roo_monitoring/manifest.h" to use it.
+  Manifest* manifest() const { return manifest_.get(); }
+
+  /// Enables reading finished vault files through read-only memory
+  /// mappings, decoding entries straight from the mapped bytes. host_root is
+  /// the host directory that the collection's filesystem is mounted at (e.g.
+  /// the root of a `roo_io::PosixFilesystem`), so that the file at path
+  /// `/monitoring/...` is `<host_root>/monitoring/...` on the host.
+  ///
+  /// Hot (unfinished) files, and files that cannot be mapped (e.g. on hosts
+  /// without mmap), are read through the filesystem as usual. Finished files
+  /// must not be rewritten or truncated while mapped.
+  void enableMappedReads(const char* host_root);
+
+  /// Returns the host root for mapped reads, or nullptr if not enabled.
+  const char* mapped_reads_root() const {
+    return mapped_reads_root_.length() == 0 ? nullptr
+                                            : mapped_reads_root_.c_str();
+  }
+
+  /// Enables compression of the vault files created from now on (format
+  /// 1.7): sample values are delta-encoded against the previous entries of
+  /// the same stream, and min, max and fill are omitted when trivial. Vault
+  /// files shrink several-fold for slowly changing signals, at the cost of
+  /// decoding up to 15 preceding entries when seeking, and of parsing all
+  /// samples when filtering by stream. Existing files keep their format.
+  void enableVaultCompression() { vault_compression_ = true; }
+
+  /// Returns true if new vault files are compressed.
+  bool vault_compression() const { return vault_compression_; }
+
  private:
   friend class Writer;
   friend class WriteTransaction;
@@ -42,11 +109,81 @@ class Collection {
   String base_dir_;
   Resolution resolution_;
   Transform transform_;
+  std::unique_ptr<VaultCache> vault_cache_;
+  std::unique_ptr<Manifest> manifest_;
+  String mapped_reads_root_;
+  bool vault_compression_;
 };
 
 class LogReader;
 class LogFileReader;
 class VaultWriter;
+class VaultWriteHistory;
+class FusedCompaction;
+
+/// Limits the amount of work done by a single `Writer::flushFor()` call.
+///
+/// The budget is checked at safe points, i.e. after each vault entry written,
+/// so it may be slightly exceeded.
+class FlushBudget {
+ public:
+  /// Budget of wall time, in milliseconds, starting now.
+  static FlushBudget Millis(uint32_t max_ms) {
+    return FlushBudget(max_ms, kUnlimited);
+  }
+
+  /// Budget of bytes written to vault files.
+  static FlushBudget Bytes(uint32_t max_bytes) {
+    return FlushBudget(kUnlimited, max_bytes);
+  }
+
+  /// Budget that is exhausted when either limit is reached.
+  static FlushBudget MillisOrBytes(uint32_t max_ms, uint32_t max_bytes) {
+    return FlushBudget(max_ms, max_bytes);
+  }
+
+  /// Records that the specified number of bytes has been written.
+  void consume(uint32_t bytes) { bytes_written_ += bytes; }
+
+  /// Returns the number of bytes written so far.
+  uint32_t bytes_written() const { return bytes_written_; }
+
+  /// Returns true if no more work should be done.
+  bool exhausted() const;
+
+ private:
+  static constexpr uint32_t kUnlimited = 0xFFFFFFFF;
+
+  FlushBudget(uint32_t max_ms, uint32_t max_bytes);
+
+  unsigned long start_ms_;
+  uint32_t max_ms_;
+  uint32_t max_bytes_;
+  uint32_t bytes_written_;
+};
+
+/// Describes the flush work that remains to be done.
+class FlushBacklog {
+ public:
+  FlushBacklog(size_t log_files, bool in_progress)
+      : log_files_(log_files), in_progress_(in_progress) {}
+
+  /// Returns the number of log files, other than the one currently being
+  /// written to, that are waiting to be flushed into the vault.
+  size_t log_files() const { return log_files_; }
+
+  /// Returns true if a flush has been started (or interrupted) and not yet
+  /// completed.
+  bool in_progress() const { return in_progress_; }
+
+  /// Returns true if all data, except the (hot) data in the current log file,
+  /// has been flushed.
+  bool empty() const { return log_files_ == 0 && !in_progress_; }
+
+ private:
+  size_t log_files_;
+  bool in_progress_;
+};
 
 /// Write interface for a monitoring collection.
 class Writer {
@@ -55,27 +192,76 @@ class Writer {
 
   enum IoState { IOSTATE_OK, IOSTATE_ERROR };
 
-  Writer(Collection* collection);
+  /// Creates a writer for the collection.
+  ///
+  /// The policy determines when the written data is committed to the log
+  /// file; see `LogCommitPolicy` for the durability guarantees.
+  Writer(Collection* collection,
+         LogCommitPolicy policy = LogCommitPolicy::EveryTransaction());
+
+  ~Writer();
 
   const Collection& collection() const { return *collection_; }
 
+  /// Commits all data written so far to the log file.
+  ///
+  /// Once this method returns, the data survives a reset or a power loss.
+  /// Returns false on I/O error.
+  bool sync();
+
   /// Periodically flushes logged data into vault files.
+  ///
+  /// Commits all buffered log data first.
   void flushAll();
 
   IoState io_state() const { return io_state_; }
 
   void flushSome();
 
+  /// Flushes logged data into vault files, until there is nothing more to
+  /// flush, or until the budget is exhausted.
+  ///
+  /// An interrupted flush leaves compaction cursors behind, and is resumed by
+  /// the next call to `flushFor()`, `flushSome()`, or `flushAll()`. Returns
+  /// the work that remains to be done.
+  FlushBacklog flushFor(FlushBudget budget);
+
+  /// Returns the flush work that remains to be done.
+  FlushBacklog backlog();
+
+  /// Returns the counters and latency histograms of this writer.
+  WriterStats stats() const;
+
   bool isFlushInProgress() { return flush_in_progress_; }
 
+  /// Enables fused compaction: the ancestor levels are compacted in the same
+  /// pass that writes log data into the base vault level (see
+  /// `FusedCompaction`), instead of one level per `flushSome()` call, each
+  /// reading back its child level and writing a compaction cursor.
+  ///
+  /// The first range flushed after this call (or after an I/O error, or a
+  /// gap in the log) is still compacted level by level, to bring the
+  /// in-memory state in sync with the vault files.
+  void enableFusedCompaction();
+
  private:
   friend class WriteTransaction;
 
-  /// Writes logs to vault and returns past-end index written.
-  int16_t writeToVault(roo_io::Mount& fs, LogReader& reader, VaultFileRef ref);
+  /// Writes logs to vault, and sets the compaction head to the vault file
+  /// and past-end index written. Returns IN_PROGRESS if interrupted due to
+  /// an exhausted budget.
+  Status writeToVault(roo_io::Mount& fs, LogReader& reader);
 
   Status compactVaultOneLevel();
 
+  // Charges the vault bytes written (as a running total) since the last call
+  // to the current flush budget. Returns true if the budget is exhausted.
+  bool chargeBudget(uint32_t bytes_written, uint32_t* charged);
+
+  // Syncs the fused compaction with the vault files, once they have been
+  // compacted level by level up to flushed_until_.
+  void startFusedCompaction(roo_io::Mount& fs);
+
   Collection* collection_;
   String log_dir_;
   CachedLogDir cache_;
@@ -87,21 +273,60 @@ class Writer {
   bool is_hot_range_;
 
   bool flush_in_progress_;
+
+  // Timestamp of the next entry to be written to the base vault level.
+  int64_t flushed_until_;
+
+  // Null unless enabled.
+  std::unique_ptr<FusedCompaction> fused_;
+
+  // Whether the ancestors of the range being flushed have been compacted
+  // along with it, by fused_.
+  bool compaction_fused_;
+
+  // Whether the write of log data into the base vault file, or the
+  // compaction of the current level, has been interrupted and needs to be
+  // resumed.
+  bool base_write_paused_;
+  bool compaction_paused_;
+
+  // State of the vault files last written, shared by the vault writers.
+  std::unique_ptr<VaultWriteHistory> vault_history_;
+
+  // Budget of the current flushFor() call, or nullptr if unlimited.
+  FlushBudget* budget_;
+
+  // Log writer counters are kept by writer_, and merged in stats().
+  WriterStats stats_;
 };
 
 /// Represents a single write operation to a monitoring collection.
 ///
-/// Intended as a transient RAII object; commit happens on destruction.
+/// Intended as a transient RAII object. On destruction, the written data is
+/// committed to the log file if the writer's `LogCommitPolicy` says so.
 class WriteTransaction {
  public:
   WriteTransaction(Writer* writer);
   ~WriteTransaction();
 
+  /// Writes a single sample. Samples with a timestamp earlier than one
+  /// already written are dropped, and counted in
+  /// `WriterStats::samples_dropped`.
   void write(int64_t timestamp, uint64_t stream_id, float data);
 
+  /// Writes values of `count` streams, all at the same timestamp.
+  ///
+  /// Equivalent to calling `write()` for each (stream_ids[i], data[i]) pair,
+  /// but rounds the timestamp once, transforms the values in a single
+  /// vectorizable pass, and emits a single timestamp record followed by all
+  /// the data records.
+  void writeBatch(int64_t timestamp, const uint64_t* stream_ids,
+                  const float* data, size_t count);
+
  private:
   const Transform* transform_;
   LogWriter* writer_;
+  WriterStats* stats_;
 };
 
 /// Iterator that scans monitoring data at a given resolution.
@@ -116,16 +341,55 @@ class VaultIterator {
   VaultIterator(const Collection* collection, int64_t start,
                 Resolution resolution);
 
+  /// Same as above, but `next()` returns only the samples of the specified
+  /// streams. The samples of other streams are skipped over without being
+  /// decoded; in vault files of format 1.5 or newer, without even being
+  /// read, so that the cost of a query is roughly proportional to the data
+  /// it returns.
+  VaultIterator(const Collection* collection, int64_t start,
+                Resolution resolution, std::vector<uint64_t> stream_ids);
+
   /// Returns current iterator timestamp.
   int64_t cursor() const;
 
-  /// Advances by one resolution step and fills `sample`.
+  /// Advances by one resolution step and fills `sample` (with the samples of
+  /// the requested streams, if specified).
   void next(std::vector<Sample>* sample);
 
+  /// Reads consecutive steps, starting at the cursor and ending before `end`,
+  /// into the columnar buffer.
+  ///
+  /// Clears the buffer, and reads at most `columns->capacity()` steps. Decodes
+  /// only the streams requested by the buffer. Returns the number of steps
+  /// read; if it is smaller than requested, call again to continue.
+  size_t readRange(int64_t end, SampleColumns* columns);
+
+  /// Returns the counters of vault reads done by this iterator.
+  ///
+  /// Reads served from the collection's vault cache are not counted.
+  const VaultReadStats& stats() const { return current_.stats(); }
+
  private:
+  // Opens the vault file current_ref_, positioned at the specified index.
+  void open(int index);
+
+  // Advances to the next vault file, if the current one has been read.
+  void maybeAdvance();
+
+  // Returns the index of the next entry within the current vault file.
+  int index() const;
+
   const Collection* collection_;
   VaultFileRef current_ref_;
   VaultFileReader current_;
+
+  // The current vault file, if read through the collection's vault cache.
+  std::shared_ptr<const DecodedVaultFile> cached_;
+  bool use_cache_;
+  int cached_index_;
+
+  // Null unless restricted to specific streams.
+  std::unique_ptr<StreamFilter> filter_;
 };
 
 }  // namespace roo_monitoring
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "columns.h"
+
+#include <algorithm>
+
+namespace roo_monitoring {
+
+SampleColumns::SampleColumns(std::vector<uint64_t> stream_ids, size_t capacity)
+    : stream_ids_(std::move(stream_ids)),
+      capacity_(capacity),
+      size_(0),
+      timestamps_(capacity),
+      avg_(capacity * stream_ids_.size()),
+      min_(capacity * stream_ids_.size()),
+      max_(capacity * stream_ids_.size()),
+      fill_(capacity * stream_ids_.size()) {
+  lookup_.reserve(stream_ids_.size());
+  for (size_t i = 0; i < stream_ids_.size(); ++i) {
+    lookup_.emplace_back(stream_ids_[i], i);
+  }
+  std::sort(lookup_.begin(), lookup_.end());
+}
+
+int SampleColumns::find(uint64_t stream_id) const {
+  auto i = std::lower_bound(
+      lookup_.begin(), lookup_.end(), stream_id,
+      [](const std::pair<uint64_t, int>& a, uint64_t b) { return a.first < b; });
+  if (i == lookup_.end() || i->first != stream_id) return -1;
+  return i->second;
+}
+
+size_t SampleColumns::appendEmpty(int64_t timestamp) {
+  size_t step = size_++;
+  timestamps_[step] = timestamp;
+  for (size_t i = step; i < avg_.size(); i += capacity_) {
+    avg_[i] = 0;
+    min_[i] = 0;
+    max_[i] = 0;
+    fill_[i] = 0;
+  }
+  return step;
+}
+
+}  // namespace roo_monitoring
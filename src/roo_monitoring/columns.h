@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+namespace roo_monitoring {
+
+/// Columnar (structure-of-arrays) buffer of samples for a set of streams.
+///
+/// Holds up to `capacity` consecutive time steps. For every step, it stores
+/// the timestamp, and for every requested stream, the avg, min, max, and fill
+/// values. Streams that have no data at a given step have all values set to
+/// zero (in particular, zero fill).
+///
+/// Intended to be allocated once and reused across reads; see
+/// `VaultIterator::readRange()`.
+class SampleColumns {
+ public:
+  /// Creates a buffer for the specified streams and maximum step count.
+  SampleColumns(std::vector<uint64_t> stream_ids, size_t capacity);
+
+  /// Returns the number of streams (columns).
+  size_t stream_count() const { return stream_ids_.size(); }
+
+  /// Returns the stream identifier of the specified column.
+  uint64_t stream_id(size_t column) const { return stream_ids_[column]; }
+
+  /// Returns the maximum number of steps that fit in the buffer.
+  size_t capacity() const { return capacity_; }
+
+  /// Returns the number of steps currently in the buffer.
+  size_t size() const { return size_; }
+
+  /// Returns the timestamps of the steps in the buffer.
+  const int64_t* timestamps() const { return timestamps_.data(); }
+
+  /// Returns the average values for the specified column.
+  const uint16_t* avg(size_t column) const {
+    return &avg_[column * capacity_];
+  }
+  /// Returns the minimum values for the specified column.
+  const uint16_t* min(size_t column) const {
+    return &min_[column * capacity_];
+  }
+  /// Returns the maximum values for the specified column.
+  const uint16_t* max(size_t column) const {
+    return &max_[column * capacity_];
+  }
+  /// Returns the fill values (0x2000 == 100%) for the specified column.
+  const uint16_t* fill(size_t column) const {
+    return &fill_[column * capacity_];
+  }
+
+  /// Removes all steps from the buffer.
+  void clear() { size_ = 0; }
+
+  /// Returns the column of the specified stream, or -1 if not requested.
+  int find(uint64_t stream_id) const;
+
+  /// Appends a step with no data at the specified timestamp, and returns
+  /// its index.
+  size_t appendEmpty(int64_t timestamp);
+
+  /// Sets the values of the specified column at the specified step.
+  void set(size_t column, size_t step, uint16_t avg, uint16_t min,
+           uint16_t max, uint16_t fill) {
+    size_t i = column * capacity_ + step;
+    avg_[i] = avg;
+    min_[i] = min;
+    max_[i] = max;
+    fill_[i] = fill;
+  }
+
+ private:
+  std::vector<uint64_t> stream_ids_;
+
+  // Pairs of (stream_id, column), sorted by stream_id.
+  std::vector<std::pair<uint64_t, int>> lookup_;
+
+  size_t capacity_;
+  size_t size_;
+  std::vector<int64_t> timestamps_;
+  std::vector<uint16_t> avg_;
+  std::vector<uint16_t> min_;
+  std::vector<uint16_t> max_;
+  std::vector<uint16_t> fill_;
+};
+
+}  // namespace roo_monitoring
@@ -1,5 +1,7 @@
 #include "common.h"
 
+#include <string.h>
+
 #include <algorithm>
 #include <memory>
 
@@ -16,10 +18,28 @@ String subdir(String base, const String& sub) {
   return base;
 }
 
-String filepath(String dir, int64_t file) {
-  dir += "/";
-  dir += Filename::forTimestamp(file).filename();
-  return dir;
+FilePath& FilePath::append(const char* str) {
+  size_t len = strlen(str);
+  CHECK_LE(size_ + len, kCapacity) << "Path too long: " << data_ << str;
+  memcpy(data_ + size_, str, len + 1);
+  size_ += len;
+  return *this;
+}
+
+FilePath& FilePath::append(char c) {
+  CHECK_LT(size_, kCapacity) << "Path too long: " << data_ << c;
+  data_[size_++] = c;
+  data_[size_] = 0;
+  return *this;
+}
+
+FilePath& FilePath::appendFilename(int64_t timestamp) {
+  append('/');
+  return append(Filename::forTimestamp(timestamp).filename());
+}
+
+FilePath filepath(const char* dir, int64_t file) {
+  return FilePath(dir).appendFilename(file);
 }
 
 namespace {
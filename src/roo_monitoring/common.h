@@ -33,8 +33,49 @@ inline constexpr char toHexDigit(int d) {
 
 /// Returns a path formed by joining the base directory and subdirectory.
 String subdir(String base, const String& sub);
+
+/// Fixed-capacity, null-terminated file path, built without heap
+/// allocations.
+///
+/// All paths used by the library are bounded: the collection base directory,
+/// plus `/vault-XX/`, two 12-character hex names, and the `.cursor` suffix.
+/// Appending past the capacity is a fatal error.
+class FilePath {
+ public:
+  /// Maximum path length, not counting the terminating null.
+  static constexpr size_t kCapacity = 127;
+
+  /// Maximum length of a collection base directory, so that all of its file
+  /// paths fit.
+  static constexpr size_t kMaxBaseDirLength = kCapacity - 42;
+
+  FilePath() : size_(0) { data_[0] = 0; }
+
+  explicit FilePath(const char* path) : FilePath() { append(path); }
+
+  /// Appends the specified string.
+  FilePath& append(const char* str);
+
+  /// Appends a single character.
+  FilePath& append(char c);
+
+  /// Appends a `/`, followed by the 12-character hex name of the specified
+  /// timestamp (see `Filename`).
+  FilePath& appendFilename(int64_t timestamp);
+
+  /// Returns the path as a null-terminated string.
+  const char* c_str() const { return data_; }
+
+  /// Returns the path length.
+  size_t size() const { return size_; }
+
+ private:
+  char data_[kCapacity + 1];
+  size_t size_;
+};
+
 /// Returns a file path for the given directory and timestamp-like value.
-String filepath(String dir, int64_t file);
+FilePath filepath(const char* dir, int64_t file);
 
 /// Lists timestamp-named files in the directory and returns their timestamps.
 ///
@@ -1,32 +1,141 @@
 #include "compaction.h"
 
+#include <stddef.h>
+
+#include <algorithm>
+#include <utility>
+
 #include "common.h"
+#include "manifest.h"
+#include "roo_io/data/input_stream_reader.h"
+#include "roo_io/data/multipass_input_stream_reader.h"
 #include "roo_io/data/output_stream_writer.h"
 #include "roo_io/fs/fsutil.h"
 #include "roo_logging.h"
+#include "vault_cache.h"
 
 #ifndef MLOG_roo_monitoring_compaction
 #define MLOG_roo_monitoring_compaction 0
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ROO_MONITORING_AGGREGATE_SSE41 1
+#include <immintrin.h>
+#else
+#define ROO_MONITORING_AGGREGATE_SSE41 0
+#endif
+
 namespace roo_monitoring {
 
+#if ROO_MONITORING_AGGREGATE_SSE41
+
+// The kernel loads samples as 16 bytes, and takes the upper 8 bytes as the
+// avg, min, max, and fill, in this order.
+struct SampleLayout {
+  static_assert(sizeof(Sample) == 16, "Unexpected Sample layout");
+  static_assert(offsetof(Sample, stream_id_) == 0, "Unexpected Sample layout");
+  static_assert(offsetof(Sample, avg_value_) == 8, "Unexpected Sample layout");
+  static_assert(offsetof(Sample, min_value_) == 10, "Unexpected Sample layout");
+  static_assert(offsetof(Sample, max_value_) == 12, "Unexpected Sample layout");
+  static_assert(offsetof(Sample, fill_) == 14, "Unexpected Sample layout");
+};
+
+#endif  // ROO_MONITORING_AGGREGATE_SSE41
+
+namespace {
+
+// Number of streams aggregated at a time by the vectorized kernel.
+static const size_t kAggregateBlock = 8;
+
+// Aggregates of a block of streams, in columnar form.
+struct AggregateBlock {
+  uint32_t weighted_total[kAggregateBlock];
+  uint16_t weight[kAggregateBlock];
+  uint16_t min_value[kAggregateBlock];
+  uint16_t max_value[kAggregateBlock];
+};
+
+#if ROO_MONITORING_AGGREGATE_SSE41
+
+// Aggregates samples [begin, begin + kAggregateBlock) of the four entries.
+__attribute__((target("sse4.1"))) void aggregate_block_sse41(
+    const Sample* const* entries, size_t begin, AggregateBlock* out) {
+  __m128i total_lo = _mm_setzero_si128();
+  __m128i total_hi = _mm_setzero_si128();
+  __m128i weight = _mm_setzero_si128();
+  __m128i min_value = _mm_set1_epi16(-1);
+  __m128i max_value = _mm_setzero_si128();
+  for (int c = 0; c < 4; ++c) {
+    const __m128i* in = (const __m128i*)(entries[c] + begin);
+    // Gathers the (avg, min, max, fill) of two samples per register, and
+    // transposes them into (avg[8], min[8], max[8], fill[8]).
+    __m128i p01 = _mm_unpackhi_epi64(_mm_loadu_si128(in + 0),
+                                     _mm_loadu_si128(in + 1));
+    __m128i p23 = _mm_unpackhi_epi64(_mm_loadu_si128(in + 2),
+                                     _mm_loadu_si128(in + 3));
+    __m128i p45 = _mm_unpackhi_epi64(_mm_loadu_si128(in + 4),
+                                     _mm_loadu_si128(in + 5));
+    __m128i p67 = _mm_unpackhi_epi64(_mm_loadu_si128(in + 6),
+                                     _mm_loadu_si128(in + 7));
+    __m128i t0 = _mm_unpacklo_epi16(p01, p23);
+    __m128i t1 = _mm_unpackhi_epi16(p01, p23);
+    __m128i t2 = _mm_unpacklo_epi16(p45, p67);
+    __m128i t3 = _mm_unpackhi_epi16(p45, p67);
+    __m128i avg_min_lo = _mm_unpacklo_epi16(t0, t1);
+    __m128i max_fill_lo = _mm_unpackhi_epi16(t0, t1);
+    __m128i avg_min_hi = _mm_unpacklo_epi16(t2, t3);
+    __m128i max_fill_hi = _mm_unpackhi_epi16(t2, t3);
+    __m128i avg = _mm_unpacklo_epi64(avg_min_lo, avg_min_hi);
+    __m128i min = _mm_unpackhi_epi64(avg_min_lo, avg_min_hi);
+    __m128i max = _mm_unpacklo_epi64(max_fill_lo, max_fill_hi);
+    __m128i fill = _mm_unpackhi_epi64(max_fill_lo, max_fill_hi);
+
+    // Samples with zero fill do not contribute to min and max.
+    __m128i empty = _mm_cmpeq_epi16(fill, _mm_setzero_si128());
+    min_value = _mm_min_epu16(min_value, _mm_or_si128(min, empty));
+    max_value = _mm_max_epu16(max_value, _mm_andnot_si128(empty, max));
+    weight = _mm_add_epi16(weight, fill);
+    __m128i product_lo = _mm_mullo_epi16(avg, fill);
+    __m128i product_hi = _mm_mulhi_epu16(avg, fill);
+    total_lo = _mm_add_epi32(total_lo,
+                             _mm_unpacklo_epi16(product_lo, product_hi));
+    total_hi = _mm_add_epi32(total_hi,
+                             _mm_unpackhi_epi16(product_lo, product_hi));
+  }
+  _mm_storeu_si128((__m128i*)&out->weighted_total[0], total_lo);
+  _mm_storeu_si128((__m128i*)&out->weighted_total[4], total_hi);
+  _mm_storeu_si128((__m128i*)out->weight, weight);
+  _mm_storeu_si128((__m128i*)out->min_value, min_value);
+  _mm_storeu_si128((__m128i*)out->max_value, max_value);
+}
+
+bool has_sse41() {
+  static const bool result = __builtin_cpu_supports("sse4.1");
+  return result;
+}
+
+#endif  // ROO_MONITORING_AGGREGATE_SSE41
+
+}  // namespace
+
 void Aggregator::clear() {
   data_.clear();
-  index_.clear();
+  cursor_ = 0;
 }
 
 void Aggregator::add(const Sample& input) {
-  int idx;
-  auto pos = index_.find(input.stream_id());
-  if (pos == index_.end()) {
-    idx = data_.size();
-    data_.emplace_back();
-    index_.insert(std::make_pair(input.stream_id(), idx));
-  } else {
-    idx = pos->second;
-  }
-  SampleAggregator& output = data_[idx];
+  uint64_t stream_id = input.stream_id();
+  if (cursor_ > 0 && data_[cursor_ - 1].stream_id >= stream_id) {
+    // Start of a new run.
+    cursor_ = 0;
+  }
+  while (cursor_ < data_.size() && data_[cursor_].stream_id < stream_id) {
+    ++cursor_;
+  }
+  if (cursor_ == data_.size() || data_[cursor_].stream_id != stream_id) {
+    data_.emplace(data_.begin() + cursor_, stream_id);
+  }
+  SampleAggregator& output = data_[cursor_++];
   output.weighted_total += (input.avg_value() * input.fill());
   output.weight += input.fill();
   if (output.min_value > input.min_value()) {
@@ -37,11 +146,160 @@ void Aggregator::add(const Sample& input) {
   }
 }
 
-VaultWriter::VaultWriter(Collection* collection, VaultFileRef ref)
-    : collection_(collection), ref_(ref), write_index_(0) {}
+void Aggregator::addLogData(const std::vector<LogSample>& data) {
+  for (const LogSample& sample : data) {
+    add(Sample(sample.stream_id(), sample.value(), sample.value(),
+               sample.value(), 0x2000));
+  }
+}
+
+void Aggregator::addGroup(const std::vector<Sample> (&entries)[4]) {
+  if (data_.empty() && Aligned(entries)) {
+    addAligned(entries);
+    return;
+  }
+  for (const std::vector<Sample>& entry : entries) {
+    for (const Sample& sample : entry) {
+      if (sample.fill() > 0) add(sample);
+    }
+  }
+}
+
+bool Aggregator::Aligned(const std::vector<Sample> (&entries)[4]) {
+  size_t size = entries[0].size();
+  for (int c = 1; c < 4; ++c) {
+    if (entries[c].size() != size) return false;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    uint64_t stream_id = entries[0][i].stream_id();
+    if (i > 0 && entries[0][i - 1].stream_id() >= stream_id) return false;
+    for (int c = 1; c < 4; ++c) {
+      if (entries[c][i].stream_id() != stream_id) return false;
+    }
+  }
+  return true;
+}
+
+void Aggregator::addAligned(const std::vector<Sample> (&entries)[4]) {
+  size_t size = entries[0].size();
+  data_.reserve(size);
+  for (const Sample& sample : entries[0]) {
+    data_.emplace_back(sample.stream_id());
+  }
+  size_t i = 0;
+#if ROO_MONITORING_AGGREGATE_SSE41
+  if (has_sse41()) {
+    const Sample* inputs[4] = {entries[0].data(), entries[1].data(),
+                               entries[2].data(), entries[3].data()};
+    AggregateBlock block;
+    for (; i + kAggregateBlock <= size; i += kAggregateBlock) {
+      aggregate_block_sse41(inputs, i, &block);
+      for (size_t j = 0; j < kAggregateBlock; ++j) {
+        SampleAggregator& output = data_[i + j];
+        output.weighted_total = block.weighted_total[j];
+        output.weight = block.weight[j];
+        output.min_value = block.min_value[j];
+        output.max_value = block.max_value[j];
+      }
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    SampleAggregator& output = data_[i];
+    for (const std::vector<Sample>& entry : entries) {
+      const Sample& input = entry[i];
+      if (input.fill() == 0) continue;
+      output.weighted_total += (input.avg_value() * input.fill());
+      output.weight += input.fill();
+      if (output.min_value > input.min_value()) {
+        output.min_value = input.min_value();
+      }
+      if (output.max_value < input.max_value()) {
+        output.max_value = input.max_value();
+      }
+    }
+  }
+  // Streams with zero fill in all four entries are not aggregated at all.
+  data_.erase(std::remove_if(data_.begin(), data_.end(),
+                             [](const SampleAggregator& output) {
+                               return output.weight == 0;
+                             }),
+              data_.end());
+}
+
+void Aggregator::addAggregated(const Aggregator& child, bool ignore_fill) {
+  for (const SampleAggregator& sample : child.data_) {
+    uint16_t fill = ignore_fill ? 0x2000 : sample.weight / 4;
+    if (fill == 0) continue;
+    add(Sample(sample.stream_id,
+               sample.weight > 0 ? sample.weighted_total / sample.weight : 0,
+               sample.min_value, sample.max_value, fill));
+  }
+}
+
+namespace {
+
+uint32_t varint_size(uint64_t value) {
+  uint32_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+void append_varint(std::vector<uint8_t>& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((uint8_t)value | 0x80);
+    value >>= 7;
+  }
+  buffer.push_back((uint8_t)value);
+}
+
+}  // namespace
+
+const VaultWriteHistory::File* VaultWriteHistory::find(
+    const VaultFileRef& ref) const {
+  const File& file = files_[ref.resolution()];
+  if (!recorded_[ref.resolution()] || file.ref.timestamp() != ref.timestamp()) {
+    return nullptr;
+  }
+  return &file;
+}
+
+VaultWriteHistory::File* VaultWriteHistory::record(const VaultFileRef& ref) {
+  recorded_[ref.resolution()] = true;
+  File& file = files_[ref.resolution()];
+  file.ref = ref;
+  return &file;
+}
+
+void VaultWriteHistory::forget(const VaultFileRef& ref) {
+  if (find(ref) != nullptr) recorded_[ref.resolution()] = false;
+}
+
+VaultWriter::VaultWriter(Collection* collection, VaultFileRef ref,
+                         VaultWriteHistory* history)
+    : collection_(collection),
+      ref_(ref),
+      history_(history),
+      write_index_(0),
+      position_(0),
+      bytes_written_(0),
+      bytes_read_(0),
+      minor_version_(kVaultFormatMinorVersion),
+      dictionary_(),
+      dictionary_used_(),
+      new_streams_(),
+      streams_known_(false),
+      compressed_(false),
+      previous_avg_(),
+      delta_block_(-1),
+      entry_(),
+      pending_empty_(0) {}
 
 roo_io::Status VaultWriter::openNew() {
-  String path;
+  FilePath path;
   collection_->getVaultFilePath(ref_, &path);
   roo_io::Mount fs = collection_->fs().mount();
   if (!fs.ok()) return fs.status();
@@ -51,8 +309,21 @@ roo_io::Status VaultWriter::openNew() {
   }
   MLOG(roo_monitoring_compaction)
       << "Opening a new vault file " << path.c_str() << " for write";
+  bytes_read_ = 0;
+  loadDictionary();
+  dictionary_used_.assign(dictionary_.size(), 0);
+  new_streams_.clear();
+  streams_known_ = true;
+  Manifest* manifest = collection_->manifest();
+  if (manifest != nullptr) manifest->addVaultFile(ref_);
   writer_.reset(fs.fopenForWrite(path.c_str(), roo_io::kTruncateIfExists));
+  invalidateCache();
   write_index_ = 0;
+  minor_version_ = kVaultFormatMinorVersion;
+  compressed_ = collection_->vault_compression();
+  delta_block_ = -1;
+  pending_empty_ = 0;
+  offsets_.clear();
   writeHeader();
   if (!writer_.ok()) {
     LOG(ERROR) << "Failed to open vault file " << path.c_str()
@@ -61,17 +332,69 @@ roo_io::Status VaultWriter::openNew() {
   return writer_.status();
 }
 
-roo_io::Status VaultWriter::openExisting(int write_index) {
+roo_io::Status VaultWriter::openExisting(int write_index,
+                                         uint8_t minor_version) {
   CHECK_GE(write_index, 0);
   CHECK_LT(write_index, kRangeElementCount);
-  String path;
+  FilePath path;
   collection_->getVaultFilePath(ref_, &path);
   MLOG(roo_monitoring_compaction)
       << "Opening an existing vault file " << path.c_str() << " for append";
   roo_io::Mount fs = collection_->fs().mount();
   if (!fs.ok()) return fs.status();
+  minor_version_ = minor_version;
+  dictionary_.clear();
+  new_streams_.clear();
+  streams_known_ = false;
+  compressed_ = false;
+  delta_block_ = -1;
+  bytes_read_ = 0;
+  const VaultWriteHistory::File* recorded =
+      history_ == nullptr ? nullptr : history_->find(ref_);
+  if (recorded != nullptr && recorded->write_index == write_index &&
+      (minor_version == 0 || minor_version == recorded->minor_version)) {
+    // Closed by a previous writer at this index; no need to read it back.
+    minor_version_ = recorded->minor_version;
+    dictionary_ = recorded->dictionary;
+    compressed_ = recorded->compressed;
+    previous_avg_ = recorded->previous_avg;
+    delta_block_ = recorded->delta_block;
+    streams_known_ = recorded->streams_known;
+    dictionary_used_.assign(dictionary_.size(), 0);
+    for (uint64_t stream_id : recorded->streams) {
+      addStream(stream_id, streamCode(stream_id));
+    }
+  } else if (minor_version_ == 0 || has_dictionary()) {
+    // The appended entries must use the format, and the stream dictionary,
+    // of the existing file.
+    VaultFileReader reader(collection_);
+    reader.open(ref_, 0, 0);
+    minor_version_ = reader.minor_version();
+    if (minor_version_ == 0) minor_version_ = 1;
+    dictionary_ = reader.dictionary();
+    compressed_ = reader.compressed();
+    if (compressed_ && write_index % kVaultDeltaBlockSize != 0) {
+      // The appended entries are delta-encoded against the preceding
+      // entries of their block.
+      delta_block_ = write_index / kVaultDeltaBlockSize;
+      previous_avg_.assign(dictionary_.size(), kVaultNoDeltaBase);
+      reader.seek(delta_block_ * kVaultDeltaBlockSize);
+      std::vector<Sample> samples;
+      while (reader.index() < write_index && reader.next(&samples)) {
+        for (const Sample& sample : samples) {
+          uint64_t code = streamCode(sample.stream_id());
+          if (code > 0) previous_avg_[code - 1] = sample.avg_value();
+        }
+      }
+    }
+    bytes_read_ = reader.stats().bytes_read;
+    dictionary_used_.assign(dictionary_.size(), 0);
+  }
   writer_.reset(fs.fopenForWrite(path.c_str(), roo_io::kAppendIfExists));
   write_index_ = write_index;
+  position_ = 0;
+  pending_empty_ = 0;
+  offsets_.clear();
   if (!writer_.ok()) {
     LOG(ERROR) << "Failed to open vault file " << path.c_str()
                << " for append: " << roo_io::StatusAsString(writer_.status());
@@ -79,21 +402,125 @@ roo_io::Status VaultWriter::openExisting(int write_index) {
   return writer_.status();
 }
 
-void VaultWriter::writeEmptyData() {
-  CHECK_LE(write_index_, kRangeElementCount);
+void VaultWriter::close() {
+  flushEmptyRun();
+  if (write_index_ == kRangeElementCount && writer_.ok()) {
+    writeIndex();
+  }
+  writer_.close();
+  invalidateCache();
+  recordHistory();
+}
+
+void VaultWriter::recordHistory() {
+  if (history_ == nullptr) return;
+  if (writer_.status() != roo_io::kClosed) {
+    history_->forget(ref_);
+    return;
+  }
+  VaultWriteHistory::File* file = history_->record(ref_);
+  file->write_index = write_index_;
+  file->minor_version = minor_version_;
+  file->compressed = compressed_;
+  file->dictionary = dictionary_;
+  file->previous_avg = previous_avg_;
+  file->delta_block = delta_block_;
+  file->streams_known = streams_known_;
+  file->streams.clear();
+  for (size_t i = 0; i < dictionary_.size(); ++i) {
+    if (dictionary_used_[i]) file->streams.push_back(dictionary_[i]);
+  }
+  size_t used = file->streams.size();
+  file->streams.insert(file->streams.end(), new_streams_.begin(),
+                       new_streams_.end());
+  std::inplace_merge(file->streams.begin(), file->streams.begin() + used,
+                     file->streams.end());
+}
+
+void VaultWriter::addStream(uint64_t stream_id, uint64_t code) {
+  if (code > 0) {
+    dictionary_used_[code - 1] = 1;
+    return;
+  }
+  auto i = std::lower_bound(new_streams_.begin(), new_streams_.end(),
+                            stream_id);
+  if (i == new_streams_.end() || *i != stream_id) {
+    new_streams_.insert(i, stream_id);
+  }
+}
+
+void VaultWriter::invalidateCache() {
+  VaultCache* cache = collection_->vault_cache();
+  if (cache != nullptr) cache->invalidate(ref_);
+}
+
+void VaultWriter::addEntry(uint32_t size, int count) {
+  bytes_written_ += size;
+  if (position_ == 0) return;
+  offsets_.insert(offsets_.end(), count, position_);
+  position_ += size;
+}
+
+void VaultWriter::writeEmptyData(int count) {
+  CHECK_LE(write_index_ + count, kRangeElementCount);
+  if (minor_version_ >= 3) {
+    pending_empty_ += count;
+    write_index_ += count;
+    return;
+  }
+  for (int i = 0; i < count; ++i) {
+    addEntry(1);
+    writer_.writeVarU64(0);
+    if (!writer_.ok()) {
+      LOG(ERROR) << "Failed to write empty data at index " << write_index_
+                 << ": " << roo_io::StatusAsString(writer_.status());
+    }
+    ++write_index_;
+  }
+}
+
+void VaultWriter::flushEmptyRun() {
+  if (pending_empty_ == 0) return;
+  addEntry(1 + varint_size(pending_empty_ - 1), pending_empty_);
   writer_.writeVarU64(0);
+  writer_.writeVarU64(pending_empty_ - 1);
   if (!writer_.ok()) {
-    LOG(ERROR) << "Failed to write empty data at index " << write_index_ << ": "
+    LOG(ERROR) << "Failed to write " << pending_empty_
+               << " empty entries before index " << write_index_ << ": "
                << roo_io::StatusAsString(writer_.status());
   }
-  ++write_index_;
+  pending_empty_ = 0;
 }
 
 void VaultWriter::writeLogData(const std::vector<LogSample>& data) {
   CHECK_LE(write_index_, kRangeElementCount);
+  if (data.empty()) {
+    writeEmptyData();
+    return;
+  }
+  flushEmptyRun();
+  if (compressed_) {
+    startCompressedEntry();
+    for (const auto& sample : data) {
+      encodeCompressedSample(sample.stream_id(), sample.value(),
+                             sample.value(), sample.value(), 0x2000);
+    }
+    writeCompressedEntry(data.size());
+    return;
+  }
+  uint32_t size = varint_size(data.size());
+  for (const auto& sample : data) {
+    size += streamIdSize(sample.stream_id()) + 8;
+  }
+  addEntry(size);
   writer_.writeVarU64(data.size());
+  if (has_directory()) {
+    for (const auto& sample : data) {
+      writeStreamId(sample.stream_id());
+    }
+  }
   for (const auto& sample : data) {
-    writer_.writeVarU64(sample.stream_id());
+    if (!has_directory()) writeStreamId(sample.stream_id());
     // Write the 'average'
     writer_.writeBeU16(sample.value());
     // Write the 'min'
@@ -113,11 +540,36 @@ void VaultWriter::writeLogData(const std::vector<LogSample>& data) {
 
 void VaultWriter::writeAggregatedData(const Aggregator& data) {
   CHECK_LE(write_index_, kRangeElementCount);
+  if (data.data_.empty()) {
+    writeEmptyData();
+    return;
+  }
+  flushEmptyRun();
+  if (compressed_) {
+    startCompressedEntry();
+    for (const auto& sample : data.data_) {
+      encodeCompressedSample(
+          sample.stream_id,
+          sample.weight > 0 ? sample.weighted_total / sample.weight : 0,
+          sample.min_value, sample.max_value, sample.weight / 4);
+    }
+    writeCompressedEntry(data.data_.size());
+    return;
+  }
+  uint32_t size = varint_size(data.data_.size());
+  for (const auto& sample : data.data_) {
+    size += streamIdSize(sample.stream_id) + 8;
+  }
+  addEntry(size);
   writer_.writeVarU64(data.data_.size());
-  for (const auto& entry : data.index_) {
-    const Aggregator::SampleAggregator& sample = data.data_[entry.second];
+  if (has_directory()) {
+    for (const auto& sample : data.data_) {
+      writeStreamId(sample.stream_id);
+    }
+  }
+  for (const auto& sample : data.data_) {
     // uint16_t fill = sample.weight / 4;
-    writer_.writeVarU64(entry.first);
+    if (!has_directory()) writeStreamId(sample.stream_id);
     // Write the 'average'
     writer_.writeBeU16(sample.weight > 0 ? sample.weighted_total / sample.weight
                                          : 0);
@@ -137,10 +589,402 @@ void VaultWriter::writeAggregatedData(const Aggregator& data) {
   ++write_index_;
 }
 
+void VaultWriter::startCompressedEntry() {
+  int block = write_index_ / kVaultDeltaBlockSize;
+  if (block != delta_block_) {
+    previous_avg_.assign(dictionary_.size(), kVaultNoDeltaBase);
+    delta_block_ = block;
+  }
+  entry_.clear();
+}
+
+void VaultWriter::encodeCompressedSample(uint64_t stream_id, uint16_t avg,
+                                         uint16_t min, uint16_t max,
+                                         uint16_t fill) {
+  uint64_t code = streamCode(stream_id);
+  addStream(stream_id, code);
+  append_varint(entry_, code);
+  if (code == 0) append_varint(entry_, stream_id);
+  uint64_t head = avg;
+  if (code > 0) {
+    uint32_t& previous = previous_avg_[code - 1];
+    if (previous != kVaultNoDeltaBase) head = VaultDeltaEncode(avg, previous);
+    previous = avg;
+  }
+  head = (head << 3) | (min != avg ? 1 : 0) | (max != avg ? 2 : 0) |
+         (fill != 0x2000 ? 4 : 0);
+  append_varint(entry_, head);
+  if (min != avg) append_varint(entry_, VaultDeltaEncode(min, avg));
+  if (max != avg) append_varint(entry_, VaultDeltaEncode(max, avg));
+  if (fill != 0x2000) append_varint(entry_, fill);
+}
+
+void VaultWriter::writeCompressedEntry(size_t sample_count) {
+  addEntry(varint_size(sample_count) + entry_.size());
+  writer_.writeVarU64(sample_count);
+  writer_.writeByteArray((const roo_io::byte*)entry_.data(), entry_.size());
+  if (!writer_.ok()) {
+    LOG(ERROR) << "Failed to write compressed data (" << sample_count
+               << ") at index " << write_index_ << ": "
+               << roo_io::StatusAsString(writer_.status());
+  }
+  ++write_index_;
+}
+
+void VaultWriter::writeCompactionCursor(const LogCursor& source) {
+  CHECK(embeds_cursor());
+  CHECK_LT(write_index_, kRangeElementCount);
+  CHECK_GE(source.position(), 0);
+  flushEmptyRun();
+  uint32_t size = 1 + varint_size(kVaultCursorMarker) + 1 +
+                  varint_size(source.file()) +
+                  varint_size(source.position()) + 1 + 4;
+  writer_.writeVarU64(0);
+  writer_.writeVarU64(kVaultCursorMarker);
+  writer_.writeU8(write_index_);
+  writer_.writeVarU64(source.file());
+  writer_.writeVarU64(source.position());
+  writer_.writeU8(size);
+  writer_.writeBeU32(kVaultCursorMagic);
+  if (!writer_.ok()) {
+    LOG(ERROR) << "Failed to write the compaction cursor of " << ref_ << ": "
+               << roo_io::StatusAsString(writer_.status());
+  }
+  // Not an entry; later entries (if any) start past it.
+  if (position_ != 0) position_ += size;
+}
+
 void VaultWriter::writeHeader() {
   CHECK_EQ(0, write_index_);
   writer_.writeU8(0x01);
-  writer_.writeU8(0x01);
+  writer_.writeU8(kVaultFormatMinorVersion);
+  writer_.writeU8(compressed_ ? kVaultFlagCompressed : 0);
+  writer_.writeVarU64(dictionary_.size());
+  position_ = 3 + varint_size(dictionary_.size());
+  uint64_t previous = 0;
+  for (uint64_t stream_id : dictionary_) {
+    writer_.writeVarU64(stream_id - previous);
+    position_ += varint_size(stream_id - previous);
+    previous = stream_id;
+  }
+}
+
+void VaultWriter::loadDictionary() {
+  dictionary_.clear();
+  const VaultWriteHistory::File* prev =
+      history_ == nullptr ? nullptr : history_->find(ref_.prev());
+  VaultFileReader reader(collection_);
+  if (prev != nullptr && prev->write_index == kRangeElementCount &&
+      prev->streams_known) {
+    // Finished by a previous writer; no need to read it back.
+    dictionary_ = prev->streams;
+  } else if (reader.open(ref_.prev(), 0, 0)) {
+    reader.readStreamIds(&dictionary_);
+  }
+  if (dictionary_.empty() && ref_.resolution() > collection_->resolution() &&
+      reader.open(ref_.child(0), 0, 0)) {
+    reader.readStreamIds(&dictionary_);
+  }
+  bytes_read_ += reader.stats().bytes_read;
+}
+
+uint64_t VaultWriter::streamCode(uint64_t stream_id) const {
+  auto i = std::lower_bound(dictionary_.begin(), dictionary_.end(), stream_id);
+  if (i == dictionary_.end() || *i != stream_id) return 0;
+  return i - dictionary_.begin() + 1;
+}
+
+uint32_t VaultWriter::streamIdSize(uint64_t stream_id) const {
+  if (!has_dictionary()) return varint_size(stream_id);
+  uint64_t code = streamCode(stream_id);
+  return code > 0 ? varint_size(code) : 1 + varint_size(stream_id);
+}
+
+void VaultWriter::writeStreamId(uint64_t stream_id) {
+  if (!has_dictionary()) {
+    addStream(stream_id, 0);
+    writer_.writeVarU64(stream_id);
+    return;
+  }
+  uint64_t code = streamCode(stream_id);
+  addStream(stream_id, code);
+  writer_.writeVarU64(code);
+  if (code == 0) writer_.writeVarU64(stream_id);
+}
+
+void VaultWriter::writeIndex() {
+  if (offsets_.size() != kRangeElementCount) {
+    // The file has been appended to; recover the offsets of all entries.
+    writer_.close();
+    offsets_.clear();
+    VaultFileReader reader(collection_);
+    if (!reader.open(ref_, 0, 0)) return;
+    if (reader.minor_version() < 2) {
+      // Legacy format; does not support the index.
+      return;
+    }
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      reader.seek(i);
+      if (!reader.is_open()) {
+        LOG(ERROR) << "Failed to scan the vault file " << ref_
+                   << " at index " << i << "; not writing the index";
+        return;
+      }
+      offsets_.push_back(reader.position());
+    }
+    reader.close();
+    FilePath path;
+    collection_->getVaultFilePath(ref_, &path);
+    roo_io::Mount fs = collection_->fs().mount();
+    if (!fs.ok()) return;
+    if (dropCursorRecords(fs, path)) return;
+    writer_.reset(fs.fopenForWrite(path.c_str(), roo_io::kAppendIfExists));
+  }
+  for (uint32_t offset : offsets_) {
+    writer_.writeBeU32(offset);
+  }
+  writer_.writeBeU32(kVaultIndexMagic);
+  if (!writer_.ok()) {
+    LOG(ERROR) << "Failed to write the entry-offset index of " << ref_ << ": "
+               << roo_io::StatusAsString(writer_.status());
+  }
+}
+
+bool VaultWriter::dropCursorRecords(roo_io::Mount& fs, const FilePath& path) {
+  if (minor_version_ < 4) return false;
+  roo_io::MultipassInputStreamReader in(fs.fopen(path.c_str()));
+  // Cursor records precede entries; find the ones at the entry offsets, as
+  // (offset, size) pairs.
+  std::vector<std::pair<uint32_t, uint32_t>> cursors;
+  uint32_t previous = 0;
+  for (uint32_t offset : offsets_) {
+    if (offset == previous) continue;
+    previous = offset;
+    while (in.ok()) {
+      in.seek(offset);
+      if (in.readU8() != 0 || in.readVarU64() != kVaultCursorMarker) break;
+      in.readU8();
+      in.readVarU64();
+      in.readVarU64();
+      in.readU8();
+      in.readBeU32();
+      if (!in.ok()) break;
+      uint32_t size = in.position() - offset;
+      cursors.emplace_back(offset, size);
+      offset += size;
+    }
+  }
+  if (!in.ok() || cursors.empty()) return false;
+
+  // Copies the file without them, with the index, and replaces the file.
+  FilePath tmp_path = path;
+  tmp_path.append(".tmp");
+  writer_.reset(fs.fopenForWrite(tmp_path.c_str(), roo_io::kTruncateIfExists));
+  uint64_t size = in.size();
+  uint32_t start = 0;
+  roo_io::byte buffer[64];
+  for (size_t i = 0; i <= cursors.size() && writer_.ok() && in.ok(); ++i) {
+    uint32_t end = i < cursors.size() ? cursors[i].first : size;
+    in.seek(start);
+    while (start < end) {
+      size_t count = std::min<size_t>(sizeof(buffer), end - start);
+      count = in.readByteArray(buffer, count);
+      if (count == 0) break;
+      writer_.writeByteArray(buffer, count);
+      bytes_written_ += count;
+      start += count;
+    }
+    if (start < end) break;
+    if (i < cursors.size()) start += cursors[i].second;
+  }
+  in.close();
+  if (start < size || !writer_.ok()) {
+    LOG(ERROR) << "Failed to copy the vault file " << ref_
+               << "; keeping its compaction cursors";
+    writer_.close();
+    fs.remove(tmp_path.c_str());
+    return false;
+  }
+  // Entries past a dropped record move back by its size.
+  uint32_t dropped = 0;
+  auto cursor = cursors.begin();
+  for (uint32_t& offset : offsets_) {
+    for (; cursor != cursors.end() && cursor->first < offset; ++cursor) {
+      dropped += cursor->second;
+    }
+    offset -= dropped;
+    writer_.writeBeU32(offset);
+  }
+  writer_.writeBeU32(kVaultIndexMagic);
+  writer_.close();
+  roo_io::Status status = writer_.status();
+  if (status == roo_io::kClosed) {
+    status = fs.rename(tmp_path.c_str(), path.c_str());
+    if (status != roo_io::kOk) {
+      // Some filesystems do not rename over existing files.
+      fs.remove(path.c_str());
+      status = fs.rename(tmp_path.c_str(), path.c_str());
+    }
+  }
+  if (status != roo_io::kOk) {
+    LOG(ERROR) << "Failed to drop the compaction cursors of " << ref_ << ": "
+               << roo_io::StatusAsString(status);
+    fs.remove(tmp_path.c_str());
+  }
+  return true;
+}
+
+FusedCompaction::FusedCompaction(Collection* collection,
+                                 VaultWriteHistory* history)
+    : collection_(collection),
+      history_(history),
+      levels_(kMaxResolution - collection->resolution()),
+      valid_(false),
+      next_(0),
+      failed_(false),
+      files_opened_(0) {}
+
+bool FusedCompaction::init(int64_t next) {
+  invalidate();
+  VaultFileReader reader(collection_);
+  std::vector<Sample> samples;
+  // Start of the incomplete entry at the child level.
+  int64_t child_start = next;
+  for (int i = 0; i < levels(); ++i) {
+    Level& level = levels_[i];
+    Resolution resolution = Resolution(collection_->resolution() + i + 1);
+    level.ref = VaultFileRef::Lookup(next, resolution);
+    level.write_index = (next - level.ref.timestamp()) / level.ref.time_step();
+    int64_t start = level.ref.timestamp_at(level.write_index);
+    VaultFileRef child =
+        VaultFileRef::Lookup(start, Resolution(resolution - 1));
+    level.children = (child_start - start) / child.time_step();
+    child_start = start;
+    if (level.children == 0) continue;
+    // The complete child entries of the incomplete entry.
+    reader.open(child, (start - child.timestamp()) / child.time_step(), 0);
+    for (int j = 0; j < level.children; ++j) {
+      reader.next(&samples);
+      for (const Sample& sample : samples) {
+        if (sample.fill() > 0) level.aggregator.add(sample);
+      }
+    }
+    if (!reader.ok()) {
+      LOG(ERROR) << "Failed to read the vault file " << child << ": "
+                 << roo_io::StatusAsString(reader.status());
+      invalidate();
+      return false;
+    }
+    reader.close();
+  }
+  next_ = next;
+  valid_ = true;
+  MLOG(roo_monitoring_compaction)
+      << "Fused compaction starts at " << roo_logging::hex << next;
+  return true;
+}
+
+void FusedCompaction::invalidate() {
+  for (Level& level : levels_) {
+    if (level.writer != nullptr) closeWriter(level);
+    level.aggregator.clear();
+    level.children = 0;
+    level.bytes_written = 0;
+    level.bytes_read = 0;
+  }
+  valid_ = false;
+  failed_ = false;
+  files_opened_ = 0;
+}
+
+void FusedCompaction::addLogData(const std::vector<LogSample>& data) {
+  next_ += timestamp_increment(1, collection_->resolution());
+  if (levels_.empty()) return;
+  levels_[0].aggregator.addLogData(data);
+  childAdded(0);
+}
+
+void FusedCompaction::addEmptyData(int count) {
+  next_ += timestamp_increment(count, collection_->resolution());
+  if (levels_.empty()) return;
+  for (int i = 0; i < count; ++i) childAdded(0);
+}
+
+void FusedCompaction::childAdded(int index) {
+  while (index < levels()) {
+    Level& level = levels_[index];
+    if (++level.children < 4) return;
+    if (level.writer == nullptr) {
+      level.writer.reset(new VaultWriter(collection_, level.ref, history_));
+      if (level.write_index == 0) {
+        level.writer->openNew();
+      } else {
+        level.writer->openExisting(level.write_index);
+      }
+      ++files_opened_;
+    }
+    level.writer->writeAggregatedData(level.aggregator);
+    if (!level.writer->ok()) failed_ = true;
+    if (index + 1 < levels()) {
+      levels_[index + 1].aggregator.addAggregated(
+          level.aggregator,
+          VaultFileReader::IgnoresFill(level.ref.resolution()));
+    }
+    level.aggregator.clear();
+    level.children = 0;
+    if (++level.write_index == kRangeElementCount) {
+      closeWriter(level);
+      level.ref = level.ref.next();
+      level.write_index = 0;
+    }
+    ++index;
+  }
+}
+
+uint32_t FusedCompaction::bytes_written() const {
+  uint32_t result = 0;
+  for (const Level& level : levels_) {
+    result += level.bytes_written;
+    if (level.writer != nullptr) result += level.writer->bytes_written();
+  }
+  return result;
+}
+
+uint32_t FusedCompaction::bytes_read() const {
+  uint32_t result = 0;
+  for (const Level& level : levels_) {
+    result += level.bytes_read;
+    if (level.writer != nullptr) result += level.writer->bytes_read();
+  }
+  return result;
+}
+
+void FusedCompaction::closeWriter(Level& level) {
+  level.writer->close();
+  if (level.writer->status() != roo_io::kClosed) {
+    LOG(ERROR) << "Failed to write the vault file " << level.ref << ": "
+               << roo_io::StatusAsString(level.writer->status());
+    failed_ = true;
+  }
+  level.bytes_written += level.writer->bytes_written();
+  level.bytes_read += level.writer->bytes_read();
+  level.writer.reset();
+}
+
+bool FusedCompaction::close(WriterStats* stats) {
+  for (Level& level : levels_) {
+    if (level.writer != nullptr) closeWriter(level);
+    stats->vault_bytes_written[level.ref.resolution()] += level.bytes_written;
+    level.bytes_written = 0;
+    level.bytes_read = 0;
+  }
+  stats->files_opened += files_opened_;
+  files_opened_ = 0;
+  if (failed_) {
+    invalidate();
+    return false;
+  }
+  return true;
 }
 
-}  // namespace roo_monitoring
\ No newline at end of file
+}  // namespace roo_monitoring
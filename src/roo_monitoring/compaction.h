@@ -1,7 +1,7 @@
 #pragma once
 
-#include <map>
 #include <memory>
+#include <vector>
 
 #include "log.h"
 #include "roo_io/data/output_stream_writer.h"
@@ -11,52 +11,175 @@
 namespace roo_monitoring {
 
 /// Aggregates samples for a vault file time bucket.
+///
+/// Keeps the aggregated streams in a flat vector, sorted by stream ID. Input
+/// entries are sorted by stream ID as well, so each of them is merged in a
+/// single linear pass. The vector keeps its capacity across `clear()`, so
+/// that, in the steady state, aggregation does not allocate.
 class Aggregator {
  public:
+  Aggregator() : cursor_(0) {}
+
   /// Clears any accumulated data.
   void clear();
   /// Adds a sample into the aggregation state.
+  ///
+  /// Samples are expected to come in runs (input entries) sorted by stream
+  /// ID; a sample with a stream ID not greater than the previous one starts a
+  /// new run. Unsorted input is handled correctly, but less efficiently.
   void add(const Sample& sample);
 
+  /// Adds the entry that `VaultWriter::writeLogData()` writes for the
+  /// specified log samples, as it is read back from the vault file.
+  void addLogData(const std::vector<LogSample>& data);
+
+  /// Adds the entry that `VaultWriter::writeAggregatedData()` writes for the
+  /// child aggregator, as it is read back from the vault file; i.e. with fill
+  /// values replaced by 100% if `ignore_fill` is true, and skipping samples
+  /// with zero fill.
+  void addAggregated(const Aggregator& child, bool ignore_fill);
+
+  /// Adds a group of four input entries, skipping samples with zero fill;
+  /// equivalent to calling `add()` for all the other samples.
+  ///
+  /// If the aggregator is empty, and the four entries hold the same streams,
+  /// in the same (sorted) order, which is the common case when all streams
+  /// report at every step, they are aggregated column-wise, using SIMD
+  /// instructions if the CPU supports them.
+  void addGroup(const std::vector<Sample> (&entries)[4]);
+
  private:
   friend class VaultWriter;
 
   struct SampleAggregator {
-    SampleAggregator()
-        : weighted_total(0), weight(0), min_value(0xFFFF), max_value(0) {}
+    SampleAggregator(uint64_t stream_id)
+        : stream_id(stream_id),
+          weighted_total(0),
+          weight(0),
+          min_value(0xFFFF),
+          max_value(0) {}
 
+    uint64_t stream_id;
     uint32_t weighted_total;
     uint16_t weight;
     uint16_t min_value;
     uint16_t max_value;
   };
 
+  // Returns true if the four entries hold the same streams, in increasing
+  // order.
+  static bool Aligned(const std::vector<Sample> (&entries)[4]);
+
+  // Aggregates aligned entries into the (empty) aggregator.
+  void addAligned(const std::vector<Sample> (&entries)[4]);
+
   std::vector<SampleAggregator> data_;
-  std::map<uint64_t, int> index_;
+
+  // Position in data_ at which the merge of the current run continues.
+  size_t cursor_;
+};
+
+/// State of the vault file most recently closed by a `VaultWriter`, at every
+/// resolution, kept in memory so that it does not need to be read back from
+/// the file: neither to resume writing it, nor to build the stream
+/// dictionary of the file that follows it.
+///
+/// Shared by the vault writers of a single `Writer`.
+class VaultWriteHistory {
+ public:
+  struct File {
+    File()
+        : write_index(0),
+          minor_version(0),
+          compressed(false),
+          delta_block(-1),
+          streams_known(false) {}
+
+    VaultFileRef ref;
+    int write_index;
+    uint8_t minor_version;
+    bool compressed;
+    std::vector<uint64_t> dictionary;
+    std::vector<uint32_t> previous_avg;
+    int delta_block;
+
+    // All the distinct streams written to the file (sorted), if known, i.e.
+    // unless the file has been resumed without a recorded state.
+    std::vector<uint64_t> streams;
+    bool streams_known;
+  };
+
+  VaultWriteHistory() : files_(), recorded_() {}
+
+  /// Returns the recorded state of the file, or nullptr if there is none.
+  const File* find(const VaultFileRef& ref) const;
+
+  /// Returns the state to be recorded for the file, replacing the one of
+  /// the previous file at the same resolution.
+  File* record(const VaultFileRef& ref);
+
+  /// Drops the recorded state of the file, if any.
+  void forget(const VaultFileRef& ref);
+
+ private:
+  // Indexed by resolution.
+  File files_[kMaxResolution + 1];
+  bool recorded_[kMaxResolution + 1];
 };
 
 /// Writes vault files for a collection at a specific resolution.
 class VaultWriter {
  public:
   /// Creates a writer for the given collection and vault file.
-  VaultWriter(Collection* collection, VaultFileRef ref);
+  ///
+  /// If a history is given, the writer records the state of the file in it
+  /// on `close()`, and uses the state recorded by a previous writer, if
+  /// available, instead of reading the file (or its predecessor) back.
+  VaultWriter(Collection* collection, VaultFileRef ref,
+              VaultWriteHistory* history = nullptr);
   /// Returns the reference to the vault file being written.
   const VaultFileRef& vault_ref() const { return ref_; }
 
   /// Opens a new vault file for writing.
+  ///
+  /// The stream dictionary of the new file holds the streams of the
+  /// previous file at the same resolution or, if there are none, of the
+  /// first child file. Streams missing from it are written in full. The
+  /// file is compressed if the collection has vault compression enabled.
   roo_io::Status openNew();
 
   /// Opens an existing vault file, seeking to the specified entry index.
-  roo_io::Status openExisting(int write_index);
+  ///
+  /// The appended entries use the format of the existing file: the
+  /// specified minor version, or, if zero, the one read from the file. In
+  /// format 1.6 or newer, the stream dictionary is read from the file; in
+  /// compressed files, so are the preceding entries of the block.
+  roo_io::Status openExisting(int write_index, uint8_t minor_version = 0);
 
   /// Closes the underlying writer.
-  void close() { writer_.close(); }
+  ///
+  /// If the vault file has been finished, appends the entry-offset index
+  /// first. If it has been finished by appending to it, the compaction cursor
+  /// records left by earlier appends are dropped, by rewriting the file.
+  void close();
 
   /// Returns the current write index within the vault file.
   int write_index() const { return write_index_; }
 
-  /// Writes an empty vault file payload.
-  void writeEmptyData();
+  /// Returns the number of entry bytes written since the file was opened,
+  /// including the ones copied when dropping compaction cursor records.
+  uint32_t bytes_written() const { return bytes_written_; }
+
+  /// Returns the number of entry bytes read back from vault files when
+  /// opening the file: the streams of the previous file, or the preceding
+  /// entries of a compressed block. Zero if served from the history.
+  uint32_t bytes_read() const { return bytes_read_; }
+
+  /// Writes the specified number of empty entries.
+  ///
+  /// Consecutive empty entries are buffered, and written as a single run
+  /// record before the next non-empty entry, or on close.
+  void writeEmptyData(int count = 1);
 
   /// Writes raw log samples into the vault file.
   void writeLogData(const std::vector<LogSample>& data);
@@ -64,6 +187,30 @@ class VaultWriter {
   /// Writes aggregated samples into the vault file.
   void writeAggregatedData(const Aggregator& aggregator);
 
+  /// Returns true if the compaction cursor can be embedded in the file,
+  /// i.e. if the file format is 1.4 or newer.
+  bool embeds_cursor() const { return minor_version_ >= 4; }
+
+  /// Returns true if the entries are written with stream-ID directories,
+  /// i.e. if the file format is 1.5 or newer.
+  bool has_directory() const { return minor_version_ >= 5 && !compressed_; }
+
+  /// Appends the compaction cursor of the unfinished file: the current write
+  /// index, and the specified position in the source file up to which the
+  /// data has been compacted. Must be the last record written before
+  /// `close()`. Requires `embeds_cursor()`.
+  void writeCompactionCursor(const LogCursor& source);
+
+  /// Returns true if the stream IDs are written as codes referring to the
+  /// stream dictionary of the file, i.e. if the file format is 1.6 or newer.
+  bool has_dictionary() const { return minor_version_ >= 6; }
+
+  /// Returns the stream dictionary of the file (sorted).
+  const std::vector<uint64_t>& dictionary() const { return dictionary_; }
+
+  /// Returns true if the samples are written in the compressed encoding.
+  bool compressed() const { return compressed_; }
+
   /// Returns true if the writer is in a good state.
   bool ok() const { return writer_.ok(); }
 
@@ -73,10 +220,196 @@ class VaultWriter {
  private:
   void writeHeader();
 
+  // Sets the stream dictionary of a new file; see openNew().
+  void loadDictionary();
+
+  // Marks the stream, of the specified dictionary code, as written.
+  void addStream(uint64_t stream_id, uint64_t code);
+
+  // Records the state of the closed file in the history.
+  void recordHistory();
+
+  // Returns 1 + the index of the stream in the dictionary, or 0 if absent.
+  uint64_t streamCode(uint64_t stream_id) const;
+
+  // Returns the encoded size of the stream ID, in bytes.
+  uint32_t streamIdSize(uint64_t stream_id) const;
+
+  // Writes the stream ID; as a code if the file has a dictionary.
+  void writeStreamId(uint64_t stream_id);
+
+  // Starts encoding a compressed entry at write_index_ into entry_.
+  void startCompressedEntry();
+
+  // Appends the compressed sample to entry_, and updates the delta-encoding
+  // state.
+  void encodeCompressedSample(uint64_t stream_id, uint16_t avg, uint16_t min,
+                              uint16_t max, uint16_t fill);
+
+  // Writes the compressed entry of the specified number of samples, encoded
+  // in entry_.
+  void writeCompressedEntry(size_t sample_count);
+
+  // Appends the entry-offset index to the finished vault file. If the file
+  // has been opened for append, scans it first to recover the offsets of
+  // entries written previously.
+  void writeIndex();
+
+  // Rewrites the finished file at path, which has been opened for append,
+  // without the compaction cursor records left by earlier appends, and with
+  // the index (adjusting offsets_). Returns false, without writing anything,
+  // if there are no cursor records.
+  bool dropCursorRecords(roo_io::Mount& fs, const FilePath& path);
+
+  // Drops the vault file from the collection's vault cache, if any.
+  void invalidateCache();
+
+  // Records the offset of the record about to be written, of the specified
+  // size in bytes, holding the specified number of entries.
+  void addEntry(uint32_t size, int count = 1);
+
+  // Writes out the buffered run of empty entries, if any.
+  void flushEmptyRun();
+
   const Collection* collection_;
   VaultFileRef ref_;
+  VaultWriteHistory* history_;
   int write_index_;
   roo_io::OutputStreamWriter writer_;
+
+  // Byte offset of the next entry, or 0 if unknown (i.e. after opening an
+  // existing file).
+  uint32_t position_;
+
+  // Offsets of the entries written, if known.
+  std::vector<uint32_t> offsets_;
+
+  uint32_t bytes_written_;
+  uint32_t bytes_read_;
+
+  // Minor format version of the file being written.
+  uint8_t minor_version_;
+
+  // Stream dictionary of the file being written (sorted).
+  std::vector<uint64_t> dictionary_;
+
+  // The streams written to the file: whether each dictionary stream has
+  // been, and the other ones (sorted). Complete only if streams_known_.
+  std::vector<uint8_t> dictionary_used_;
+  std::vector<uint64_t> new_streams_;
+  bool streams_known_;
+
+  // Whether the file being written is compressed.
+  bool compressed_;
+
+  // For compressed files: the last avg value of every dictionary stream
+  // within the current block of entries (or kVaultNoDeltaBase), and the
+  // index of that block (-1 if none).
+  std::vector<uint32_t> previous_avg_;
+  int delta_block_;
+
+  // The compressed entry being encoded; reused across entries.
+  std::vector<uint8_t> entry_;
+
+  // Number of buffered empty entries, not yet written.
+  int pending_empty_;
+};
+
+/// Compacts all the ancestor levels of the base vault level in a single pass.
+///
+/// Fed with every entry written to the base vault file, keeps a running
+/// aggregate of the incomplete entry at every ancestor level, and appends
+/// each entry to its vault file as soon as it is complete. Ancestor files are
+/// never read back, and need no cursor files: the position in every ancestor
+/// file follows from the timestamp of the next base entry.
+///
+/// The state lives in memory only. `init()` rebuilds it from the vault files,
+/// reading at most 3 entries per level; the vault files must be up to date
+/// (i.e. compacted level by level) at that point.
+class FusedCompaction {
+ public:
+  /// Creates a compaction of the ancestors of the collection's base level.
+  /// The history, if given, is passed to the vault writers.
+  explicit FusedCompaction(Collection* collection,
+                           VaultWriteHistory* history = nullptr);
+
+  /// Returns true if the state is in sync with the vault files.
+  bool valid() const { return valid_; }
+
+  /// Returns the timestamp of the next base entry. Meaningful only if
+  /// `valid()`.
+  int64_t next() const { return next_; }
+
+  /// Returns the number of ancestor levels.
+  int levels() const { return levels_.size(); }
+
+  /// Returns the vault file that receives the next entry of the specified
+  /// ancestor level (0 being the parent of the base level).
+  const VaultFileRef& level_ref(int level) const { return levels_[level].ref; }
+
+  /// Rebuilds the state from the vault files, which must contain all the
+  /// base entries before `next`, compacted. Returns false on read error.
+  bool init(int64_t next);
+
+  /// Marks the state as out of sync, dropping any entries not yet written.
+  void invalidate();
+
+  /// Adds the entry that has just been written to the base vault file.
+  void addLogData(const std::vector<LogSample>& data);
+
+  /// Adds the specified number of empty entries that have just been written
+  /// to the base vault file.
+  void addEmptyData(int count = 1);
+
+  /// Returns the number of entry bytes written to the ancestor vault files
+  /// since the last `close()`.
+  uint32_t bytes_written() const;
+
+  /// Returns the number of entry bytes read back when opening the ancestor
+  /// vault files since the last `close()`; see `VaultWriter::bytes_read()`.
+  uint32_t bytes_read() const;
+
+  /// Closes the ancestor vault files that are open for writing, and adds
+  /// the bytes written and files opened to `stats`. Returns false (and
+  /// invalidates the state) on write error.
+  bool close(WriterStats* stats);
+
+ private:
+  struct Level {
+    Level() : write_index(0), children(0), bytes_written(0), bytes_read(0) {}
+
+    // The vault file, and the index in it, of the next entry.
+    VaultFileRef ref;
+    int write_index;
+
+    // Child entries of the next entry, aggregated so far.
+    Aggregator aggregator;
+    int children;
+
+    // Open while the level is being written to.
+    std::unique_ptr<VaultWriter> writer;
+
+    // Bytes written and read by the writers closed since the last close().
+    uint32_t bytes_written;
+    uint32_t bytes_read;
+  };
+
+  // Called after a child entry has been added to the aggregator of the
+  // specified level. Writes out the entry if complete, and propagates it up.
+  void childAdded(int level);
+
+  // Closes the writer of the specified level, if open.
+  void closeWriter(Level& level);
+
+  Collection* collection_;
+  VaultWriteHistory* history_;
+  std::vector<Level> levels_;
+  bool valid_;
+  int64_t next_;
+
+  // Set on write error; reported by close().
+  bool failed_;
+  uint32_t files_opened_;
 };
 
 }  // namespace roo_monitoring
\ No newline at end of file
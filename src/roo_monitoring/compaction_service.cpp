@@ -0,0 +1,162 @@
+#include "compaction_service.h"
+
+#if ROO_MONITORING_HAS_THREADS
+
+#include <chrono>
+
+#include "roo_logging.h"
+
+namespace roo_monitoring {
+
+CompactionService::Lock::Lock(CompactionService& service, Writer* writer)
+    : service_(service), writer_(writer) {
+  std::unique_lock<std::mutex> lock(service_.mutex_);
+  Entry* entry = service_.waitUntilIdle(lock, writer_);
+  CHECK(entry != nullptr) << "Writer not registered";
+  entry->locked = true;
+}
+
+CompactionService::Lock::~Lock() {
+  {
+    std::unique_lock<std::mutex> lock(service_.mutex_);
+    Entry* entry = service_.find(writer_);
+    if (entry != nullptr) entry->locked = false;
+  }
+  // The data just written is likely to need flushing.
+  service_.work_available_.notify_one();
+  service_.writer_released_.notify_all();
+}
+
+CompactionService::CompactionService(Options options)
+    : options_(options), next_(0), stopping_(false) {}
+
+CompactionService::~CompactionService() { stop(); }
+
+void CompactionService::add(Writer* writer, IngestQueue* queue) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    CHECK(find(writer) == nullptr) << "Writer already registered";
+    entries_.emplace_back(writer, queue);
+  }
+  work_available_.notify_one();
+}
+
+void CompactionService::remove(Writer* writer) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Entry* entry = waitUntilIdle(lock, writer);
+  if (entry == nullptr) return;
+  size_t index = entry - entries_.data();
+  entries_.erase(entries_.begin() + index);
+  if (next_ > index) --next_;
+}
+
+void CompactionService::start() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!threads_.empty()) return;
+  stopping_ = false;
+  for (size_t i = 0; i < options_.thread_count(); ++i) {
+    threads_.emplace_back(&CompactionService::run, this);
+  }
+}
+
+void CompactionService::stop() {
+  std::vector<std::thread> threads;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    threads.swap(threads_);
+  }
+  work_available_.notify_all();
+  for (std::thread& thread : threads) thread.join();
+}
+
+void CompactionService::notify() { work_available_.notify_all(); }
+
+FlushBacklog CompactionService::backlog(Writer* writer) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Entry* entry = find(writer);
+  return entry == nullptr ? FlushBacklog(0, false) : entry->backlog;
+}
+
+void CompactionService::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    int index = pick(millis());
+    if (index < 0) {
+      work_available_.wait_for(
+          lock, std::chrono::milliseconds(options_.idle_poll_ms()));
+      continue;
+    }
+    Entry& entry = entries_[index];
+    entry.busy = true;
+    Writer* writer = entry.writer;
+    IngestQueue* queue = entry.queue;
+    lock.unlock();
+
+    // The writer is ours until we clear the busy flag.
+    if (queue != nullptr) queue->drain(writer);
+    FlushBacklog backlog =
+        writer->flushFor(FlushBudget::Millis(options_.slice_ms()));
+
+    lock.lock();
+    // The entry may have moved in the meantime, but not been removed.
+    Entry* updated = find(writer);
+    updated->busy = false;
+    updated->backlog = backlog;
+    updated->last_flush_ms = millis();
+    updated->flushed = true;
+    writer_released_.notify_all();
+  }
+}
+
+bool CompactionService::hasWork(const Entry& entry, unsigned long now) const {
+  if (entry.busy || entry.locked) return false;
+  if (!entry.flushed || !entry.backlog.empty()) return true;
+  if (entry.queue != nullptr && entry.queue->size() > 0) return true;
+  return now - entry.last_flush_ms >= options_.idle_poll_ms();
+}
+
+int CompactionService::pick(unsigned long now) {
+  size_t count = entries_.size();
+  if (count == 0) return -1;
+  if (options_.scheduling() == kLargestBacklog) {
+    int best = -1;
+    for (size_t i = 0; i < count; ++i) {
+      const Entry& entry = entries_[i];
+      if (!hasWork(entry, now)) continue;
+      if (best < 0 || entry.backlog.log_files() >
+                          entries_[best].backlog.log_files()) {
+        best = i;
+      }
+    }
+    return best;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    size_t index = (next_ + i) % count;
+    if (hasWork(entries_[index], now)) {
+      next_ = (index + 1) % count;
+      return index;
+    }
+  }
+  return -1;
+}
+
+CompactionService::Entry* CompactionService::find(Writer* writer) {
+  for (Entry& entry : entries_) {
+    if (entry.writer == writer) return &entry;
+  }
+  return nullptr;
+}
+
+CompactionService::Entry* CompactionService::waitUntilIdle(
+    std::unique_lock<std::mutex>& lock, Writer* writer) {
+  while (true) {
+    Entry* entry = find(writer);
+    if (entry == nullptr || (!entry->busy && !entry->locked)) return entry;
+    writer_released_.wait(lock);
+  }
+}
+
+}  // namespace roo_monitoring
+
+#endif  // ROO_MONITORING_HAS_THREADS
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Frameworks without std::thread (e.g. bare-metal ones) can define
+// ROO_MONITORING_HAS_THREADS to 0, or, conversely, enable the service on
+// other platforms by defining it to 1.
+#ifndef ROO_MONITORING_HAS_THREADS
+#if defined(ESP32) || defined(__linux__) || defined(__APPLE__) || \
+    defined(_WIN32)
+#define ROO_MONITORING_HAS_THREADS 1
+#else
+#define ROO_MONITORING_HAS_THREADS 0
+#endif
+#endif
+
+#if ROO_MONITORING_HAS_THREADS
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+
+/// Flushes and compacts multiple writers on a pool of background threads.
+///
+/// Replaces polling `flushSome()` on every writer from the application
+/// thread. Workers pick a writer that has pending work, and call
+/// `Writer::flushFor()` on it with a small time budget (a 'slice'), so that a
+/// writer is never held for long, and large backlogs are worked off
+/// incrementally.
+///
+/// Concurrency rules:
+///
+/// * `Writer` itself is not thread-safe. Once registered, a writer is used
+///   by at most one worker at a time, and the application must not use it
+///   directly, except while holding a `CompactionService::Lock` on it.
+/// * The preferred way to write to a registered writer is through the
+///   `IngestQueue` passed to `add()`: pushing never blocks, and workers drain
+///   the queue before every flush slice. Holding a `Lock` blocks for at most
+///   one slice, and stalls the flushing of that writer while held.
+/// * `VaultIterator`s and other readers of a collection must hold a `Lock`
+///   on its writer while reading. Workers append to vault files, and rewrite
+///   compaction cursors, in place; an unlocked reader may observe a
+///   partially written entry.
+/// * `add()`, `remove()`, and `Lock` can be used from any thread.
+class CompactionService {
+ public:
+  /// How workers choose the next writer to flush.
+  enum Scheduling {
+    /// Cycle through writers with pending work.
+    kRoundRobin,
+    /// Prefer the writer with the most pending log files.
+    kLargestBacklog,
+  };
+
+  class Options {
+   public:
+    Options()
+        : thread_count_(1),
+          slice_ms_(50),
+          idle_poll_ms_(1000),
+          scheduling_(kRoundRobin) {}
+
+    /// Number of worker threads.
+    Options& set_thread_count(size_t thread_count) {
+      thread_count_ = thread_count;
+      return *this;
+    }
+
+    /// Time budget of a single flush slice.
+    Options& set_slice_ms(uint32_t slice_ms) {
+      slice_ms_ = slice_ms;
+      return *this;
+    }
+
+    /// How often to flush writers that have no known backlog, to pick up the
+    /// data accumulated in their current (hot) log file.
+    Options& set_idle_poll_ms(uint32_t idle_poll_ms) {
+      idle_poll_ms_ = idle_poll_ms;
+      return *this;
+    }
+
+    Options& set_scheduling(Scheduling scheduling) {
+      scheduling_ = scheduling;
+      return *this;
+    }
+
+    size_t thread_count() const { return thread_count_; }
+    uint32_t slice_ms() const { return slice_ms_; }
+    uint32_t idle_poll_ms() const { return idle_poll_ms_; }
+    Scheduling scheduling() const { return scheduling_; }
+
+   private:
+    size_t thread_count_;
+    uint32_t slice_ms_;
+    uint32_t idle_poll_ms_;
+    Scheduling scheduling_;
+  };
+
+  /// Exclusive access to a registered writer, e.g. to write to it directly.
+  ///
+  /// Waits until no worker uses the writer, and keeps workers away from it
+  /// until destroyed.
+  class Lock {
+   public:
+    Lock(CompactionService& service, Writer* writer);
+    ~Lock();
+
+    Lock(const Lock&) = delete;
+    Lock& operator=(const Lock&) = delete;
+
+   private:
+    CompactionService& service_;
+    Writer* writer_;
+  };
+
+  CompactionService(Options options = Options());
+
+  /// Stops the workers.
+  ~CompactionService();
+
+  CompactionService(const CompactionService&) = delete;
+  CompactionService& operator=(const CompactionService&) = delete;
+
+  /// Registers a writer, optionally fed by the specified ingest queue.
+  ///
+  /// The writer (and the queue) must outlive the registration.
+  void add(Writer* writer, IngestQueue* queue = nullptr);
+
+  /// Unregisters the writer, waiting for a worker to finish with it first.
+  void remove(Writer* writer);
+
+  /// Starts the worker threads.
+  void start();
+
+  /// Stops the worker threads, waiting for the current slices to finish.
+  /// Interrupted flushes are resumed after the next `start()`.
+  void stop();
+
+  /// Wakes up the workers, e.g. after a burst of writes, so that they don't
+  /// wait for the idle poll.
+  void notify();
+
+  /// Returns the most recently observed backlog of the writer.
+  FlushBacklog backlog(Writer* writer);
+
+ private:
+  struct Entry {
+    Entry(Writer* writer, IngestQueue* queue)
+        : writer(writer),
+          queue(queue),
+          backlog(0, false),
+          last_flush_ms(0),
+          flushed(false),
+          busy(false),
+          locked(false) {}
+
+    Writer* writer;
+    IngestQueue* queue;
+    FlushBacklog backlog;
+    unsigned long last_flush_ms;
+    // Whether the writer has been flushed at least once.
+    bool flushed;
+    // Whether a worker is flushing the writer.
+    bool busy;
+    // Whether the application holds a Lock on the writer.
+    bool locked;
+  };
+
+  void run();
+
+  // Returns the index of the entry to flush next, or -1 if none needs
+  // flushing now. Must be called with mutex_ held.
+  int pick(unsigned long now);
+
+  // Returns true if the entry has work to do. Must be called with mutex_
+  // held.
+  bool hasWork(const Entry& entry, unsigned long now) const;
+
+  // Returns the entry of the writer. Must be called with mutex_ held.
+  Entry* find(Writer* writer);
+
+  // Waits until no worker uses the writer. Must be called with lock held.
+  Entry* waitUntilIdle(std::unique_lock<std::mutex>& lock, Writer* writer);
+
+  const Options options_;
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable writer_released_;
+  std::vector<Entry> entries_;
+  size_t next_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace roo_monitoring
+
+#endif  // ROO_MONITORING_HAS_THREADS
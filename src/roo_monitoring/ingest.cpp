@@ -0,0 +1,124 @@
+#include "ingest.h"
+
+#include <algorithm>
+
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+
+namespace {
+
+size_t round_up_to_power_of_two(size_t value) {
+  size_t result = 2;
+  while (result < value) result <<= 1;
+  return result;
+}
+
+}  // namespace
+
+IngestQueue::IngestQueue(size_t capacity, OverflowPolicy policy)
+    : cells_(new Cell[round_up_to_power_of_two(capacity)]),
+      mask_(round_up_to_power_of_two(capacity) - 1),
+      policy_(policy),
+      enqueue_pos_(0),
+      dequeue_pos_(0),
+      pushed_(0),
+      dropped_(0) {
+  for (size_t i = 0; i <= mask_; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool IngestQueue::push(int64_t timestamp, uint64_t stream_id, float value) {
+  Item item{timestamp, stream_id, value};
+  while (!tryPush(item)) {
+    if (policy_ == kDropNewest) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    // Evict the oldest sample, and retry. (If the consumer has just made
+    // room, there is nothing to evict, and the retry will succeed.)
+    Item evicted;
+    if (tryPop(&evicted)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  pushed_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool IngestQueue::tryPush(const Item& item) {
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Full.
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->item = item;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool IngestQueue::tryPop(Item* item) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Empty.
+      return false;
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  *item = cell->item;
+  cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+size_t IngestQueue::size() const {
+  size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+  size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+  return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+size_t IngestQueue::drain(Writer* writer, size_t max_count) {
+  batch_.clear();
+  // Do not let concurrent producers keep the consumer busy indefinitely.
+  if (max_count > capacity()) max_count = capacity();
+  Item item;
+  while (batch_.size() < max_count && tryPop(&item)) {
+    batch_.push_back(item);
+  }
+  if (batch_.empty()) return 0;
+  std::stable_sort(batch_.begin(), batch_.end(),
+                   [](const Item& a, const Item& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  WriteTransaction transaction(writer);
+  for (const Item& i : batch_) {
+    transaction.write(i.timestamp, i.stream_id, i.value);
+  }
+  return batch_.size();
+}
+
+}  // namespace roo_monitoring
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace roo_monitoring {
+
+class Writer;
+
+/// Thread-safe, bounded, lock-free ingest queue in front of a `Writer`.
+///
+/// Any number of threads (producers) can `push()` samples concurrently,
+/// without locking. A single consumer thread periodically calls `drain()`,
+/// which writes the queued samples to the writer. The consumer must be the
+/// only thread that uses the writer (including flushing it).
+///
+/// The queue has a fixed capacity, allocated up front. When it is full, the
+/// overflow policy decides whether the incoming sample or the oldest queued
+/// one gets dropped; either way, the drop is counted.
+///
+/// Implemented as a bounded array-based queue in which every cell carries a
+/// sequence number (after D. Vyukov), so that producers contend on a single
+/// atomic increment, and never wait for each other.
+class IngestQueue {
+ public:
+  /// What to do with a sample pushed to a full queue.
+  enum OverflowPolicy {
+    /// Reject the incoming sample; `push()` returns false.
+    kDropNewest,
+    /// Evict the oldest queued sample to make room for the incoming one.
+    kDropOldest,
+  };
+
+  /// Creates a queue with the specified capacity, rounded up to a power of
+  /// two.
+  IngestQueue(size_t capacity, OverflowPolicy policy = kDropNewest);
+
+  IngestQueue(const IngestQueue&) = delete;
+  IngestQueue& operator=(const IngestQueue&) = delete;
+
+  /// Enqueues a sample. Can be called concurrently from any thread.
+  ///
+  /// Returns false if the sample has been dropped because the queue is full.
+  bool push(int64_t timestamp, uint64_t stream_id, float value);
+
+  /// Writes queued samples to the writer, in a single write transaction.
+  ///
+  /// Must only be called from the consumer thread. Writes at most max_count
+  /// samples, and returns the number written. Samples are ordered by
+  /// timestamp before writing, so that samples pushed concurrently by
+  /// different producers, slightly out of order, do not cause the log file
+  /// to rotate.
+  size_t drain(Writer* writer, size_t max_count = (size_t)-1);
+
+  /// Returns the capacity of the queue.
+  size_t capacity() const { return mask_ + 1; }
+
+  /// Returns the (approximate) number of queued samples.
+  size_t size() const;
+
+  /// Returns the total number of samples successfully pushed.
+  uint64_t pushed() const { return pushed_.load(std::memory_order_relaxed); }
+
+  /// Returns the total number of samples dropped due to overflow.
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Item {
+    int64_t timestamp;
+    uint64_t stream_id;
+    float value;
+  };
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Item item;
+  };
+
+  bool tryPush(const Item& item);
+  bool tryPop(Item* item);
+
+  std::unique_ptr<Cell[]> cells_;
+  const size_t mask_;
+  const OverflowPolicy policy_;
+
+  // Kept on separate cache lines, as producers and the consumer update them
+  // independently.
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+
+  alignas(64) std::atomic<uint64_t> pushed_;
+  std::atomic<uint64_t> dropped_;
+
+  // Owned by the consumer; reused across drains.
+  std::vector<Item> batch_;
+};
+
+}  // namespace roo_monitoring
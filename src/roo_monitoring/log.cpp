@@ -5,6 +5,7 @@
 #include <algorithm>
 
 #include "common.h"
+#include "manifest.h"
 #include "roo_io/fs/fsutil.h"
 #include "roo_logging.h"
 
@@ -20,6 +21,22 @@ namespace roo_monitoring {
 
 enum Code { CODE_ERROR = 0, CODE_TIMESTAMP = 1, CODE_DATUM = 2 };
 
+namespace {
+
+// Starts version 2 files. Version 1 files start with CODE_TIMESTAMP.
+static const uint8_t kLogHeaderMarker = 0;
+
+static const uint8_t kLogFormatVersion = 2;
+
+// Record tag bits of version 2 files; see LogFileReader.
+static const uint64_t kTagTimestamp = 1;
+static const uint64_t kTagLiteralDatum = 3;
+
+// Index of a stream that is not in the dictionary of the log file.
+static const uint32_t kNotInDictionary = 0xFFFFFFFF;
+
+}  // namespace
+
 bool LogFileReader::open(const char* path, int64_t checkpoint) {
   MLOG(roo_monitoring_compaction)
       << "Opening log file " << path << " at " << checkpoint;
@@ -29,6 +46,13 @@ bool LogFileReader::open(const char* path, int64_t checkpoint) {
                << roo_io::StatusAsString(reader_.status());
     return false;
   }
+  // The header is read even when resuming at a checkpoint, since the records
+  // refer to it.
+  if (!readHeader()) {
+    LOG(ERROR) << "Failed to read the header of the log file " << path;
+    reader_.close();
+    return false;
+  }
   if (checkpoint > 0) {
     reader_.seek(checkpoint);
     if (!reader_.ok()) {
@@ -38,10 +62,48 @@ bool LogFileReader::open(const char* path, int64_t checkpoint) {
     }
   }
   checkpoint_ = checkpoint;
-  lookahead_entry_type_ = reader_.readU8();
+  readEntryType();
+  return true;
+}
+
+bool LogFileReader::readHeader() {
+  dictionary_.clear();
+  uint8_t marker = reader_.readU8();
+  if (!reader_.ok() || marker != kLogHeaderMarker) {
+    // Version 1 (or empty).
+    version_ = 1;
+    base_timestamp_ = 0;
+    if (reader_.ok()) reader_.seek(0);
+    return true;
+  }
+  version_ = reader_.readU8();
+  base_timestamp_ = reader_.readVarU64();
+  resolution_ = (Resolution)reader_.readU8();
+  uint64_t size = reader_.readVarU64();
+  if (!reader_.ok() || version_ != kLogFormatVersion ||
+      resolution_ > kMaxResolution) {
+    return false;
+  }
+  uint64_t stream_id = 0;
+  for (uint64_t i = 0; i < size; ++i) {
+    stream_id += reader_.readVarU64();
+    if (!reader_.ok()) return false;
+    dictionary_.push_back(stream_id);
+  }
   return true;
 }
 
+void LogFileReader::readEntryType() {
+  lookahead_position_ = reader_.position();
+  if (version_ < 2) {
+    lookahead_entry_type_ = reader_.readU8();
+    return;
+  }
+  lookahead_tag_ = reader_.readVarU64();
+  lookahead_entry_type_ =
+      (lookahead_tag_ & 3) == kTagTimestamp ? CODE_TIMESTAMP : CODE_DATUM;
+}
+
 bool LogFileReader::next(int64_t* timestamp, std::vector<LogSample>* data,
                          bool is_hot) {
   data->clear();
@@ -52,8 +114,13 @@ bool LogFileReader::next(int64_t* timestamp, std::vector<LogSample>* data,
                << (int)lookahead_entry_type_;
     return false;
   }
-  *timestamp = reader_.readVarU64();
-  lookahead_entry_type_ = reader_.readU8();
+  if (version_ < 2) {
+    *timestamp = reader_.readVarU64();
+  } else {
+    *timestamp = base_timestamp_ +
+                 timestamp_increment(lookahead_tag_ >> 2, resolution_);
+  }
+  readEntryType();
   if (!reader_.ok()) return false;
 
   // LOG(INFO) << "Read log data at timestamp: " << roo_logging::hex <<
@@ -79,14 +146,22 @@ bool LogFileReader::next(int64_t* timestamp, std::vector<LogSample>* data,
     } else if (lookahead_entry_type_ == CODE_DATUM) {
       uint64_t stream_id;
       uint16_t datum;
-      stream_id = reader_.readVarU64();
+      if (version_ < 2 || (lookahead_tag_ & 3) == kTagLiteralDatum) {
+        stream_id = reader_.readVarU64();
+      } else if ((lookahead_tag_ >> 1) < dictionary_.size()) {
+        stream_id = dictionary_[lookahead_tag_ >> 1];
+      } else {
+        LOG(ERROR) << "Invalid stream code in the log file: "
+                   << (lookahead_tag_ >> 1);
+        return false;
+      }
       datum = reader_.readBeU16();
       if (!reader_.ok()) return false;
       data->emplace_back(stream_id, datum);
-      lookahead_entry_type_ = reader_.readU8();
+      readEntryType();
       continue;
     } else if (lookahead_entry_type_ == CODE_TIMESTAMP) {
-      checkpoint_ = (int64_t)reader_.position() - 1;
+      checkpoint_ = lookahead_position_;
       break;
     } else {
       LOG(ERROR) << "Unexpected entry type " << (int)lookahead_entry_type_;
@@ -97,25 +172,41 @@ bool LogFileReader::next(int64_t* timestamp, std::vector<LogSample>* data,
   return true;
 }
 
-std::vector<int64_t> CachedLogDir::list() {
+void CachedLogDir::insert(int64_t entry) {
   sync();
-  std::vector<int64_t> result;
-  for (int64_t e : entries_) {
-    result.push_back(e);
+  if (manifest_ != nullptr) manifest_->addLogFile(entry);
+  if (entries_.empty() || entries_.back() < entry) {
+    entries_.push_back(entry);
+    return;
   }
-  std::sort(result.begin(), result.end());
-  return result;
+  auto i = std::lower_bound(entries_.begin(), entries_.end(), entry);
+  if (*i != entry) entries_.insert(i, entry);
+}
+
+void CachedLogDir::erase(int64_t entry) {
+  sync();
+  auto i = std::lower_bound(entries_.begin(), entries_.end(), entry);
+  if (i != entries_.end() && *i == entry) erase(i, i + 1);
+}
+
+CachedLogDir::const_iterator CachedLogDir::erase(const_iterator first,
+                                                const_iterator last) {
+  if (manifest_ != nullptr) manifest_->removeLogFiles(first, last);
+  return entries_.erase(first, last);
 }
 
 void CachedLogDir::sync() {
   if (synced_) return;
+  if (manifest_ != nullptr) {
+    entries_ = manifest_->logFiles();
+    synced_ = true;
+    return;
+  }
   entries_.clear();
   roo_io::Mount fs = fs_.mount();
   if (!fs.ok()) return;
-  std::vector<int64_t> entries = listFiles(fs, log_dir_);
-  for (int64_t e : entries) {
-    entries_.insert(e);
-  }
+  // listFiles() returns the entries sorted.
+  entries_ = listFiles(fs, log_dir_);
   synced_ = true;
 }
 
@@ -126,7 +217,7 @@ LogReader::LogReader(roo_io::Mount& fs, const char* log_dir,
       log_dir_(log_dir),
       cache_(cache),
       resolution_(resolution),
-      entries_(cache_.list()),
+      entries_(cache_.entries()),
       group_begin_(entries_.begin()),
       cursor_(entries_.begin()),
       group_end_(entries_.begin()),
@@ -136,7 +227,9 @@ LogReader::LogReader(roo_io::Mount& fs, const char* log_dir,
       reached_hot_file_(false),
       range_floor_(0),
       range_ceil_(0),
-      reader_(fs) {
+      reader_(fs),
+      files_opened_(0),
+      files_removed_(0) {
   // Ensure that the hot file is at the end of the list, even if it is not, for
   // some reason, chronologically the newest. This way, we will always delete
   // the non-hot logs and leave the hot file be.
@@ -167,7 +260,9 @@ bool LogReader::nextRange() {
 bool LogReader::isHotRange() { return hot_file_ < range_ceil_; }
 
 bool LogReader::open(int64_t file, uint64_t position) {
-  return reader_.open(filepath(log_dir_, file).c_str(), position);
+  if (!reader_.open(filepath(log_dir_, file).c_str(), position)) return false;
+  ++files_opened_;
+  return true;
 }
 
 bool LogReader::nextSample(int64_t* timestamp, std::vector<LogSample>* data) {
@@ -192,8 +287,7 @@ bool LogReader::seek(LogCursor cursor) {
                  << cursor.file();
     return false;
   }
-  if (!reader_.open(filepath(log_dir_, cursor.file()).c_str(),
-                    cursor.position())) {
+  if (!open(cursor.file(), cursor.position())) {
     LOG(WARNING) << "Seek failed; could not open: " << roo_logging::hex
                  << cursor.file();
     return false;
@@ -207,6 +301,19 @@ LogCursor LogReader::tell() {
   return LogCursor(hot_file_, reader_.checkpoint());
 }
 
+bool LogReader::resumeCursor(LogCursor* cursor) const {
+  if (cursor_ == group_end_ || !reader_.is_open()) return false;
+  if (reader_.checkpoint() >= 0) {
+    *cursor = LogCursor(*cursor_, reader_.checkpoint());
+    return true;
+  }
+  // Reached the end of a historical file; continue with the next one.
+  auto next = cursor_ + 1;
+  if (next == group_end_) return false;
+  *cursor = LogCursor(*next, 0);
+  return true;
+}
+
 void LogReader::deleteRange() {
   CHECK(!isHotRange());
   for (auto i = group_begin_; i != group_end_; ++i) {
@@ -215,87 +322,274 @@ void LogReader::deleteRange() {
     if (fs_.remove(filepath(log_dir_, *i).c_str()) != roo_io::kOk) {
       LOG(ERROR) << "Failed to remove processed log file " << roo_logging::hex
                  << *i;
+    } else {
+      ++files_removed_;
     }
-    cache_.erase(*i);
   }
+  group_begin_ = cursor_ = group_end_ = cache_.erase(group_begin_, group_end_);
 }
 
 LogWriter::LogWriter(roo_io::Filesystem& fs, const char* log_dir,
-                     CachedLogDir& cache, Resolution resolution)
+                     CachedLogDir& cache, Resolution resolution,
+                     LogCommitPolicy policy)
     : log_dir_(log_dir),
       cache_(cache),
       resolution_(resolution),
+      policy_(policy),
       fs_(fs),
       mount_(),
+      buffer_start_ms_(0),
+      file_created_(false),
       first_timestamp_(-1),
+      file_(-1),
       last_timestamp_(-1),
-      range_ceil_(-1) {}
+      range_ceil_(-1),
+      latest_timestamp_(-1),
+      dictionary_(),
+      dictionary_used_(),
+      new_streams_(),
+      bucket_order_(),
+      bucket_position_(0),
+      bytes_committed_(0),
+      files_opened_(0) {}
+
+LogWriter::~LogWriter() { close(); }
+
+namespace {
+
+void writeU8(std::vector<uint8_t>& buffer, uint8_t value) {
+  buffer.push_back(value);
+}
+
+void writeVarU64(std::vector<uint8_t>& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((uint8_t)value | 0x80);
+    value >>= 7;
+  }
+  buffer.push_back((uint8_t)value);
+}
+
+void writeBeU16(std::vector<uint8_t>& buffer, uint16_t value) {
+  buffer.push_back(value >> 8);
+  buffer.push_back(value & 0xFF);
+}
+
+void writeHeader(std::vector<uint8_t>& buffer, int64_t base_timestamp,
+                 Resolution resolution,
+                 const std::vector<uint64_t>& dictionary) {
+  writeU8(buffer, kLogHeaderMarker);
+  writeU8(buffer, kLogFormatVersion);
+  writeVarU64(buffer, base_timestamp);
+  writeU8(buffer, resolution);
+  writeVarU64(buffer, dictionary.size());
+  uint64_t previous = 0;
+  for (uint64_t stream_id : dictionary) {
+    writeVarU64(buffer, stream_id - previous);
+    previous = stream_id;
+  }
+}
+
+}  // namespace
+
+void LogWriter::writeDatum(uint64_t stream_id, uint16_t datum) {
+  // Buckets usually hold the same streams, in the same order, so the index
+  // at the same position in the previous bucket is tried first.
+  uint32_t index = kNotInDictionary;
+  if (bucket_position_ < bucket_order_.size()) {
+    uint32_t predicted = bucket_order_[bucket_position_];
+    if (predicted < dictionary_.size() && dictionary_[predicted] == stream_id) {
+      index = predicted;
+    }
+  }
+  if (index == kNotInDictionary) {
+    auto i =
+        std::lower_bound(dictionary_.begin(), dictionary_.end(), stream_id);
+    if (i != dictionary_.end() && *i == stream_id) {
+      index = i - dictionary_.begin();
+    }
+  }
+  if (bucket_position_ < bucket_order_.size()) {
+    bucket_order_[bucket_position_] = index;
+  } else {
+    bucket_order_.push_back(index);
+  }
+  ++bucket_position_;
+  if (index != kNotInDictionary) {
+    dictionary_used_[index] = 1;
+    writeVarU64(buffer_, (uint64_t)index << 1);
+  } else {
+    new_streams_.insert(stream_id);
+    writeVarU64(buffer_, kTagLiteralDatum);
+    writeVarU64(buffer_, stream_id);
+  }
+  writeBeU16(buffer_, datum);
+}
 
-void writeTimestamp(roo_io::OutputStreamWriter& writer, int64_t timestamp) {
-  writer.writeU8(CODE_TIMESTAMP);
-  writer.writeVarU64(timestamp);
+void LogWriter::rotateDictionary() {
+  std::vector<uint64_t> next(new_streams_.begin(), new_streams_.end());
+  for (size_t i = 0; i < dictionary_.size(); ++i) {
+    if (dictionary_used_[i]) next.push_back(dictionary_[i]);
+  }
+  std::sort(next.begin(), next.end());
+  dictionary_.swap(next);
+  dictionary_used_.assign(dictionary_.size(), 0);
+  new_streams_.clear();
 }
 
-void writeDatum(roo_io::OutputStreamWriter& writer, uint64_t stream_id,
-                uint16_t transformed_datum) {
-  writer.writeU8(CODE_DATUM);
-  writer.writeVarU64(stream_id);
-  writer.writeBeU16(transformed_datum);
-  // write_float(file, datum);
+bool LogWriter::commit() {
+  if (buffer_.empty()) return true;
+  FilePath path = filepath(log_dir_, file_);
+  if (!mount_.ok()) {
+    mount_ = fs_.mount();
+    if (!mount_.ok()) {
+      LOG(ERROR) << "Failed to mount the filesystem to commit the log; "
+                    "dropping "
+                 << buffer_.size() << " bytes";
+      buffer_.clear();
+      last_timestamp_ = -1;
+      streams_.clear();
+      return false;
+    }
+  }
+  roo_io::FileUpdatePolicy update_policy = roo_io::kAppendIfExists;
+  if (!file_created_) {
+    roo_io::Status status =
+        roo_io::MkParentDirRecursively(mount_, path.c_str());
+    if (status != roo_io::kOk && status != roo_io::kDirectoryExists) {
+      LOG(ERROR) << "Failed to create the log directory: "
+                 << roo_io::StatusAsString(status);
+      buffer_.clear();
+      last_timestamp_ = -1;
+      streams_.clear();
+      return false;
+    }
+    update_policy = roo_io::kFailIfExists;
+  }
+  roo_io::OutputStreamWriter writer(
+      mount_.fopenForWrite(path.c_str(), update_policy));
+  ++files_opened_;
+  // A file by that name exists already, written before a restart within the
+  // same range. Its records are relative to its own header, so they can't be
+  // continued; the new file takes the next unused name in the range instead.
+  // (The header holds the base timestamp, so the name does not matter to the
+  // reader.)
+  while (!file_created_ && writer.status() == roo_io::kFileExists &&
+         file_ < range_ceil_) {
+    ++file_;
+    path = filepath(log_dir_, file_);
+    writer.reset(mount_.fopenForWrite(path.c_str(), roo_io::kFailIfExists));
+    ++files_opened_;
+  }
+  size_t committed = buffer_.size();
+  if (!file_created_ && writer.ok()) {
+    // If the file could not be created, the next commit tries again, with
+    // the header. Only a file that has been created is listed in the cache
+    // (and in the manifest, if any); before any data is written to it.
+    cache_.insert(file_);
+    std::vector<uint8_t> header;
+    writeHeader(header, first_timestamp_, resolution_, dictionary_);
+    writer.writeByteArray((const roo_io::byte*)header.data(), header.size());
+    committed += header.size();
+    file_created_ = true;
+  }
+  writer.writeByteArray((const roo_io::byte*)buffer_.data(), buffer_.size());
+  writer.close();
+  buffer_.clear();
+  if (writer.status() != roo_io::kClosed) {
+    LOG(ERROR) << "Failed to commit the log file " << path.c_str() << ": "
+               << roo_io::StatusAsString(writer.status());
+    // Make sure that the next record starts with a timestamp.
+    last_timestamp_ = -1;
+    streams_.clear();
+    return false;
+  }
+  bytes_committed_ += committed;
+  return true;
 }
 
-void LogWriter::open(roo_io::FileUpdatePolicy update_policy) {
-  String path = log_dir_;
-  path += "/";
-  path += Filename::forTimestamp(first_timestamp_).filename();
-  mount_ = fs_.mount();
-  roo_io::Status status = roo_io::MkParentDirRecursively(mount_, path.c_str());
-  if (status != roo_io::kOk && status != roo_io::kDirectoryExists) return;
-  //   last_log_file_path_ = path;
-  writer_.reset(mount_.fopenForWrite(path.c_str(), update_policy));
-  cache_.insert(first_timestamp_);
+void LogWriter::maybeCommit() {
+  if (buffer_.empty()) return;
+  if (policy_.release_mount()) {
+    close();
+    return;
+  }
+  if (buffer_.size() >= policy_.max_buffered_bytes() ||
+      millis() - buffer_start_ms_ >= policy_.max_delay_ms()) {
+    commit();
+  }
 }
 
 void LogWriter::close() {
-  writer_.close();
+  commit();
   mount_.close();
 }
 
+bool LogWriter::accepts(int64_t timestamp) const {
+  return timestamp >= latest_timestamp_ ||
+         latest_timestamp_ - timestamp >
+             timestamp_increment(kRangeElementCount, resolution_);
+}
+
 bool LogWriter::can_skip_write(int64_t timestamp, uint64_t stream_id) {
   return timestamp == last_timestamp_ &&
          streams_.find(stream_id) != streams_.end();
 }
 
 void LogWriter::write(int64_t timestamp, uint64_t stream_id, uint16_t datum) {
+  if (!accepts(timestamp)) return;
+  startTimestamp(timestamp);
+  if (streams_.insert(stream_id).second) {
+    // Did not exist.
+    writeDatum(stream_id, datum);
+  }
+}
+
+size_t LogWriter::writeBatch(int64_t timestamp, const uint64_t* stream_ids,
+                             const uint16_t* data, size_t count) {
+  if (!accepts(timestamp)) return 0;
+  startTimestamp(timestamp);
+  buffer_.reserve(buffer_.size() + count * 12);
+  size_t written = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (streams_.insert(stream_ids[i]).second) {
+      writeDatum(stream_ids[i], data[i]);
+      ++written;
+    }
+  }
+  return written;
+}
+
+void LogWriter::startTimestamp(int64_t timestamp) {
   // Need to handle various cases:
   // 1. Log file not yet initiated since process start
   // 2. Log file initiated, but timestamp falls outside its range
-  // 3. Log file initiated, and timestamp in range, but not yet opened
-  // 4. Log file initiated, timestamp in range, file opened
+  // 3. Log file initiated, and timestamp in range
+  // (Timestamps slightly earlier than latest_timestamp_ have been dropped;
+  // much earlier ones start a new file.)
+  latest_timestamp_ = timestamp;
   if (timestamp < last_timestamp_ || timestamp > range_ceil_) {
     // Log file either not yet created after start, or the timestamp
     // falls outside its range.
-    close();
+    commit();
+    rotateDictionary();
     Resolution range_resolution = Resolution(resolution_ + kRangeLength);
     first_timestamp_ = timestamp;
+    file_ = timestamp;
     range_ceil_ = timestamp_ms_ceil(timestamp, range_resolution);
     streams_.clear();
-    open(roo_io::kFailIfExists);
-  } else {
-    if (!writer_.ok()) {
-      open(roo_io::kAppendIfExists);
-    }
+    file_created_ = false;
+  }
+  if (buffer_.empty()) {
+    buffer_start_ms_ = millis();
   }
-
   if (timestamp != last_timestamp_) {
     last_timestamp_ = timestamp;
     streams_.clear();
-    writeTimestamp(writer_, timestamp);
-  }
-  if (streams_.insert(stream_id).second) {
-    // Did not exist.
-    writeDatum(writer_, stream_id, datum);
+    bucket_position_ = 0;
+    // Resolution steps past the base timestamp of the file.
+    uint64_t steps = (timestamp - first_timestamp_) >> (resolution_ << 1);
+    writeVarU64(buffer_, (steps << 2) | kTagTimestamp);
   }
 }
 
-}  // namespace roo_monitoring
\ No newline at end of file
+}  // namespace roo_monitoring
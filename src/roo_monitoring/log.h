@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 
 #include "resolution.h"
@@ -31,47 +32,111 @@ inline bool operator<(const LogSample& a, const LogSample& b) {
   return a.stream_id() < b.stream_id();
 }
 
-/// In-memory cache of log directory entries.
+class Manifest;
+
+/// In-memory cache of log directory entries, sorted by timestamp.
+///
+/// The directory is scanned once, on first use; afterwards, the cache is
+/// maintained incrementally. New log files are normally the newest ones, so
+/// inserting is an append; processed files are removed from the front.
 class CachedLogDir {
  public:
+  typedef std::vector<int64_t>::const_iterator const_iterator;
+
   /// Creates a cache for a specific filesystem and log directory.
-  CachedLogDir(roo_io::Filesystem& fs, const char* log_dir)
-      : fs_(fs), log_dir_(log_dir), synced_(false) {}
+  ///
+  /// If a manifest is given, the entries are read from it instead of
+  /// scanning the directory, and changes are recorded in it.
+  CachedLogDir(roo_io::Filesystem& fs, const char* log_dir,
+               Manifest* manifest = nullptr)
+      : fs_(fs), log_dir_(log_dir), manifest_(manifest), synced_(false) {}
 
   /// Inserts an entry into the cache.
-  void insert(int64_t entry) {
-    sync();
-    entries_.insert(entry);
-  }
+  void insert(int64_t entry);
 
   /// Removes an entry from the cache.
-  void erase(int64_t entry) {
+  void erase(int64_t entry);
+
+  /// Removes the entries in [first, last), and returns the iterator that
+  /// follows them.
+  const_iterator erase(const_iterator first, const_iterator last);
+
+  /// Returns the cached entries, sorted by timestamp, without copying.
+  ///
+  /// The reference stays valid for the lifetime of the cache; iterators are
+  /// invalidated by `insert()` and `erase()`.
+  const std::vector<int64_t>& entries() {
     sync();
-    entries_.erase(entry);
+    return entries_;
   }
 
-  /// Returns the cached entries sorted by timestamp.
-  std::vector<int64_t> list();
+  /// Returns the number of cached entries.
+  size_t size() { return entries().size(); }
+
+  /// Returns true if the cache contains the specified entry.
+  bool contains(int64_t entry) {
+    const std::vector<int64_t>& all = entries();
+    return std::binary_search(all.begin(), all.end(), entry);
+  }
 
  private:
   void sync();
 
   roo_io::Filesystem& fs_;
   const char* log_dir_;
+  Manifest* manifest_;
   bool synced_;
 
-  roo_collections::FlatSmallHashSet<int64_t> entries_;
+  std::vector<int64_t> entries_;
 };
 
 /// Reader for a single log file.
+///
+/// A log file holds buckets of samples that share a timestamp, written within
+/// a single range. Since version 2, a log file has the following format:
+///
+/// header:
+///   marker         (uint8): 0
+///   version        (uint8): 2
+///   base timestamp (varint): timestamp of the first bucket (the file name)
+///   resolution     (uint8)
+///   dictionary:
+///     size         (varint)
+///     stream ID[]  (varint): sorted, each stored as the delta to the
+///                  previous one
+/// record[]: a tag (varint), followed by:
+///   tag % 2 == 0: a sample of the dictionary stream at index tag / 2:
+///     value        (uint16)
+///   tag % 4 == 1: the start of the bucket at (tag / 4) resolution steps
+///                 past the base timestamp
+///   tag % 4 == 3: a sample of a stream missing from the dictionary (tag / 4
+///                 is reserved, 0):
+///     stream ID    (varint)
+///     value        (uint16)
+///
+/// Version 1 files, which have no header, hold records of a type byte (1 for
+/// a bucket, 2 for a sample), followed by the absolute timestamp (varint), or
+/// by the stream ID (varint) and the value (uint16). They are still read, so
+/// that log files written before an upgrade get compacted.
 class LogFileReader {
  public:
   /// Creates a reader over the specified mount.
-  LogFileReader(roo_io::Mount& mount) : fs_(mount) {}
+  LogFileReader(roo_io::Mount& mount)
+      : fs_(mount),
+        version_(0),
+        base_timestamp_(0),
+        resolution_(kResolution_1_ms) {}
 
   /// Opens the log file at path and seeks to checkpoint.
   bool open(const char* path, int64_t checkpoint);
 
+  /// Returns the format version of the open file.
+  uint8_t version() const { return version_; }
+
+  /// Returns the stream dictionary of the open file (sorted); empty in
+  /// version 1 files.
+  const std::vector<uint64_t>& dictionary() const { return dictionary_; }
+
   /// Returns true if a file is currently open.
   bool is_open() const { return reader_.isOpen(); }
 
@@ -85,10 +150,24 @@ class LogFileReader {
   bool next(int64_t* timestamp, std::vector<LogSample>* data, bool is_hot);
 
  private:
+  // Reads the version 2 header, if the file has one.
+  bool readHeader();
+
+  // Reads the type (and, in version 2, the tag) of the next record.
+  void readEntryType();
+
   roo_io::Mount& fs_;
   roo_io::MultipassInputStreamReader reader_;
   uint8_t lookahead_entry_type_;
+  uint64_t lookahead_tag_;
+  int64_t lookahead_position_;
   int64_t checkpoint_;
+
+  // Header of the open file.
+  uint8_t version_;
+  int64_t base_timestamp_;
+  Resolution resolution_;
+  std::vector<uint64_t> dictionary_;
 };
 
 /// Cursor used when seeking through multiple log files.
@@ -125,6 +204,12 @@ class LogReader {
   bool seek(LogCursor cursor);
   /// Returns the current cursor.
   LogCursor tell();
+  /// Returns the cursor at which reading of the current range can be resumed,
+  /// after a call to `nextSample()` returned true.
+  ///
+  /// Unlike `tell()`, works for historical ranges too. Returns false if there
+  /// is no more data to read in the range.
+  bool resumeCursor(LogCursor* cursor) const;
 
   /// Returns true if the current range is hot (still being written).
   bool isHotRange();
@@ -134,6 +219,12 @@ class LogReader {
   /// Reads the next sample in the current range.
   bool nextSample(int64_t* timestamp, std::vector<LogSample>* data);
 
+  /// Returns the number of log files opened by this reader.
+  uint32_t files_opened() const { return files_opened_; }
+
+  /// Returns the number of log files removed by this reader.
+  uint32_t files_removed() const { return files_removed_; }
+
  private:
   bool open(int64_t file, uint64_t position);
 
@@ -141,7 +232,7 @@ class LogReader {
   const char* log_dir_;
   CachedLogDir& cache_;
   Resolution resolution_;
-  std::vector<int64_t> entries_;
+  const std::vector<int64_t>& entries_;
   std::vector<int64_t>::const_iterator group_begin_;
   std::vector<int64_t>::const_iterator cursor_;
   std::vector<int64_t>::const_iterator group_end_;
@@ -150,48 +241,215 @@ class LogReader {
   int64_t range_floor_;
   int64_t range_ceil_;
   LogFileReader reader_;
+  uint32_t files_opened_;
+  uint32_t files_removed_;
+};
+
+/// Policy that determines when buffered log data is committed to the file.
+///
+/// Log records are buffered in memory, and committed in groups: a commit
+/// appends all buffered records to the log file, and closes it. Data is
+/// durable (i.e. survives a reset or a power loss) once it has been
+/// committed; data that is still buffered is lost if the device resets.
+/// Buffered data is always committed on `Writer::sync()`, when the log file
+/// rotates to a new time range, and when the writer is closed or destroyed.
+///
+/// The policy is evaluated at the end of every write transaction, and on
+/// every `Writer::flushSome()`.
+class LogCommitPolicy {
+ public:
+  /// Commits at the end of every write transaction, and releases the
+  /// filesystem mount in between. Nothing is ever lost, at the cost of
+  /// re-mounting and re-opening the file for every transaction. This is the
+  /// default.
+  static LogCommitPolicy EveryTransaction() {
+    return LogCommitPolicy(0, 0, true);
+  }
+
+  /// Commits once at least the specified number of bytes are buffered.
+  static LogCommitPolicy BufferedBytes(size_t max_buffered_bytes) {
+    return LogCommitPolicy(max_buffered_bytes, kNever, false);
+  }
+
+  /// Commits once the oldest buffered data is at least the specified number
+  /// of milliseconds old.
+  static LogCommitPolicy Delay(uint32_t max_delay_ms) {
+    return LogCommitPolicy(kNever, max_delay_ms, false);
+  }
+
+  /// Commits when either the byte or the delay threshold is reached.
+  static LogCommitPolicy BufferedBytesOrDelay(size_t max_buffered_bytes,
+                                              uint32_t max_delay_ms) {
+    return LogCommitPolicy(max_buffered_bytes, max_delay_ms, false);
+  }
+
+  /// Commits only on explicit `Writer::sync()` (and on log file rotation).
+  ///
+  /// Note that the buffer is not bounded in this case.
+  static LogCommitPolicy Manual() {
+    return LogCommitPolicy(kNever, kNever, false);
+  }
+
+  /// Returns the number of buffered bytes that triggers a commit.
+  size_t max_buffered_bytes() const { return max_buffered_bytes_; }
+
+  /// Returns the age, in milliseconds, of buffered data that triggers a
+  /// commit.
+  uint32_t max_delay_ms() const { return max_delay_ms_; }
+
+  /// Returns true if the mount should be released after every commit.
+  bool release_mount() const { return release_mount_; }
+
+ private:
+  static constexpr uint32_t kNever = 0xFFFFFFFF;
+
+  LogCommitPolicy(size_t max_buffered_bytes, uint32_t max_delay_ms,
+                  bool release_mount)
+      : max_buffered_bytes_(max_buffered_bytes),
+        max_delay_ms_(max_delay_ms),
+        release_mount_(release_mount) {}
+
+  size_t max_buffered_bytes_;
+  uint32_t max_delay_ms_;
+  bool release_mount_;
 };
 
 /// Writer for log files at a fixed resolution.
+///
+/// Buffers the records in memory, and commits them to the log file according
+/// to the `LogCommitPolicy`. Writes version 2 files (see `LogFileReader`);
+/// the stream dictionary of every file holds the streams written to the
+/// previous file by this writer. In steady state, a sample (of one of the
+/// first 64 dictionary streams) takes 3 bytes, and a bucket timestamp 1 or 2.
 class LogWriter {
  public:
   /// Creates a log writer for the specified directory and resolution.
   LogWriter(roo_io::Filesystem& fs, const char* log_dir, CachedLogDir& cache,
-            Resolution resolution);
+            Resolution resolution,
+            LogCommitPolicy policy = LogCommitPolicy::EveryTransaction());
+
+  /// Commits any buffered data.
+  ~LogWriter();
 
   /// Returns the resolution used for this writer.
   Resolution resolution() const { return resolution_; }
 
-  /// Opens the log file according to the update policy.
-  void open(roo_io::FileUpdatePolicy update_policy);
-  /// Closes the log file.
+  /// Returns the commit policy.
+  const LogCommitPolicy& policy() const { return policy_; }
+
+  /// Commits the buffered data, if the commit policy says so.
+  void maybeCommit();
+
+  /// Appends all buffered data to the log file.
+  ///
+  /// Returns false on I/O error, in which case the buffered data is dropped.
+  bool commit();
+
+  /// Commits the buffered data, and releases the filesystem mount.
   void close();
 
-  /// Writes a single log sample.
+  /// Writes a single log sample. The timestamp must be a multiple of the
+  /// resolution step (i.e. floored to the resolution).
   void write(int64_t timestamp, uint64_t stream_id, uint16_t datum);
+  /// Writes samples of `count` streams, all at the same timestamp.
+  ///
+  /// Equivalent to calling `write()` for each sample, but does the timestamp
+  /// bookkeeping only once. Returns the number of samples written, i.e.
+  /// excluding duplicates.
+  size_t writeBatch(int64_t timestamp, const uint64_t* stream_ids,
+                    const uint16_t* data, size_t count);
   /// Returns true if a write can be skipped for this bucket.
   bool can_skip_write(int64_t timestamp, uint64_t stream_id);
 
+  /// Returns false if the timestamp precedes the latest one written by less
+  /// than a range, in which case `write()` and `writeBatch()` drop the
+  /// samples. (A log file started at the earlier timestamp could overlap the
+  /// existing ones.) A larger step back is taken to be a clock correction;
+  /// the samples are written to a new log file, and the later timestamps are
+  /// no longer required.
+  bool accepts(int64_t timestamp) const;
+
   /// Returns the first timestamp recorded in the current file.
   int64_t first_timestamp() const { return first_timestamp_; }
 
+  /// Returns the name of the current log file, as a timestamp.
+  ///
+  /// Normally the same as `first_timestamp()`. If a file by that name exists
+  /// already (e.g. one written before a restart), the file gets the next
+  /// unused name in the range instead.
+  int64_t file() const { return file_; }
+
+  /// Returns the number of bytes buffered and not yet committed.
+  size_t buffered_bytes() const { return buffer_.size(); }
+
+  /// Returns the total number of bytes committed to log files.
+  uint64_t bytes_committed() const { return bytes_committed_; }
+
+  /// Returns the number of times a log file has been opened for commit.
+  uint32_t files_opened() const { return files_opened_; }
+
+  /// Returns the stream dictionary of the current log file (sorted).
+  const std::vector<uint64_t>& dictionary() const { return dictionary_; }
+
  private:
+  // Rotates the log file if needed, and starts the bucket for the specified
+  // timestamp.
+  void startTimestamp(int64_t timestamp);
+
+  // Appends the sample record to buffer_.
+  void writeDatum(uint64_t stream_id, uint16_t datum);
+
+  // Sets the dictionary of the next file to the streams written to the
+  // current one.
+  void rotateDictionary();
+
   // const that contains the path where log files are stored.
   const char* log_dir_;
   CachedLogDir& cache_;
   Resolution resolution_;
+  LogCommitPolicy policy_;
 
   roo_io::Filesystem& fs_;
   roo_io::Mount mount_;
-  roo_io::OutputStreamWriter writer_;
+
+  // Encoded records that have not yet been committed.
+  std::vector<uint8_t> buffer_;
+
+  // The value of millis() when the first record in buffer_ was added.
+  unsigned long buffer_start_ms_;
+
+  // Whether the current log file has been created.
+  bool file_created_;
 
   // For tentatively deduplicating data reported in the same target
   // resolution bucket.
   roo_collections::FlatSmallHashSet<uint64_t> streams_;
 
   int64_t first_timestamp_;
+  int64_t file_;
   int64_t last_timestamp_;
   int64_t range_ceil_;
+
+  // The latest timestamp written, or the one after a clock correction.
+  // Unlike last_timestamp_, not reset when a commit fails.
+  int64_t latest_timestamp_;
+
+  // Stream dictionary of the current file (sorted), and whether each of its
+  // streams has been written to the file.
+  std::vector<uint64_t> dictionary_;
+  std::vector<uint8_t> dictionary_used_;
+
+  // Streams written to the current file that are not in the dictionary.
+  roo_collections::FlatSmallHashSet<uint64_t> new_streams_;
+
+  // Dictionary indices of the samples of the last bucket, in the order
+  // written (or 0xFFFFFFFF for streams not in the dictionary), and the
+  // position in the current bucket.
+  std::vector<uint32_t> bucket_order_;
+  size_t bucket_position_;
+
+  uint64_t bytes_committed_;
+  uint32_t files_opened_;
 };
 
 }  // namespace roo_monitoring
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include "manifest.h"
+
+#include <algorithm>
+
+#include "roo_io/data/input_stream_reader.h"
+#include "roo_io/data/output_stream_writer.h"
+#include "roo_io/fs/fsutil.h"
+#include "roo_logging.h"
+#include "vault.h"
+
+#ifndef MLOG_roo_monitoring_manifest
+#define MLOG_roo_monitoring_manifest 0
+#endif
+
+namespace roo_monitoring {
+
+namespace {
+
+static const uint8_t kManifestMajorVersion = 1;
+static const uint8_t kManifestMinorVersion = 0;
+
+// Written at the end of the manifest, to detect truncated files.
+static const uint32_t kManifestEndMagic = 0x4D4E4654;  // "MNFT"
+
+void writeList(roo_io::OutputStreamWriter& writer,
+               const std::vector<int64_t>& list) {
+  writer.writeVarU64(list.size());
+  int64_t previous = 0;
+  for (int64_t entry : list) {
+    writer.writeVarU64(entry - previous);
+    previous = entry;
+  }
+}
+
+bool readList(roo_io::InputStreamReader& reader, std::vector<int64_t>* list) {
+  uint64_t count = reader.readVarU64();
+  if (!reader.ok()) return false;
+  list->clear();
+  list->reserve(count);
+  int64_t entry = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    entry += reader.readVarU64();
+    if (!reader.ok()) return false;
+    list->push_back(entry);
+  }
+  return true;
+}
+
+void vaultDirPath(const char* base_dir, Resolution resolution,
+                  FilePath* path) {
+  *path = FilePath(base_dir);
+  path->append("/vault-");
+  path->append(toHexDigit((resolution >> 4) & 0xF));
+  path->append(toHexDigit((resolution >> 0) & 0xF));
+}
+
+}  // namespace
+
+Manifest::Manifest(roo_io::Filesystem& fs, const char* base_dir)
+    : fs_(fs), base_dir_(base_dir) {
+  path_ = FilePath(base_dir).append("/manifest");
+  tmp_path_ = FilePath(path_.c_str()).append(".tmp");
+}
+
+roo_io::Status Manifest::load() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  roo_io::Mount fs = fs_.mount();
+  if (!fs.ok()) return fs.status();
+  auto reader = roo_io::OpenDataFile(fs, path_.c_str());
+  if (reader.ok()) {
+    uint8_t major = reader.readU8();
+    uint8_t minor = reader.readU8();
+    bool ok = reader.ok() && major == kManifestMajorVersion &&
+              readList(reader, &log_files_);
+    for (int r = 0; ok && r <= kMaxResolution; ++r) {
+      ok = readList(reader, &vault_files_[r]);
+    }
+    ok = ok && reader.readBeU32() == kManifestEndMagic && reader.ok();
+    reader.close();
+    if (ok) {
+      MLOG(roo_monitoring_manifest)
+          << "Loaded manifest " << path_.c_str() << ", version "
+          << (int)major << "." << (int)minor << ", with " << log_files_.size()
+          << " log files";
+      return roo_io::kOk;
+    }
+    LOG(WARNING) << "Manifest " << path_.c_str()
+                 << " is corrupted; rebuilding";
+  } else if (reader.status() != roo_io::kNotFound) {
+    LOG(WARNING) << "Failed to open manifest " << path_.c_str() << ": "
+                 << roo_io::StatusAsString(reader.status()) << "; rebuilding";
+  }
+  rebuild(fs);
+  return save();
+}
+
+void Manifest::rebuild(roo_io::Mount& fs) {
+  FilePath log_dir = FilePath(base_dir_).append('/').append(kLogSubPath);
+  log_files_ = listFiles(fs, log_dir.c_str());
+  for (int r = 0; r <= kMaxResolution; ++r) {
+    std::vector<int64_t>& files = vault_files_[r];
+    files.clear();
+    FilePath vault_dir;
+    vaultDirPath(base_dir_, (Resolution)r, &vault_dir);
+    std::vector<FilePath> groups;
+    {
+      roo_io::Directory dir = fs.opendir(vault_dir.c_str());
+      if (!dir.isOpen()) continue;
+      while (dir.read()) {
+        if (!dir.entry().isDirectory() || dir.entry().name()[0] == '.') {
+          continue;
+        }
+        groups.push_back(
+            FilePath(vault_dir.c_str()).append('/').append(dir.entry().name()));
+      }
+    }
+    for (const FilePath& group : groups) {
+      std::vector<int64_t> group_files = listFiles(fs, group.c_str());
+      files.insert(files.end(), group_files.begin(), group_files.end());
+    }
+    std::sort(files.begin(), files.end());
+  }
+  MLOG(roo_monitoring_manifest)
+      << "Rebuilt manifest " << path_.c_str() << " with "
+      << log_files_.size() << " log files";
+}
+
+std::vector<int64_t> Manifest::logFiles() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return log_files_;
+}
+
+void Manifest::addLogFile(int64_t file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto i = std::lower_bound(log_files_.begin(), log_files_.end(), file);
+  if (i != log_files_.end() && *i == file) return;
+  log_files_.insert(i, file);
+  save();
+}
+
+void Manifest::removeLogFiles(std::vector<int64_t>::const_iterator first,
+                              std::vector<int64_t>::const_iterator last) {
+  if (first == last) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto out = log_files_.begin();
+  for (auto i = log_files_.begin(); i != log_files_.end(); ++i) {
+    while (first != last && *first < *i) ++first;
+    if (first != last && *first == *i) continue;
+    *out++ = *i;
+  }
+  log_files_.erase(out, log_files_.end());
+  save();
+}
+
+bool Manifest::hasVaultFile(const VaultFileRef& ref) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const std::vector<int64_t>& files = vault_files_[ref.resolution()];
+  return std::binary_search(files.begin(), files.end(), ref.timestamp());
+}
+
+void Manifest::addVaultFile(const VaultFileRef& ref) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<int64_t>& files = vault_files_[ref.resolution()];
+  auto i = std::lower_bound(files.begin(), files.end(), ref.timestamp());
+  if (i != files.end() && *i == ref.timestamp()) return;
+  files.insert(i, ref.timestamp());
+  save();
+}
+
+roo_io::Status Manifest::save() {
+  roo_io::Mount fs = fs_.mount();
+  if (!fs.ok()) return fs.status();
+  roo_io::Status status = roo_io::MkParentDirRecursively(fs, path_.c_str());
+  if (status != roo_io::kOk && status != roo_io::kDirectoryExists) {
+    return status;
+  }
+  {
+    auto writer = roo_io::OpenDataFileForWrite(fs, tmp_path_.c_str(),
+                                               roo_io::kTruncateIfExists);
+    writer.writeU8(kManifestMajorVersion);
+    writer.writeU8(kManifestMinorVersion);
+    writeList(writer, log_files_);
+    for (int r = 0; r <= kMaxResolution; ++r) {
+      writeList(writer, vault_files_[r]);
+    }
+    writer.writeBeU32(kManifestEndMagic);
+    writer.close();
+    status = writer.status();
+  }
+  if (status == roo_io::kClosed) {
+    status = fs.rename(tmp_path_.c_str(), path_.c_str());
+    if (status != roo_io::kOk) {
+      // Some filesystems do not rename over existing files. Not atomic, but
+      // a missing manifest is merely rebuilt.
+      fs.remove(path_.c_str());
+      status = fs.rename(tmp_path_.c_str(), path_.c_str());
+    }
+  }
+  if (status != roo_io::kOk) {
+    LOG(ERROR) << "Failed to update manifest " << path_.c_str() << ": "
+               << roo_io::StatusAsString(status)
+               << "; removing it, to be rebuilt on the next load";
+    fs.remove(tmp_path_.c_str());
+    fs.remove(path_.c_str());
+    return status;
+  }
+  return roo_io::kOk;
+}
+
+}  // namespace roo_monitoring
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "resolution.h"
+#include "roo_io/fs/filesystem.h"
+
+namespace roo_monitoring {
+
+class VaultFileRef;
+
+/// Persistent list of the log and vault files of a collection.
+///
+/// Lets the writer start up without scanning the log directory, and lets
+/// readers skip vault files that do not exist without probing the
+/// filesystem; this matters for sparse data on slow (e.g. flash or
+/// network-backed) storage.
+///
+/// The manifest is a superset of the files that exist: entries are added
+/// before files are created, and removed after files are deleted, so a
+/// crash can leave a stale entry (which costs a probe), but never a
+/// missing one. Every update rewrites the manifest file into a temporary
+/// file and renames it into place. If that fails, the manifest file is
+/// removed, so that it gets rebuilt by a scan on the next load.
+///
+/// Thread-safe.
+class Manifest {
+ public:
+  /// Creates a manifest of the collection stored under base_dir.
+  Manifest(roo_io::Filesystem& fs, const char* base_dir);
+
+  Manifest(const Manifest&) = delete;
+  Manifest& operator=(const Manifest&) = delete;
+
+  /// Reads the manifest file. If it does not exist, or cannot be read,
+  /// rebuilds the manifest by scanning the log and vault directories, and
+  /// saves it.
+  roo_io::Status load();
+
+  /// Returns the log files (as timestamps), sorted.
+  std::vector<int64_t> logFiles() const;
+
+  /// Records that the specified log file is about to be created.
+  void addLogFile(int64_t file);
+
+  /// Records that the specified (sorted) log files have been removed.
+  void removeLogFiles(std::vector<int64_t>::const_iterator first,
+                      std::vector<int64_t>::const_iterator last);
+
+  /// Returns true if the specified vault file may exist; false if it
+  /// definitely does not.
+  bool hasVaultFile(const VaultFileRef& ref) const;
+
+  /// Records that the specified vault file is about to be created.
+  void addVaultFile(const VaultFileRef& ref);
+
+ private:
+  // Scans the log and vault directories.
+  void rebuild(roo_io::Mount& fs);
+
+  // Writes the manifest file; must be called with mutex_ held.
+  roo_io::Status save();
+
+  roo_io::Filesystem& fs_;
+  const char* base_dir_;
+  FilePath path_;
+  FilePath tmp_path_;
+
+  mutable std::mutex mutex_;
+
+  // All sorted.
+  std::vector<int64_t> log_files_;
+  std::vector<int64_t> vault_files_[kMaxResolution + 1];
+};
+
+}  // namespace roo_monitoring
@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#include <string.h>
+
+#if ROO_MONITORING_HAS_MMAP
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace roo_monitoring {
+
+#if ROO_MONITORING_HAS_MMAP
+
+bool MappedFile::map(const char* root, const char* path) {
+  unmap();
+  char full_path[PATH_MAX];
+  size_t root_length = strlen(root);
+  size_t path_length = strlen(path);
+  if (root_length + path_length >= sizeof(full_path)) return false;
+  memcpy(full_path, root, root_length);
+  memcpy(full_path + root_length, path, path_length + 1);
+  int fd = ::open(full_path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+  // The mapping stays valid after the descriptor is closed.
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) return false;
+  data_ = static_cast<const uint8_t*>(data);
+  size_ = st.st_size;
+  return true;
+}
+
+void MappedFile::unmap() {
+  if (data_ == nullptr) return;
+  munmap(const_cast<uint8_t*>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+#else
+
+bool MappedFile::map(const char* root, const char* path) { return false; }
+
+void MappedFile::unmap() {}
+
+#endif
+
+}  // namespace roo_monitoring
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define ROO_MONITORING_HAS_MMAP 1
+#else
+#define ROO_MONITORING_HAS_MMAP 0
+#endif
+
+namespace roo_monitoring {
+
+/// Read-only memory mapping of a file on the host filesystem.
+///
+/// Only available on POSIX hosts (see ROO_MONITORING_HAS_MMAP); elsewhere,
+/// `map()` always fails, so that callers fall back to reading through the
+/// filesystem abstraction.
+class MappedFile {
+ public:
+  MappedFile() : data_(nullptr), size_(0) {}
+  ~MappedFile() { unmap(); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /// Maps the file at root + path (e.g. the mount point of a filesystem,
+  /// and a path within it), replacing any previous mapping. Returns false if
+  /// the file does not exist, is empty, or cannot be mapped.
+  bool map(const char* root, const char* path);
+
+  /// Releases the mapping, if any.
+  void unmap();
+
+  /// Returns true if a file is mapped.
+  bool mapped() const { return data_ != nullptr; }
+
+  /// Returns the mapped bytes, or nullptr if not mapped.
+  const uint8_t* data() const { return data_; }
+
+  /// Returns the size of the mapped file, in bytes.
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+}  // namespace roo_monitoring
@@ -1,14 +1,18 @@
 
+#include <algorithm>
 #include <map>
+#include <utility>
 
 #include "common.h"
 #include "compaction.h"
 #include "log.h"
+#include "manifest.h"
 #include "roo_io/data/input_stream_reader.h"
 #include "roo_io/data/output_stream_writer.h"
 #include "roo_io/fs/fsutil.h"
 #include "roo_logging.h"
 #include "roo_monitoring.h"
+#include "vault_cache.h"
 
 #ifdef ROO_TESTING
 const char* GetVfsRoot();
@@ -29,38 +33,116 @@ Collection::Collection(roo_io::Filesystem& fs, String name,
     : fs_(fs),
       name_(name),
       resolution_(resolution),
-      transform_(Transform::Linear(256, 0x8000)) {
+      transform_(Transform::Linear(256, 0x8000)),
+      vault_compression_(false) {
   base_dir_ = kMonitoringBasePath;
   base_dir_ += "/";
-  base_dir_ += name;
+  if (base_dir_.length() + name.length() <= FilePath::kMaxBaseDirLength) {
+    base_dir_ += name;
+    return;
+  }
+  // The name does not leave room for the longest file path. Truncate it, and
+  // append a hash of the full name, so that distinct names that share a long
+  // prefix still get distinct directories.
+  uint32_t hash = 2166136261u;
+  for (const char* c = name.c_str(); *c != 0; ++c) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  base_dir_ += name.substring(0, FilePath::kMaxBaseDirLength -
+                                     base_dir_.length() - 9);
+  base_dir_ += '-';
+  for (int shift = 28; shift >= 0; shift -= 4) {
+    base_dir_ += toHexDigit((hash >> shift) & 0xF);
+  }
+  LOG(WARNING) << "Collection name too long: " << name.c_str()
+               << "; using directory " << base_dir_.c_str();
+}
+
+Collection::~Collection() {}
+
+void Collection::enableVaultCache(size_t max_bytes) {
+  vault_cache_.reset(new VaultCache(max_bytes));
 }
 
-Writer::Writer(Collection* collection)
+roo_io::Status Collection::enableManifest() {
+  manifest_.reset(new Manifest(fs_, base_dir_.c_str()));
+  return manifest_->load();
+}
+
+void Collection::enableMappedReads(const char* host_root) {
+  mapped_reads_root_ = host_root;
+}
+
+Writer::Writer(Collection* collection, LogCommitPolicy policy)
     : collection_(collection),
       log_dir_(subdir(collection->base_dir_, kLogSubPath)),
-      cache_(collection->fs(), log_dir_.c_str()),
+      cache_(collection->fs(), log_dir_.c_str(), collection->manifest()),
       writer_(collection->fs(), log_dir_.c_str(), cache_,
-              collection->resolution()),
+              collection->resolution(), policy),
       io_state_(Writer::IOSTATE_OK),
       compaction_head_index_end_(0),
       is_hot_range_(false),
-      flush_in_progress_(false) {}
+      flush_in_progress_(false),
+      flushed_until_(0),
+      compaction_fused_(false),
+      base_write_paused_(false),
+      compaction_paused_(false),
+      vault_history_(new VaultWriteHistory()),
+      budget_(nullptr),
+      stats_() {}
+
+Writer::~Writer() {}
+
+void Writer::enableFusedCompaction() {
+  fused_.reset(new FusedCompaction(collection_, vault_history_.get()));
+}
 
 WriteTransaction::WriteTransaction(Writer* writer)
     : transform_(&writer->collection_->transform()),
-      writer_(&writer->writer_) {}
+      writer_(&writer->writer_),
+      stats_(&writer->stats_) {}
 
-WriteTransaction::~WriteTransaction() { writer_->close(); }
+WriteTransaction::~WriteTransaction() { writer_->maybeCommit(); }
 
 void WriteTransaction::write(int64_t timestamp_ms, uint64_t stream_id,
                              float datum) {
   int64_t ts_rounded = timestamp_ms_floor(timestamp_ms, writer_->resolution());
+  if (!writer_->accepts(ts_rounded)) {
+    ++stats_->samples_dropped;
+    return;
+  }
   if (writer_->can_skip_write(ts_rounded, stream_id)) {
     // Fast path: already written data for this bucket.
+    ++stats_->samples_deduplicated;
     return;
   }
   uint16_t transformed = transform_->apply(datum);
   writer_->write(ts_rounded, stream_id, transformed);
+  ++stats_->samples_written;
+}
+
+void WriteTransaction::writeBatch(int64_t timestamp_ms,
+                                  const uint64_t* stream_ids,
+                                  const float* data, size_t count) {
+  int64_t ts_rounded = timestamp_ms_floor(timestamp_ms, writer_->resolution());
+  if (!writer_->accepts(ts_rounded)) {
+    stats_->samples_dropped += count;
+    return;
+  }
+  // Transform in fixed-size chunks, to avoid allocating.
+  static const size_t kChunkSize = 64;
+  uint16_t transformed[kChunkSize];
+  while (count > 0) {
+    size_t chunk = count < kChunkSize ? count : kChunkSize;
+    transform_->applyBatch(data, transformed, chunk);
+    size_t written =
+        writer_->writeBatch(ts_rounded, stream_ids, transformed, chunk);
+    stats_->samples_written += written;
+    stats_->samples_deduplicated += chunk - written;
+    stream_ids += chunk;
+    data += chunk;
+    count -= chunk;
+  }
 }
 
 class LogCompactionCursor {
@@ -82,17 +164,17 @@ class LogCompactionCursor {
 
 namespace {
 
-String getLogCompactionCursorPath(const Collection* collection,
-                                  const VaultFileRef& ref) {
-  String cursor_file_path;
+FilePath getLogCompactionCursorPath(const Collection* collection,
+                                    const VaultFileRef& ref) {
+  FilePath cursor_file_path;
   collection->getVaultFilePath(ref, &cursor_file_path);
-  cursor_file_path += ".cursor";
+  cursor_file_path.append(".cursor");
   return cursor_file_path;
 }
 
-roo_io::Status tryReadLogCompactionCursor(roo_io::Mount& fs,
-                                          const char* cursor_path,
-                                          LogCompactionCursor* result) {
+// Reads a cursor file, used by vault files older than format 1.4.
+roo_io::Status tryReadCursorFile(roo_io::Mount& fs, const char* cursor_path,
+                                 LogCompactionCursor* result) {
   auto reader = roo_io::OpenDataFile(fs, cursor_path);
   if (!reader.ok()) {
     if (reader.status() != roo_io::kNotFound) {
@@ -120,6 +202,51 @@ roo_io::Status tryReadLogCompactionCursor(roo_io::Mount& fs,
   return roo_io::kOk;
 }
 
+// Reads the compaction cursor of the specified vault file, and sets
+// minor_version to the format of the file. Since format 1.4, the cursor is
+// embedded in the vault file. Older files have it in a separate cursor file,
+// which is removed once read.
+roo_io::Status tryReadLogCompactionCursor(roo_io::Mount& fs,
+                                          const Collection* collection,
+                                          const VaultFileRef& ref,
+                                          LogCompactionCursor* result,
+                                          uint8_t* minor_version,
+                                          WriterStats* stats) {
+  VaultFileReader vault(collection);
+  bool opened = vault.open(ref, 0, 0);
+  stats->files_opened += vault.stats().files_opened;
+  if (!opened) return roo_io::kNotFound;
+  *minor_version = vault.minor_version();
+  if (vault.minor_version() >= 4) {
+    int write_index;
+    LogCursor source;
+    if (!vault.readCompactionCursor(&write_index, &source)) {
+      return roo_io::kNotFound;
+    }
+    *result = LogCompactionCursor(source, write_index);
+    MLOG(roo_monitoring_compaction)
+        << "Found the compaction cursor of " << ref << ": " << roo_logging::hex
+        << source.file() << roo_logging::dec << ", " << source.position()
+        << ", " << write_index;
+    return roo_io::kOk;
+  }
+  vault.close();
+  FilePath cursor_path = getLogCompactionCursorPath(collection, ref);
+  roo_io::Status status = tryReadCursorFile(fs, cursor_path.c_str(), result);
+  if (status == roo_io::kNotFound) return status;
+  if (status == roo_io::kOk) ++stats->files_opened;
+  roo_io::Status remove_status = fs.remove(cursor_path.c_str());
+  if (remove_status == roo_io::kOk) {
+    ++stats->files_removed;
+  } else if (status == roo_io::kOk) {
+    // Could be read again later, when stale.
+    LOG(ERROR) << "Failed to delete cursor file " << cursor_path.c_str()
+               << ": " << roo_io::StatusAsString(remove_status);
+    return remove_status;
+  }
+  return status;
+}
+
 bool writeCursor(roo_io::Mount& fs, const char* cursor_path,
                  const LogCompactionCursor cursor) {
   auto writer = OpenDataFileForWrite(fs, cursor_path, roo_io::kFailIfExists);
@@ -146,6 +273,30 @@ bool writeCursor(roo_io::Mount& fs, const char* cursor_path,
   return true;
 }
 
+// Records the compaction cursor of the unfinished vault file being written,
+// with the specified position in the source file: in the vault file itself
+// or, for files older than format 1.4, in a separate cursor file. Must be
+// called right before the writer is closed.
+bool saveLogCompactionCursor(roo_io::Mount& fs, const Collection* collection,
+                             VaultWriter& writer, const LogCursor& source,
+                             WriterStats* stats) {
+  if (writer.embeds_cursor()) {
+    writer.writeCompactionCursor(source);
+    if (!writer.ok()) return false;
+    ++stats->cursors_embedded;
+    return true;
+  }
+  FilePath cursor_path =
+      getLogCompactionCursorPath(collection, writer.vault_ref());
+  if (!writeCursor(fs, cursor_path.c_str(),
+                   LogCompactionCursor(source, writer.write_index()))) {
+    return false;
+  }
+  ++stats->files_opened;
+  ++stats->cursor_files_written;
+  return true;
+}
+
 }  // namespace
 
 // Vault files form a hierarchy. Four vault files from a lower level cover the
@@ -160,208 +311,308 @@ bool writeCursor(roo_io::Mount& fs, const char* cursor_path,
 // vault files, which are only partially filled. Every time 4 new entries are
 // added to the lower-level 'hot' vault file, these new entries can be compacted
 // into one new entry in the higher level 'hot' vault file. In order to support
-// that, hot files are accompanied by 'compaction cursor' files. A compaction
-// cursor file has the following format:
+// that, hot files end with a 'compaction cursor' record (see VaultFileReader
+// for the format), which holds:
 //
-// * target datum index (uint8): the current count of entries in the
-//   higher-level vault file. Always within [0 - 255].
-// * source file (varint): the start_timestamp (thus filename) of the
-//   lower-level hot file that is being compacted.
-// * source checkpoint (varint): byte offset in the lower level file up
-//   to which the data has already been compacted.
+// * target datum index: the current count of entries in the higher-level
+//   vault file. Always within [0 - 255].
+// * source file: the start_timestamp (thus filename) of the lower-level hot
+//   file (or the log file) that is being compacted.
+// * source checkpoint: byte offset in the lower level file up to which the
+//   data has already been compacted.
 //
-// The compaction algorithm tries to pick up where it left off, by looking for
-// the cursor file and seeking in both the source and the destination files. If
-// the cursor file is missing or malformed, the compaction is simply done from
-// scratch (i.e. the destination file is rebuild rather than appended to). After
-// the compaction, if the destination file is still hot (i.e. has less than 256
-// entries), a new cursor file is created to be used for the next compaction
-// run.
+// The compaction algorithm tries to pick up where it left off, by reading the
+// cursor at the end of the destination file, and seeking in both the source
+// and the destination files. If the cursor is missing or malformed, or if
+// anything has been appended after it, the compaction is simply done from
+// scratch (i.e. the destination file is rebuild rather than appended to).
+// After the compaction, if the destination file is still hot (i.e. has less
+// than 256 entries), a new cursor is appended to it, to be used for the next
+// compaction run.
+//
+// Vault files older than format 1.4 are accompanied by separate cursor files
+// instead, with the same content. Since appends keep the format of the file,
+// these are still used until such files are finished.
+
+FlushBudget::FlushBudget(uint32_t max_ms, uint32_t max_bytes)
+    : start_ms_(millis()),
+      max_ms_(max_ms),
+      max_bytes_(max_bytes),
+      bytes_written_(0) {}
+
+bool FlushBudget::exhausted() const {
+  if (bytes_written_ >= max_bytes_) return true;
+  return max_ms_ != kUnlimited &&
+         (uint32_t)(millis() - start_ms_) >= max_ms_;
+}
+
+bool Writer::sync() { return writer_.commit(); }
 
 void Writer::flushAll() {
+  sync();
   while (flush_in_progress_) flushSome();
   flushSome();
   while (flush_in_progress_) flushSome();
 }
 
+FlushBacklog Writer::flushFor(FlushBudget budget) {
+  budget_ = &budget;
+  // A single flushSome() call continues with historical ranges, as long as
+  // there are any, so one flush 'pass' processes all the log data.
+  do {
+    flushSome();
+  } while (flush_in_progress_ && io_state_ == IOSTATE_OK &&
+           !budget.exhausted());
+  budget_ = nullptr;
+  return backlog();
+}
+
+FlushBacklog Writer::backlog() {
+  size_t log_files = cache_.size();
+  if (cache_.contains(writer_.file())) --log_files;
+  return FlushBacklog(log_files, flush_in_progress_);
+}
+
+WriterStats Writer::stats() const {
+  WriterStats result = stats_;
+  result.log_bytes_written = writer_.bytes_committed();
+  result.files_opened += writer_.files_opened();
+  return result;
+}
+
+bool Writer::chargeBudget(uint32_t bytes_written, uint32_t* charged) {
+  if (budget_ == nullptr) return false;
+  budget_->consume(bytes_written - *charged);
+  *charged = bytes_written;
+  return budget_->exhausted();
+}
+
+void Writer::startFusedCompaction(roo_io::Mount& fs) {
+  if (!fused_->init(flushed_until_)) return;
+  // The ancestor files are appended to without cursors from now on. That
+  // invalidates the cursors embedded in them, but not the separate cursor
+  // files of vault files older than format 1.4; remove those. Should the
+  // fused compaction get out of sync, the ancestor files are rebuilt.
+  for (int i = 0; i < fused_->levels(); ++i) {
+    FilePath cursor_path =
+        getLogCompactionCursorPath(collection_, fused_->level_ref(i));
+    if (fs.remove(cursor_path.c_str()) == roo_io::kOk) ++stats_.files_removed;
+  }
+}
+
 void Writer::flushSome() {
+  ScopedLatency latency(stats_.flush_latency);
+  writer_.maybeCommit();
   roo_io::Mount fs = collection_->fs().mount();
   if (!fs.ok()) return;
-  if (flush_in_progress_) {
-    Status status = compactVaultOneLevel();
+  if (flush_in_progress_ && !base_write_paused_) {
+    Status status = compaction_fused_ ? Writer::OK : compactVaultOneLevel();
     if (status == Writer::OK) {
       flush_in_progress_ = false;
+      if (fused_ != nullptr && !compaction_fused_) startFusedCompaction(fs);
       // We're done compacting. Check if there is more to read?
       LogReader reader(fs, log_dir_.c_str(), cache_, collection_->resolution(),
-                       writer_.first_timestamp());
+                       writer_.file());
       if (reader.nextRange() && !reader.isHotRange()) {
         // Has some historic range; let's continue compacting.
-        compaction_head_ = VaultFileRef::Lookup(reader.range_floor(),
-                                                collection_->resolution());
-        compaction_head_index_end_ = writeToVault(fs, reader, compaction_head_);
-        is_hot_range_ = reader.isHotRange();
-        if (io_state() != IOSTATE_OK) return;
-        flush_in_progress_ = true;
+        writeToVault(fs, reader);
       }
     } else if (status == Writer::FAILED) {
       LOG(ERROR) << "Vault compaction failed at resolution "
                  << compaction_head_.resolution();
       io_state_ = IOSTATE_ERROR;
       flush_in_progress_ = false;
+      compaction_paused_ = false;
     }
   } else {
-    // flush not in progress.
+    // Flush not in progress, or interrupted while writing log data to the
+    // base vault file. In the latter case, the range is still the first one
+    // in the log, and the compaction cursor says where to pick up.
     LogReader reader(fs, log_dir_.c_str(), cache_, collection_->resolution(),
-                     writer_.first_timestamp());
+                     writer_.file());
     if (reader.nextRange()) {
-      compaction_head_ =
-          VaultFileRef::Lookup(reader.range_floor(), collection_->resolution());
-      compaction_head_index_end_ = writeToVault(fs, reader, compaction_head_);
-      is_hot_range_ = reader.isHotRange();
-      if (io_state() != IOSTATE_OK) return;
-      flush_in_progress_ = true;
+      if (writeToVault(fs, reader) == Writer::FAILED) return;
       MLOG(roo_monitoring_compaction) << "Starting vault compaction.";
+    } else {
+      flush_in_progress_ = false;
+      base_write_paused_ = false;
     }
   }
 }
 
-int16_t Writer::writeToVault(roo_io::Mount& fs, LogReader& reader,
-                             VaultFileRef ref) {
-  VaultWriter writer(collection_, ref);
+Writer::Status Writer::writeToVault(roo_io::Mount& fs, LogReader& reader) {
+  compaction_head_ =
+      VaultFileRef::Lookup(reader.range_floor(), collection_->resolution());
+  is_hot_range_ = reader.isHotRange();
+  flush_in_progress_ = false;
+  base_write_paused_ = false;
+  ScopedLatency latency(stats_.write_to_vault_latency);
+  VaultWriter writer(collection_, compaction_head_, vault_history_.get());
 
   // See if we can use cursor.
-  String cursor_path = getLogCompactionCursorPath(collection_, ref);
   LogCompactionCursor cursor;
-  roo_io::Status status;
+  uint8_t minor_version;
   bool opened = false;
-  status = tryReadLogCompactionCursor(fs, cursor_path.c_str(), &cursor);
-  if (status == roo_io::kOk) {
-    if (reader.seek(cursor.log_cursor())) {
-      writer.openExisting(cursor.target_datum_index());
-      if (writer.ok()) {
-        opened = true;
-      }
-      if (fs.remove(cursor_path.c_str()) != roo_io::kOk) {
-        io_state_ = IOSTATE_ERROR;
-        return -1;
-      }
+  roo_io::Status status = tryReadLogCompactionCursor(
+      fs, collection_, compaction_head_, &cursor, &minor_version, &stats_);
+  if (status == roo_io::kOk && reader.seek(cursor.log_cursor())) {
+    writer.openExisting(cursor.target_datum_index(), minor_version);
+    if (writer.ok()) {
+      opened = true;
     }
   }
-  if (status != roo_io::kNotFound) {
-    fs.remove(cursor_path.c_str());
-  }
   if (!opened) {
     // Cursor not found.
     writer.openNew();
     if (!writer.ok()) {
       io_state_ = IOSTATE_ERROR;
-      return -1;
+      return Writer::FAILED;
     }
   }
+  ++stats_.files_opened;
 
   // In any case, now just iterate and compact.
   int64_t increment = timestamp_increment(1, collection_->resolution());
   int64_t current =
       writer.vault_ref().timestamp() +
       timestamp_increment(writer.write_index(), collection_->resolution());
+  // The ancestors are compacted along the way if the fused compaction is in
+  // sync with where the base vault file is picked up.
+  bool fused =
+      fused_ != nullptr && fused_->valid() && fused_->next() == current;
+  if (fused_ != nullptr && !fused) fused_->invalidate();
   int64_t timestamp;
   std::vector<LogSample> data;
+  uint32_t charged = 0;
+  LogCursor resume_cursor;
+  bool paused = false;
   while (reader.nextSample(&timestamp, &data)) {
     if (timestamp < current) {
       // Ignoring out-of-order log entries.
       continue;
     }
-    while (current < timestamp) {
-      writer.writeEmptyData();
-      current += increment;
+    if (current < timestamp) {
+      int count = (timestamp - current) / increment;
+      writer.writeEmptyData(count);
+      if (fused) fused_->addEmptyData(count);
+      current += count * increment;
     }
     CHECK_EQ(current, timestamp);
     writer.writeLogData(data);
+    if (fused) fused_->addLogData(data);
     current += increment;
+    // Bytes read back to open the vault files are charged too.
+    if (chargeBudget(writer.bytes_written() + writer.bytes_read() +
+                         (fused ? fused_->bytes_written() +
+                                      fused_->bytes_read()
+                                : 0),
+                     &charged) &&
+        writer.write_index() < kRangeElementCount &&
+        reader.resumeCursor(&resume_cursor)) {
+      paused = true;
+      break;
+    }
   }
   if (!writer.ok()) {
+    if (fused) fused_->invalidate();
     io_state_ = IOSTATE_ERROR;
-    return -1;
+    return Writer::FAILED;
   }
 
-  if (reader.isHotRange()) {
-    if (!writeCursor(
-            fs, cursor_path.c_str(),
-            LogCompactionCursor(reader.tell(), writer.write_index()))) {
+  if (paused) {
+    // Out of budget; leave a cursor so that the next flush resumes here.
+    if (!saveLogCompactionCursor(fs, collection_, writer, resume_cursor,
+                                 &stats_)) {
       io_state_ = IOSTATE_ERROR;
-      return -1;
+      return Writer::FAILED;
     }
-  } else {
-    while (writer.write_index() < kRangeElementCount) {
-      writer.writeEmptyData();
-      current += increment;
+  } else if (reader.isHotRange()) {
+    if (!saveLogCompactionCursor(fs, collection_, writer, reader.tell(),
+                                 &stats_)) {
+      io_state_ = IOSTATE_ERROR;
+      return Writer::FAILED;
     }
+  } else {
+    int count = kRangeElementCount - writer.write_index();
+    writer.writeEmptyData(count);
+    if (fused) fused_->addEmptyData(count);
+    current += count * increment;
     reader.deleteRange();
   }
-  // compaction_range.index_begin = compaction_index_begin;
-  int16_t compaction_index_end = writer.write_index();
+  compaction_head_index_end_ = writer.write_index();
   writer.close();
-  return compaction_index_end;
+  stats_.vault_bytes_written[compaction_head_.resolution()] +=
+      writer.bytes_written();
+  stats_.files_opened += reader.files_opened();
+  stats_.files_removed += reader.files_removed();
+  if (fused && !fused_->close(&stats_)) {
+    io_state_ = IOSTATE_ERROR;
+    return Writer::FAILED;
+  }
+  flushed_until_ = current;
+  compaction_fused_ = fused;
+  flush_in_progress_ = true;
+  base_write_paused_ = paused;
+  return paused ? Writer::IN_PROGRESS : Writer::OK;
 }
 
 Writer::Status Writer::compactVaultOneLevel() {
   roo_io::Mount fs = collection_->fs().mount();
   if (!fs.ok()) return Writer::FAILED;
-  VaultFileRef parent = compaction_head_.parent();
-  compaction_head_index_end_ =
-      (kRangeElementCount / 4) * compaction_head_.sibling_index() +
-      (compaction_head_index_end_ >> 2);
-  compaction_head_ = parent;
-  if (compaction_head_.resolution() > kMaxResolution) {
-    MLOG(roo_monitoring_compaction) << "Vault compacton finished.";
-    return Writer::OK;
-  }
-  if (compaction_head_index_end_ == 0) {
-    MLOG(roo_monitoring_compaction) << "Compaction index = 0";
-    // We're definitely done compacting.
-    return Writer::OK;
+  if (compaction_paused_) {
+    // Resuming the interrupted compaction of the current level; the cursor
+    // file says where to pick up.
+    compaction_paused_ = false;
+  } else {
+    VaultFileRef parent = compaction_head_.parent();
+    compaction_head_index_end_ =
+        (kRangeElementCount / 4) * compaction_head_.sibling_index() +
+        (compaction_head_index_end_ >> 2);
+    compaction_head_ = parent;
+    if (compaction_head_.resolution() > kMaxResolution) {
+      MLOG(roo_monitoring_compaction) << "Vault compacton finished.";
+      return Writer::OK;
+    }
+    if (compaction_head_index_end_ == 0) {
+      MLOG(roo_monitoring_compaction) << "Compaction index = 0";
+      // We're definitely done compacting.
+      return Writer::OK;
+    }
+    is_hot_range_ |= (compaction_head_.sibling_index() < 3);
   }
   CHECK_LE(compaction_head_index_end_, kRangeElementCount);
   CHECK_GT(compaction_head_index_end_, 0);
-  is_hot_range_ |= (compaction_head_.sibling_index() < 3);
+  ScopedLatency latency(stats_.compaction_latency);
 
-  VaultWriter writer(collection_, compaction_head_);
+  VaultWriter writer(collection_, compaction_head_, vault_history_.get());
   VaultFileReader reader(collection_);
   MLOG(roo_monitoring_compaction)
       << "Compacting " << roo_logging::hex << writer.vault_ref()
       << ", with end index " << roo_logging::dec << compaction_head_index_end_;
 
-  // See if we can use a cursor file.
-  String cursor_path =
-      getLogCompactionCursorPath(collection_, compaction_head_);
+  // See if we can use a cursor.
   bool opened = false;
   LogCompactionCursor cursor;
-  roo_io::Status status =
-      tryReadLogCompactionCursor(fs, cursor_path.c_str(), &cursor);
+  uint8_t minor_version;
+  roo_io::Status status = tryReadLogCompactionCursor(
+      fs, collection_, compaction_head_, &cursor, &minor_version, &stats_);
   if (status == roo_io::kOk) {
     reader.open(compaction_head_.child(cursor.target_datum_index() /
                                        (kRangeElementCount / 4)),
                 (cursor.target_datum_index() % (kRangeElementCount / 4)) << 2,
                 cursor.log_cursor().position());
     if (reader.ok()) {
-      writer.openExisting(cursor.target_datum_index());
+      writer.openExisting(cursor.target_datum_index(), minor_version);
       if (writer.ok()) {
         opened = true;
       }
-      roo_io::Status cursor_status = fs.remove(cursor_path.c_str());
-      if (cursor_status != roo_io::kOk) {
-        LOG(ERROR) << "Failed to delete cursor file " << cursor_path << ": "
-                   << roo_io::StatusAsString(cursor_status);
-        return Writer::FAILED;
-      }
     }
-  } else if (status != roo_io::kNotFound) {
-    fs.remove(cursor_path.c_str());
   }
   if (!opened) {
     reader.open(compaction_head_.child(0), 0, 0);
     writer.openNew();
   }
+  if (writer.ok()) ++stats_.files_opened;
   if (writer.write_index() >= compaction_head_index_end_) {
     // The vault already has data past the current index. We will not be
     // overwriting it. Nothing more to do.
@@ -369,32 +620,48 @@ Writer::Status Writer::compactVaultOneLevel() {
   }
 
   // Now iterate and compact.
-  std::vector<Sample> sample_group;
+  std::vector<Sample> sample_group[4];
   Aggregator aggregator;
+  uint32_t charged = 0;
   do {
     CHECK_LE(reader.index(), kRangeElementCount - 4);
-    for (int i = 0; i < 4; ++i) {
-      // Ignore missing input files when compacting.
-      reader.next(&sample_group);
-      for (const Sample& sample : sample_group) {
-        if (sample.fill() > 0) {
-          aggregator.add(sample);
-        }
+    int empty_groups = std::min(reader.empty_run_remaining() / 4,
+                                compaction_head_index_end_ -
+                                    writer.write_index());
+    if (empty_groups > 0) {
+      // Known-empty input (a run of empty entries, or a missing file); no
+      // need to read and aggregate it.
+      reader.seek(reader.index() + 4 * empty_groups);
+      writer.writeEmptyData(empty_groups);
+    } else {
+      for (int i = 0; i < 4; ++i) {
+        // Ignore missing input files when compacting.
+        reader.next(&sample_group[i]);
       }
+      aggregator.addGroup(sample_group);
+      writer.writeAggregatedData(aggregator);
+      aggregator.clear();
     }
-    writer.writeAggregatedData(aggregator);
-    aggregator.clear();
     if (reader.past_eof()) {
       reader.open(reader.vault_ref().next(), 0, 0);
     }
+    if (chargeBudget(writer.bytes_written() + writer.bytes_read(),
+                     &charged) &&
+        writer.write_index() < compaction_head_index_end_) {
+      // Out of budget; the cursor written below lets us resume later.
+      compaction_paused_ = true;
+      break;
+    }
   } while (writer.write_index() < compaction_head_index_end_);
   if (writer.write_index() > 0 && writer.write_index() < kRangeElementCount) {
     // The vault file is unfinished; create a write cursor for it.
-    writeCursor(fs, cursor_path.c_str(),
-                LogCompactionCursor(reader.tell(), writer.write_index()));
+    saveLogCompactionCursor(fs, collection_, writer, reader.tell(), &stats_);
   }
   reader.close();
   writer.close();
+  stats_.vault_bytes_written[compaction_head_.resolution()] +=
+      writer.bytes_written();
+  stats_.files_opened += reader.stats().files_opened;
   if (reader.status() != roo_io::kClosed) {
     LOG(ERROR) << "Failed to process the input vault file: "
                << roo_io::StatusAsString(reader.status());
@@ -417,7 +684,15 @@ VaultFileRef VaultFileRef::Lookup(int64_t timestamp, Resolution resolution) {
   return VaultFileRef(range_floor, resolution);
 }
 
-void Collection::getVaultFilePath(const VaultFileRef& ref, String* path) const {
+void Collection::getVaultFilePath(const VaultFileRef& ref,
+                                  String* path) const {
+  FilePath file_path;
+  getVaultFilePath(ref, &file_path);
+  *path = file_path.c_str();
+}
+
+void Collection::getVaultFilePath(const VaultFileRef& ref,
+                                  FilePath* path) const {
   // Introduce a 2nd level directory structure with max 256 (4^4) files.
   // Each file covers 256 (4 ^ range length) time steps, and each time step
   // covers 4^resolution milliseconds.
@@ -426,39 +701,121 @@ void Collection::getVaultFilePath(const VaultFileRef& ref, String* path) const {
   Filename filename = Filename::forTimestamp(ref.timestamp());
   Filename dirname = Filename::forTimestamp(
       timestamp_ms_floor(ref.timestamp(), group_range_resolution));
-  *path = base_dir_;
-  *path += "/";
-  *path += "vault-";
-  *path += toHexDigit((ref.resolution() >> 4) & 0xF);
-  *path += toHexDigit((ref.resolution() >> 0) & 0xF);
-  *path += "/";
-  *path += dirname.filename();
-  *path += "/";
-  *path += filename.filename();
+  *path = FilePath(base_dir_.c_str());
+  path->append("/vault-");
+  path->append(toHexDigit((ref.resolution() >> 4) & 0xF));
+  path->append(toHexDigit((ref.resolution() >> 0) & 0xF));
+  path->append('/');
+  path->append(dirname.filename());
+  path->append('/');
+  path->append(filename.filename());
 }
 
 VaultIterator::VaultIterator(const Collection* collection, int64_t start,
                              Resolution resolution)
     : collection_(collection),
       current_ref_(VaultFileRef::Lookup(start, resolution)),
-      current_(collection) {
+      current_(collection),
+      cached_(),
+      use_cache_(collection->vault_cache() != nullptr),
+      cached_index_(0),
+      filter_() {
+  open((start - current_ref_.timestamp()) >> (resolution << 1));
+}
+
+VaultIterator::VaultIterator(const Collection* collection, int64_t start,
+                             Resolution resolution,
+                             std::vector<uint64_t> stream_ids)
+    : VaultIterator(collection, start, resolution) {
+  filter_.reset(new StreamFilter(std::move(stream_ids)));
+  current_.setStreamFilter(filter_.get());
+}
+
+void VaultIterator::open(int index) {
+  if (use_cache_) {
+    cached_ = collection_->vault_cache()->get(collection_, current_ref_);
+    cached_index_ = index;
+    return;
+  }
   current_.open(current_ref_, 0, 0);
-  current_.seekForward(start);
+  current_.seekForward(current_ref_.timestamp_at(index));
+}
+
+void VaultIterator::maybeAdvance() {
+  if (use_cache_ ? cached_index_ < kRangeElementCount : !current_.past_eof()) {
+    return;
+  }
+  current_ref_ = current_ref_.next();
+  MLOG(roo_monitoring_vault_reader)
+      << "Advancing to next file: " << roo_logging::hex
+      << current_ref_.timestamp();
+  open(0);
+}
+
+int VaultIterator::index() const {
+  return use_cache_ ? cached_index_ : current_.index();
 }
 
 void VaultIterator::next(std::vector<Sample>* sample) {
-  if (current_.past_eof()) {
-    current_ref_ = current_ref_.next();
-    MLOG(roo_monitoring_vault_reader)
-        << "Advancing to next file: " << roo_logging::hex
-        << current_ref_.timestamp();
-    current_.open(current_ref_, 0, 0);
+  maybeAdvance();
+  if (use_cache_) {
+    sample->clear();
+    if (cached_ != nullptr && cached_index_ < cached_->entry_count()) {
+      const Sample* begin = cached_->entry_begin(cached_index_);
+      const Sample* end = cached_->entry_end(cached_index_);
+      if (filter_ == nullptr) {
+        sample->assign(begin, end);
+      } else {
+        for (const Sample* s = begin; s != end; ++s) {
+          if (filter_->contains(s->stream_id())) sample->push_back(*s);
+        }
+      }
+    }
+    ++cached_index_;
+    return;
   }
   current_.next(sample);
 }
 
+size_t VaultIterator::readRange(int64_t end, SampleColumns* columns) {
+  columns->clear();
+  while (columns->size() < columns->capacity() && cursor() < end) {
+    maybeAdvance();
+    if (use_cache_) {
+      size_t step = columns->appendEmpty(cursor());
+      if (cached_ != nullptr && cached_index_ < cached_->entry_count()) {
+        for (const Sample* s = cached_->entry_begin(cached_index_);
+             s != cached_->entry_end(cached_index_); ++s) {
+          int column = columns->find(s->stream_id());
+          if (column < 0) continue;
+          columns->set(column, step, s->avg_value(), s->min_value(),
+                       s->max_value(), s->fill());
+        }
+      }
+      ++cached_index_;
+      continue;
+    }
+    if (!current_.is_open()) {
+      // Missing (or unreadable) file; fill in empty steps up to the end of
+      // the file without going through the reader.
+      int index = current_.index();
+      while (index < kRangeElementCount &&
+             columns->size() < columns->capacity() &&
+             current_ref_.timestamp_at(index) < end) {
+        columns->appendEmpty(current_ref_.timestamp_at(index));
+        ++index;
+      }
+      current_.seek(index);
+      continue;
+    }
+    size_t step = columns->appendEmpty(cursor());
+    current_.next(columns, step);
+  }
+  return columns->size();
+}
+
 int64_t VaultIterator::cursor() const {
-  return current_ref_.timestamp_at(current_.index());
+  return current_ref_.timestamp_at(index());
 }
 
 }  // namespace roo_monitoring
\ No newline at end of file
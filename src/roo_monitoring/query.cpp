@@ -0,0 +1,98 @@
+#include "query.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "roo_logging.h"
+#include "roo_monitoring.h"
+#include "vault.h"
+
+#ifndef MLOG_roo_monitoring_vault_reader
+#define MLOG_roo_monitoring_vault_reader 0
+#endif
+
+namespace roo_monitoring {
+
+namespace {
+
+// Returns the number of points that [start, end) spans at resolution.
+int64_t point_count(int64_t start, int64_t end, Resolution resolution) {
+  if (end <= start) return 0;
+  return ((timestamp_ms_floor(end - 1, resolution) -
+           timestamp_ms_floor(start, resolution)) >>
+          (resolution << 1)) +
+         1;
+}
+
+}  // namespace
+
+int64_t QuerySegment::point_count() const {
+  return roo_monitoring::point_count(start_, end_, resolution_);
+}
+
+Resolution QueryPlanner::pickResolution(int64_t start, int64_t end,
+                                        size_t max_points) const {
+  for (Resolution r = collection_->resolution(); r < kMaxResolution;
+       r = Resolution(r + 1)) {
+    if (point_count(start, end, r) <= (int64_t)max_points) return r;
+  }
+  return kMaxResolution;
+}
+
+int64_t QueryPlanner::coverage(int64_t timestamp,
+                               Resolution resolution) const {
+  VaultFileRef ref = VaultFileRef::Lookup(timestamp, resolution);
+  VaultFileReader reader(collection_);
+  if (reader.open(ref, 0, 0)) {
+    return ref.timestamp_at(reader.scanEntryCount());
+  }
+  // Missing (or unreadable) file. The level is covered up to where the
+  // previous file ends, if it exists; otherwise, there is a gap, and nothing
+  // is known to be covered.
+  VaultFileRef prev = ref.prev();
+  if (reader.open(prev, 0, 0)) {
+    return prev.timestamp_at(reader.scanEntryCount());
+  }
+  return std::numeric_limits<int64_t>::min();
+}
+
+std::vector<QuerySegment> QueryPlanner::plan(int64_t start, int64_t end,
+                                             size_t max_points) const {
+  std::vector<QuerySegment> result;
+  if (end <= start) return result;
+  Resolution resolution = pickResolution(start, end, max_points);
+  int64_t covered = coverage(end - 1, resolution);
+  if (covered >= end) {
+    // Fully compacted; the common case for historical queries.
+    result.emplace_back(start, end, resolution);
+    return result;
+  }
+  if (covered > start) {
+    result.emplace_back(start, covered, resolution);
+  } else {
+    covered = start;
+  }
+  int64_t points = point_count(start, covered, resolution);
+  // Serve the hot tail from finer levels, while they fit in the budget.
+  while (resolution > collection_->resolution()) {
+    Resolution finer = Resolution(resolution - 1);
+    int64_t finer_covered = std::min(coverage(end - 1, finer), end);
+    if (finer_covered <= covered) break;
+    int64_t finer_points = point_count(covered, end, finer);
+    if (points + finer_points > (int64_t)max_points) break;
+    MLOG(roo_monitoring_vault_reader)
+        << "Reading the hot tail " << roo_logging::hex << covered << " - "
+        << finer_covered << " at resolution " << roo_logging::dec << finer;
+    result.emplace_back(covered, finer_covered, finer);
+    points += point_count(covered, finer_covered, finer);
+    covered = finer_covered;
+    resolution = finer;
+  }
+  if (covered < end) {
+    // Past the end of the vault data.
+    result.emplace_back(covered, end, resolution);
+  }
+  return result;
+}
+
+}  // namespace roo_monitoring
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "resolution.h"
+
+namespace roo_monitoring {
+
+class Collection;
+
+/// A contiguous time range of a query, to be read at a single resolution.
+class QuerySegment {
+ public:
+  QuerySegment(int64_t start, int64_t end, Resolution resolution)
+      : start_(start), end_(end), resolution_(resolution) {}
+
+  /// Returns the (inclusive) start timestamp of the segment.
+  int64_t start() const { return start_; }
+  /// Returns the (exclusive) end timestamp of the segment.
+  int64_t end() const { return end_; }
+  /// Returns the resolution at which the segment should be read.
+  Resolution resolution() const { return resolution_; }
+
+  /// Returns the number of points that reading the segment yields.
+  int64_t point_count() const;
+
+ private:
+  int64_t start_;
+  int64_t end_;
+  Resolution resolution_;
+};
+
+/// Picks vault resolutions for queries, given a budget of points.
+///
+/// Queries read the coarsest level that satisfies the budget, i.e. the finest
+/// resolution at which the time range spans no more than the requested number
+/// of points. Since the levels are compacted incrementally, the most recent
+/// data may not have been propagated to the coarse level yet. The planner
+/// probes the vault files covering the end of the range, and serves such 'hot
+/// tail' from progressively finer levels, as long as it fits in the budget.
+///
+/// Data that is still in the log (i.e. not yet flushed to the vault) is not
+/// visible to queries; the part of the range past the end of the vault data
+/// is assigned to the finest level used, and reads as empty.
+class QueryPlanner {
+ public:
+  /// Creates a planner for the specified collection.
+  QueryPlanner(const Collection* collection) : collection_(collection) {}
+
+  /// Returns the finest resolution at which [start, end) spans no more than
+  /// max_points points. Returns kMaxResolution if there is none.
+  Resolution pickResolution(int64_t start, int64_t end,
+                            size_t max_points) const;
+
+  /// Splits [start, end) into consecutive segments, each to be read at a
+  /// single resolution, such that the total point count does not exceed
+  /// max_points (unless the range does not fit even at kMaxResolution).
+  std::vector<QuerySegment> plan(int64_t start, int64_t end,
+                                 size_t max_points) const;
+
+ private:
+  // Returns the timestamp up to which the specified level contains data,
+  // within the vault file covering timestamp, or the preceding one if that
+  // file does not exist. Returns the minimum int64_t if neither exists.
+  int64_t coverage(int64_t timestamp, Resolution resolution) const;
+
+  const Collection* collection_;
+};
+
+}  // namespace roo_monitoring
@@ -26,6 +26,9 @@ class Sample {
   uint16_t fill() const { return fill_; }
 
  private:
+  // Checks the layout that the vectorized aggregation kernel relies on.
+  friend struct SampleLayout;
+
   uint64_t stream_id_;
   uint16_t avg_value_;
   uint16_t min_value_;
@@ -0,0 +1,204 @@
+#include "sample_decoder.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ROO_MONITORING_DECODE_SSSE3 1
+#include <immintrin.h>
+#else
+#define ROO_MONITORING_DECODE_SSSE3 0
+#endif
+
+namespace roo_monitoring {
+
+namespace {
+
+// Maximum encoded size of a sample: the stream ID varint, and four uint16
+// values.
+static const int kMaxSampleSize = 10 + 8;
+
+inline uint64_t decode_varint(const uint8_t** p) {
+  const uint8_t* q = *p;
+  // Fast paths for small stream IDs.
+  if (q[0] < 0x80) {
+    *p = q + 1;
+    return q[0];
+  }
+  if (q[1] < 0x80) {
+    *p = q + 2;
+    return (q[0] & 0x7F) | ((uint64_t)q[1] << 7);
+  }
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = *q++;
+    result |= (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) break;
+  }
+  *p = q;
+  return result;
+}
+
+inline bool decode_varint(const uint8_t** p, const uint8_t* end,
+                          uint64_t* result) {
+  *result = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8_t b = *(*p)++;
+    *result |= (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+inline uint16_t decode_be16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+// Decodes the stream IDs, and collects pointers to the payloads. Returns the
+// end of the samples, or nullptr if they would extend past end.
+const uint8_t* decode_stream_ids(const uint8_t* p, const uint8_t* end,
+                                 int count, uint64_t* stream_ids,
+                                 const uint8_t** payloads) {
+  if (end - p >= (ptrdiff_t)count * kMaxSampleSize) {
+    for (int i = 0; i < count; ++i) {
+      stream_ids[i] = decode_varint(&p);
+      payloads[i] = p;
+      p += 8;
+    }
+    return p;
+  }
+  for (int i = 0; i < count; ++i) {
+    if (!decode_varint(&p, end, &stream_ids[i]) || end - p < 8) {
+      return nullptr;
+    }
+    payloads[i] = p;
+    p += 8;
+  }
+  return p;
+}
+
+void transpose_payloads_scalar(const uint8_t* const* payloads, int begin,
+                               int count, SampleBatch* batch) {
+  for (int i = begin; i < count; ++i) {
+    const uint8_t* payload = payloads[i];
+    batch->avg[i] = decode_be16(payload);
+    batch->min[i] = decode_be16(payload + 2);
+    batch->max[i] = decode_be16(payload + 4);
+    batch->fill[i] = decode_be16(payload + 6);
+  }
+}
+
+#if ROO_MONITORING_DECODE_SSSE3
+
+// Byte-swaps and transposes four payloads at a time.
+__attribute__((target("ssse3"))) void transpose_payloads_ssse3(
+    const uint8_t* const* payloads, int count, SampleBatch* batch) {
+  // Turns two big-endian payloads, (a0, m0, x0, f0) and (a1, m1, x1, f1),
+  // into little-endian (a0, a1, m0, m1, x0, x1, f0, f1).
+  const __m128i swap = _mm_setr_epi8(1, 0, 9, 8, 3, 2, 11, 10, 5, 4, 13, 12,
+                                     7, 6, 15, 14);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i s01 = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i*)payloads[i]),
+        _mm_loadl_epi64((const __m128i*)payloads[i + 1]));
+    __m128i s23 = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i*)payloads[i + 2]),
+        _mm_loadl_epi64((const __m128i*)payloads[i + 3]));
+    s01 = _mm_shuffle_epi8(s01, swap);
+    s23 = _mm_shuffle_epi8(s23, swap);
+    // (a0..a3, m0..m3) and (x0..x3, f0..f3).
+    __m128i avg_min = _mm_unpacklo_epi32(s01, s23);
+    __m128i max_fill = _mm_unpackhi_epi32(s01, s23);
+    _mm_storel_epi64((__m128i*)&batch->avg[i], avg_min);
+    _mm_storel_epi64((__m128i*)&batch->min[i], _mm_srli_si128(avg_min, 8));
+    _mm_storel_epi64((__m128i*)&batch->max[i], max_fill);
+    _mm_storel_epi64((__m128i*)&batch->fill[i], _mm_srli_si128(max_fill, 8));
+  }
+  transpose_payloads_scalar(payloads, i, count, batch);
+}
+
+bool has_ssse3() {
+  static const bool result = __builtin_cpu_supports("ssse3");
+  return result;
+}
+
+#endif  // ROO_MONITORING_DECODE_SSSE3
+
+}  // namespace
+
+const uint8_t* DecodeSampleBatch(const uint8_t* p, const uint8_t* end,
+                                 int count, SampleBatch* batch) {
+#if ROO_MONITORING_DECODE_SSSE3
+  if (has_ssse3()) {
+    const uint8_t* payloads[kSampleBatchSize];
+    p = decode_stream_ids(p, end, count, batch->stream_id, payloads);
+    if (p != nullptr) transpose_payloads_ssse3(payloads, count, batch);
+    return p;
+  }
+#endif
+  return DecodeSampleBatchScalar(p, end, count, batch);
+}
+
+const uint8_t* DecodeSampleBatchScalar(const uint8_t* p, const uint8_t* end,
+                                       int count, SampleBatch* batch) {
+  const uint8_t* payloads[kSampleBatchSize];
+  p = decode_stream_ids(p, end, count, batch->stream_id, payloads);
+  if (p != nullptr) transpose_payloads_scalar(payloads, 0, count, batch);
+  return p;
+}
+
+const uint8_t* DecodeStreamIds(const uint8_t* p, const uint8_t* end,
+                               uint64_t count, uint64_t* stream_ids) {
+  if ((uint64_t)(end - p) / 10 >= count) {
+    for (uint64_t i = 0; i < count; ++i) {
+      stream_ids[i] = decode_varint(&p);
+    }
+    return p;
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!decode_varint(&p, end, &stream_ids[i])) return nullptr;
+  }
+  return p;
+}
+
+const uint8_t* DecodeStreamCodes(const uint8_t* p, const uint8_t* end,
+                                 uint64_t count, const uint64_t* dictionary,
+                                 size_t dictionary_size,
+                                 uint64_t* stream_ids) {
+  // A code, and possibly a stream ID, take at most 20 bytes.
+  bool checked = (uint64_t)(end - p) / 20 < count;
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t code;
+    if (!checked) {
+      code = decode_varint(&p);
+    } else if (!decode_varint(&p, end, &code)) {
+      return nullptr;
+    }
+    if (code > dictionary_size) return nullptr;
+    if (code > 0) {
+      stream_ids[i] = dictionary[code - 1];
+    } else if (!checked) {
+      stream_ids[i] = decode_varint(&p);
+    } else if (!decode_varint(&p, end, &stream_ids[i])) {
+      return nullptr;
+    }
+  }
+  return p;
+}
+
+void DecodePayloadBatch(const uint8_t* const* payloads, int count,
+                        SampleBatch* batch) {
+#if ROO_MONITORING_DECODE_SSSE3
+  if (has_ssse3()) {
+    transpose_payloads_ssse3(payloads, count, batch);
+    return;
+  }
+#endif
+  transpose_payloads_scalar(payloads, 0, count, batch);
+}
+
+bool SampleBatchDecodingIsVectorized() {
+#if ROO_MONITORING_DECODE_SSSE3
+  return has_ssse3();
+#else
+  return false;
+#endif
+}
+
+}  // namespace roo_monitoring
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace roo_monitoring {
+
+/// Maximum number of samples decoded by a single `DecodeSampleBatch()` call.
+static const int kSampleBatchSize = 32;
+
+/// Samples of a vault entry, decoded into columnar arrays.
+struct SampleBatch {
+  uint64_t stream_id[kSampleBatchSize];
+  uint16_t avg[kSampleBatchSize];
+  uint16_t min[kSampleBatchSize];
+  uint16_t max[kSampleBatchSize];
+  uint16_t fill[kSampleBatchSize];
+};
+
+/// Decodes `count` (up to kSampleBatchSize) consecutive samples, in the
+/// vault file encoding (stream ID varint, followed by the big-endian avg,
+/// min, max, and fill), from the bytes at p.
+///
+/// Stream IDs are decoded first, with a fast path for IDs that fit in one or
+/// two bytes. The 8-byte payloads are then byte-swapped and transposed into
+/// the columnar arrays, using SIMD instructions if the CPU supports them.
+///
+/// Returns the end of the decoded samples, or nullptr if they would extend
+/// past end.
+const uint8_t* DecodeSampleBatch(const uint8_t* p, const uint8_t* end,
+                                 int count, SampleBatch* batch);
+
+/// Same as `DecodeSampleBatch()`, but never uses SIMD instructions. Exposed
+/// for tests and benchmarks.
+const uint8_t* DecodeSampleBatchScalar(const uint8_t* p, const uint8_t* end,
+                                       int count, SampleBatch* batch);
+
+/// Decodes `count` consecutive stream IDs (varints), i.e. the stream-ID
+/// directory of a vault entry in format 1.5 or newer, from the bytes at p.
+///
+/// Returns the end of the decoded IDs, or nullptr if they would extend past
+/// end.
+const uint8_t* DecodeStreamIds(const uint8_t* p, const uint8_t* end,
+                               uint64_t count, uint64_t* stream_ids);
+
+/// Same as `DecodeStreamIds()`, but decodes stream codes, i.e. the
+/// directory of a vault entry in format 1.6 or newer: either 1 + the index
+/// of the stream ID in the dictionary, or 0 followed by the stream ID.
+///
+/// Returns the end of the decoded codes, or nullptr if they would extend
+/// past end, or refer past the end of the dictionary.
+const uint8_t* DecodeStreamCodes(const uint8_t* p, const uint8_t* end,
+                                 uint64_t count, const uint64_t* dictionary,
+                                 size_t dictionary_size, uint64_t* stream_ids);
+
+/// Byte-swaps and transposes `count` (up to kSampleBatchSize) 8-byte sample
+/// payloads (the big-endian avg, min, max, and fill) into the columnar arrays
+/// of the batch, using SIMD instructions if the CPU supports them. Leaves
+/// the stream IDs of the batch unchanged.
+void DecodePayloadBatch(const uint8_t* const* payloads, int count,
+                        SampleBatch* batch);
+
+/// Returns true if `DecodeSampleBatch()` uses SIMD instructions on this CPU.
+bool SampleBatchDecodingIsVectorized();
+
+}  // namespace roo_monitoring
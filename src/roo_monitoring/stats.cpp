@@ -0,0 +1,22 @@
+#include "stats.h"
+
+namespace roo_monitoring {
+
+uint32_t LatencyHistogram::percentile(float p) const {
+  if (count_ == 0) return 0;
+  // The (1-based) rank of the requested percentile.
+  uint32_t rank = (uint32_t)(p / 100.0f * count_ + 0.5f);
+  if (rank < 1) rank = 1;
+  if (rank > count_) rank = count_;
+  uint32_t seen = 0;
+  for (int i = 0; i < kBucketCount - 1; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      uint32_t upper = (uint32_t)1 << i;
+      return upper < max_us_ ? upper : max_us_;
+    }
+  }
+  return max_us_;
+}
+
+}  // namespace roo_monitoring
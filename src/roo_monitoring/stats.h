@@ -0,0 +1,158 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "resolution.h"
+
+namespace roo_monitoring {
+
+/// Histogram of latencies, with power-of-two buckets.
+///
+/// Recording is a handful of integer operations, so that histograms can be
+/// left on in production.
+class LatencyHistogram {
+ public:
+  /// Bucket 0 counts latencies below 1 us. Bucket i > 0 counts latencies in
+  /// [2^(i-1), 2^i) us. The last bucket also counts everything longer
+  /// (i.e. above ~4 s).
+  static constexpr int kBucketCount = 24;
+
+  LatencyHistogram() : buckets_(), count_(0), total_us_(0), max_us_(0) {}
+
+  /// Records a single latency, in microseconds.
+  void record(uint32_t micros) {
+    int bucket = (micros == 0) ? 0 : 32 - __builtin_clz(micros);
+    if (bucket >= kBucketCount) bucket = kBucketCount - 1;
+    ++buckets_[bucket];
+    ++count_;
+    total_us_ += micros;
+    if (micros > max_us_) max_us_ = micros;
+  }
+
+  /// Returns the number of recorded latencies.
+  uint32_t count() const { return count_; }
+
+  /// Returns the sum of recorded latencies, in microseconds.
+  uint64_t total_us() const { return total_us_; }
+
+  /// Returns the maximum recorded latency, in microseconds.
+  uint32_t max_us() const { return max_us_; }
+
+  /// Returns the count in the specified bucket.
+  uint32_t bucket(int i) const { return buckets_[i]; }
+
+  /// Returns an upper bound of the specified percentile (in [0, 100]) of
+  /// recorded latencies, in microseconds; i.e. the upper bound of the
+  /// bucket that contains it. Returns 0 if nothing has been recorded.
+  uint32_t percentile(float p) const;
+
+ private:
+  uint32_t buckets_[kBucketCount];
+  uint32_t count_;
+  uint64_t total_us_;
+  uint32_t max_us_;
+};
+
+/// Records the time elapsed between construction and destruction in a
+/// histogram.
+class ScopedLatency {
+ public:
+  ScopedLatency(LatencyHistogram& histogram)
+      : histogram_(histogram), start_us_(micros()) {}
+
+  ~ScopedLatency() { histogram_.record(micros() - start_us_); }
+
+ private:
+  LatencyHistogram& histogram_;
+  unsigned long start_us_;
+};
+
+/// Counters of vault file reads.
+struct VaultReadStats {
+  VaultReadStats()
+      : files_opened(0),
+        files_missing(0),
+        entries_read(0),
+        bytes_read(0),
+        samples_read(0) {}
+
+  /// Number of vault files successfully opened.
+  uint32_t files_opened;
+
+  /// Number of vault files that were looked up, but did not exist. (The
+  /// corresponding data is treated as empty.)
+  uint32_t files_missing;
+
+  /// Number of vault entries read.
+  uint64_t entries_read;
+
+  /// Number of bytes of vault entries read.
+  uint64_t bytes_read;
+
+  /// Number of samples decoded and returned, i.e. excluding the ones skipped
+  /// as not requested (see `VaultFileReader::setStreamFilter()`).
+  uint64_t samples_read;
+};
+
+/// Counters and latency histograms of a `Writer`.
+///
+/// Write amplification can be computed as the ratio of the vault (plus log)
+/// bytes written to the number of samples written.
+struct WriterStats {
+  WriterStats()
+      : samples_written(0),
+        samples_deduplicated(0),
+        samples_dropped(0),
+        log_bytes_written(0),
+        vault_bytes_written(),
+        files_opened(0),
+        files_removed(0),
+        cursor_files_written(0),
+        cursors_embedded(0) {}
+
+  /// Number of samples written to the log.
+  uint64_t samples_written;
+
+  /// Number of samples dropped because a sample of the same stream has
+  /// already been written in the same time bucket.
+  uint64_t samples_deduplicated;
+
+  /// Number of samples dropped because their timestamp precedes one already
+  /// written, e.g. after the clock has been set back.
+  uint64_t samples_dropped;
+
+  /// Number of bytes committed to log files.
+  uint64_t log_bytes_written;
+
+  /// Number of bytes of entries written to vault files, by resolution.
+  uint64_t vault_bytes_written[kMaxResolution + 1];
+
+  /// Number of files (log, vault, and cursor) opened for reading or writing.
+  uint32_t files_opened;
+
+  /// Number of files (log, and cursor) removed.
+  uint32_t files_removed;
+
+  /// Number of compaction cursor files written, for vault files older than
+  /// format 1.4.
+  uint32_t cursor_files_written;
+
+  /// Number of compaction cursors appended to hot vault files (format 1.4 or
+  /// newer). No file is written for these; they are dropped from the vault
+  /// file once it is finished.
+  uint32_t cursors_embedded;
+
+  /// Latency of `Writer::flushSome()`.
+  LatencyHistogram flush_latency;
+
+  /// Latency of writing log data to the base vault file (a part of some
+  /// `flushSome()` calls).
+  LatencyHistogram write_to_vault_latency;
+
+  /// Latency of compacting a single vault level (a part of some
+  /// `flushSome()` calls).
+  LatencyHistogram compaction_latency;
+};
+
+}  // namespace roo_monitoring
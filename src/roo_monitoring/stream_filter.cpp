@@ -0,0 +1,20 @@
+#include "stream_filter.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace roo_monitoring {
+
+StreamFilter::StreamFilter(std::vector<uint64_t> stream_ids)
+    : stream_ids_(std::move(stream_ids)) {
+  std::sort(stream_ids_.begin(), stream_ids_.end());
+  stream_ids_.erase(std::unique(stream_ids_.begin(), stream_ids_.end()),
+                    stream_ids_.end());
+}
+
+bool StreamFilter::contains(uint64_t stream_id) const {
+  return std::binary_search(stream_ids_.begin(), stream_ids_.end(),
+                            stream_id);
+}
+
+}  // namespace roo_monitoring
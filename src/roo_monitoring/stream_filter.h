@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace roo_monitoring {
+
+/// Set of stream identifiers that a read is restricted to.
+///
+/// See `VaultIterator` and `VaultFileReader::setStreamFilter()`.
+class StreamFilter {
+ public:
+  /// Creates a filter that matches the specified streams.
+  explicit StreamFilter(std::vector<uint64_t> stream_ids);
+
+  /// Returns the number of streams matched.
+  size_t size() const { return stream_ids_.size(); }
+
+  /// Returns true if the specified stream is matched.
+  bool contains(uint64_t stream_id) const;
+
+ private:
+  // Sorted, without duplicates.
+  std::vector<uint64_t> stream_ids_;
+};
+
+}  // namespace roo_monitoring
@@ -21,6 +21,21 @@ uint16_t Transform::apply(float value) const {
   return (uint16_t)(transformed + 0.5);
 }
 
+void Transform::applyBatch(const float* values, uint16_t* out,
+                           size_t count) const {
+  const float multiplier = multiplier_;
+  const float offset = offset_;
+  for (size_t i = 0; i < count; ++i) {
+    float transformed = multiplier * values[i] + offset;
+    transformed = transformed < 0 ? 0 : transformed;
+    transformed = transformed > 65535 ? 65535 : transformed;
+    // Rounds half up, exactly like apply(). Unlike transformed + 0.5f, which
+    // rounds e.g. 0.49999997 up to 1, the fraction is computed exactly.
+    int32_t truncated = (int32_t)transformed;
+    out[i] = (uint16_t)(truncated + (transformed - truncated >= 0.5f));
+  }
+}
+
 float Transform::unapply(uint16_t value) const {
   return (value - offset_) / multiplier_;
 }
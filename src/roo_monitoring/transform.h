@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace roo_monitoring {
@@ -22,6 +23,12 @@ class Transform {
   /// Applies the transform and clamps to [0, 65535].
   uint16_t apply(float value) const;
 
+  /// Applies the transform to `count` values, storing results in `out`.
+  ///
+  /// Equivalent to calling `apply()` on each value, but written as a
+  /// branch-free loop that the compiler can vectorize.
+  void applyBatch(const float* values, uint16_t* out, size_t count) const;
+
   /// Recovers the application-domain value from encoded data.
   float unapply(uint16_t value) const;
 
@@ -1,14 +1,17 @@
 
 #include "vault.h"
 
+#include <algorithm>
 #include <map>
 
 #include "common.h"
 #include "log.h"
+#include "manifest.h"
 #include "resolution.h"
 #include "roo_io/data/multipass_input_stream_reader.h"
 #include "roo_logging.h"
 #include "roo_monitoring.h"
+#include "sample_decoder.h"
 
 #ifndef MLOG_roo_monitoring_vault_reader
 #define MLOG_roo_monitoring_vault_reader 0
@@ -18,7 +21,9 @@ namespace roo_monitoring {
 
 namespace {
 
-bool read_header(roo_io::MultipassInputStreamReader& is) {
+bool read_header(roo_io::MultipassInputStreamReader& is,
+                 uint8_t* minor_version, uint8_t* flags,
+                 std::vector<uint64_t>* dictionary) {
   uint8_t major = is.readU8();
   uint8_t minor = is.readU8();
   if (!is.ok()) {
@@ -26,18 +31,72 @@ bool read_header(roo_io::MultipassInputStreamReader& is) {
                << roo_io::StatusAsString(is.status());
     return false;
   }
-  if (major != 1 || minor != 1) {
-    LOG(ERROR) << "Invalid content of vault file header: " << major << ", "
-               << minor;
+  if (major != 1 || minor < 1 || minor > kVaultFormatMinorVersion) {
+    LOG(ERROR) << "Invalid content of vault file header: " << (int)major
+               << ", " << (int)minor;
     return false;
   }
+  *minor_version = minor;
+  *flags = minor >= 7 ? is.readU8() : 0;
+  dictionary->clear();
+  if (minor >= 6) {
+    uint64_t size = is.readVarU64();
+    uint64_t stream_id = 0;
+    for (uint64_t i = 0; i < size && is.ok(); ++i) {
+      stream_id += is.readVarU64();
+      dictionary->push_back(stream_id);
+    }
+    if (!is.ok()) {
+      LOG(ERROR) << "Failed to read the stream dictionary of the vault file: "
+                 << roo_io::StatusAsString(is.status());
+      return false;
+    }
+  }
   return true;
 }
 
-roo_io::Status read_data(roo_io::MultipassInputStreamReader& is,
-                         std::vector<Sample>* data, bool ignore_fill) {
-  data->clear();
-  uint64_t sample_count = roo_io::ReadVarU64(is);
+// Reads a stream ID of an entry, given the dictionary that the entry
+// directory refers to, or nullptr if it holds stream IDs. Returns false if
+// the stream code is invalid.
+bool read_stream_id(roo_io::MultipassInputStreamReader& is,
+                    const std::vector<uint64_t>* dictionary,
+                    uint64_t* stream_id) {
+  *stream_id = is.readVarU64();
+  if (dictionary == nullptr) return true;
+  uint64_t code = *stream_id;
+  if (code == 0) {
+    *stream_id = is.readVarU64();
+  } else if (code <= dictionary->size()) {
+    *stream_id = (*dictionary)[code - 1];
+  } else if (is.ok()) {
+    LOG(ERROR) << "Invalid stream code in the vault file: " << code;
+    return false;
+  }
+  return true;
+}
+
+// Reads the header of an entry: the sample count, and, for empty entries in
+// files that have runs, the number of entries in the run (including this
+// one). Skips over any compaction cursor records before the entry.
+roo_io::Status read_entry_header(roo_io::MultipassInputStreamReader& is,
+                                 bool has_runs, uint64_t* sample_count,
+                                 int* run_length) {
+  while (true) {
+    *sample_count = roo_io::ReadVarU64(is);
+    *run_length = 1;
+    if (!is.ok() || *sample_count != 0 || !has_runs) break;
+    uint64_t run = roo_io::ReadVarU64(is);
+    if (run != kVaultCursorMarker) {
+      *run_length = run + 1;
+      break;
+    }
+    // A compaction cursor; not an entry.
+    is.readU8();
+    is.readVarU64();
+    is.readVarU64();
+    is.readU8();
+    is.readBeU32();
+  }
   if (!is.ok()) {
     if (is.status() != roo_io::kEndOfStream) {
       LOG(ERROR) << "Failed to read data from the vault file: "
@@ -45,25 +104,274 @@ roo_io::Status read_data(roo_io::MultipassInputStreamReader& is,
     }
     return is.status();
   }
+  return roo_io::kOk;
+}
+
+// Reads the samples of a compressed entry, using read_varint(uint64_t*) to
+// read the fields (which returns false if it fails). Updates the last avg
+// values of the dictionary streams in previous_avg, unless it is nullptr (in
+// which case the decoded values are not valid). Calls accept and emit as
+// read_samples does. Returns false if a read fails, or the data is invalid.
+template <typename ReadVarint, typename Accept, typename Emit>
+bool read_compressed_samples(ReadVarint read_varint, uint64_t sample_count,
+                             const std::vector<uint64_t>& dictionary,
+                             uint32_t* previous_avg, bool ignore_fill,
+                             Accept accept, Emit emit) {
   for (uint64_t i = 0; i < sample_count; ++i) {
-    uint64_t stream_id = is.readVarU64();
+    uint64_t code;
+    uint64_t stream_id;
+    uint64_t head;
+    if (!read_varint(&code)) return false;
+    if (code == 0) {
+      if (!read_varint(&stream_id)) return false;
+    } else if (code <= dictionary.size()) {
+      stream_id = dictionary[code - 1];
+    } else {
+      LOG(ERROR) << "Invalid stream code in the vault file: " << code;
+      return false;
+    }
+    if (!read_varint(&head)) return false;
+    uint32_t* previous = (code > 0 && previous_avg != nullptr)
+                             ? &previous_avg[code - 1]
+                             : nullptr;
+    uint16_t avg = (previous != nullptr && *previous != kVaultNoDeltaBase)
+                       ? VaultDeltaDecode(head >> 3, *previous)
+                       : head >> 3;
+    uint16_t min = avg;
+    uint16_t max = avg;
+    uint64_t fill = 0x2000;
+    uint64_t field;
+    if (head & 1) {
+      if (!read_varint(&field)) return false;
+      min = VaultDeltaDecode(field, avg);
+    }
+    if (head & 2) {
+      if (!read_varint(&field)) return false;
+      max = VaultDeltaDecode(field, avg);
+    }
+    if ((head & 4) && !read_varint(&fill)) return false;
+    if (previous != nullptr) *previous = avg;
+    if (accept(stream_id)) {
+      emit(stream_id, avg, min, max, ignore_fill ? 0x2000 : (uint16_t)fill);
+    }
+  }
+  return true;
+}
+
+// Skips over a single record (an entry, or a run of empty entries), without
+// decoding the samples. Sets run_length to the number of entries skipped.
+roo_io::Status skip_data(roo_io::MultipassInputStreamReader& is,
+                         bool has_runs, bool has_directory, bool compressed,
+                         const std::vector<uint64_t>* dictionary,
+                         int* run_length) {
+  uint64_t sample_count;
+  roo_io::Status status =
+      read_entry_header(is, has_runs, &sample_count, run_length);
+  if (compressed && status == roo_io::kOk) {
+    // The samples have variable sizes; parse them, without the state.
+    bool ok = read_compressed_samples(
+        [&is](uint64_t* value) {
+          *value = is.readVarU64();
+          return is.ok();
+        },
+        sample_count, *dictionary, nullptr, false,
+        [](uint64_t) { return false; },
+        [](uint64_t, uint16_t, uint16_t, uint16_t, uint16_t) {});
+    return (ok || !is.ok()) ? is.status() : roo_io::kEndOfStream;
+  }
+  for (uint64_t i = 0; i < sample_count && is.ok(); ++i) {
+    uint64_t stream_id;
+    if (!read_stream_id(is, dictionary, &stream_id)) {
+      return roo_io::kEndOfStream;
+    }
+    if (!has_directory) is.skip(8);
+  }
+  if (has_directory && sample_count > 0 && is.ok()) is.skip(8 * sample_count);
+  return status == roo_io::kOk ? is.status() : status;
+}
+
+// Reads the samples of an entry. Calls accept(stream_id) to determine
+// whether to decode a sample, and emit(stream_id, avg, min, max, fill) for
+// each decoded one. The payloads of the others are skipped over; in files
+// with stream-ID directories, all at once. The dictionary is the one that
+// the directories refer to, if any. The directory vector is scratch space.
+template <typename Accept, typename Emit>
+roo_io::Status read_samples(roo_io::MultipassInputStreamReader& is,
+                            uint64_t sample_count, bool has_directory,
+                            const std::vector<uint64_t>* dictionary,
+                            bool ignore_fill, std::vector<uint64_t>& directory,
+                            Accept accept, Emit emit) {
+  directory.clear();
+  for (uint64_t i = 0; i < sample_count && is.ok(); ++i) {
+    uint64_t stream_id;
+    if (!read_stream_id(is, dictionary, &stream_id)) {
+      return roo_io::kEndOfStream;
+    }
+    if (has_directory) {
+      directory.push_back(stream_id);
+      continue;
+    }
+    if (!accept(stream_id)) {
+      is.skip(8);
+      continue;
+    }
     uint16_t avg = is.readBeU16();
     uint16_t min = is.readBeU16();
     uint16_t max = is.readBeU16();
     uint16_t fill = is.readBeU16();
-    if (ignore_fill) {
-      fill = 0x2000;
-    }
-    if (!is.ok()) {
-      LOG(ERROR) << "Failed to read a sample from the vault file: "
-                 << roo_io::StatusAsString(is.status());
-      return is.status();
+    if (!is.ok()) break;
+    emit(stream_id, avg, min, max, ignore_fill ? 0x2000 : fill);
+  }
+  // Payloads not yet skipped over.
+  uint64_t skipped = 0;
+  for (uint64_t stream_id : directory) {
+    if (!is.ok()) break;
+    if (!accept(stream_id)) {
+      ++skipped;
+      continue;
     }
-    data->emplace_back(stream_id, avg, min, max, fill);
+    if (skipped > 0) is.skip(8 * skipped);
+    skipped = 0;
+    uint16_t avg = is.readBeU16();
+    uint16_t min = is.readBeU16();
+    uint16_t max = is.readBeU16();
+    uint16_t fill = is.readBeU16();
+    if (!is.ok()) break;
+    emit(stream_id, avg, min, max, ignore_fill ? 0x2000 : fill);
+  }
+  if (skipped > 0 && is.ok()) is.skip(8 * skipped);
+  if (!is.ok()) {
+    LOG(ERROR) << "Failed to read a sample from the vault file: "
+               << roo_io::StatusAsString(is.status());
+    return is.status();
   }
   return roo_io::kOk;
 }
 
+// Decoders of mapped vault files.
+
+inline uint32_t decode_be32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline bool decode_varint(const uint8_t** p, const uint8_t* end,
+                          uint64_t* result) {
+  *result = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8_t b = *(*p)++;
+    *result |= (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// Same as the dictionary part of read_header, but decodes the mapped bytes
+// at p, advancing it. Returns false if the dictionary extends past the end.
+bool decode_dictionary(const uint8_t** p, const uint8_t* end,
+                       std::vector<uint64_t>* dictionary) {
+  uint64_t size;
+  if (!decode_varint(p, end, &size) || size > (uint64_t)(end - *p)) {
+    return false;
+  }
+  dictionary->resize(size);
+  uint64_t stream_id = 0;
+  for (uint64_t& entry : *dictionary) {
+    uint64_t delta;
+    if (!decode_varint(p, end, &delta)) return false;
+    stream_id += delta;
+    entry = stream_id;
+  }
+  return true;
+}
+
+// Same as read_entry_header, but decodes the mapped bytes at p, advancing
+// it. Returns false if the header extends past the end.
+bool decode_entry_header(const uint8_t** p, const uint8_t* end, bool has_runs,
+                         uint64_t* sample_count, int* run_length) {
+  while (true) {
+    if (!decode_varint(p, end, sample_count)) return false;
+    *run_length = 1;
+    if (*sample_count != 0 || !has_runs) return true;
+    uint64_t run;
+    if (!decode_varint(p, end, &run)) return false;
+    if (run != kVaultCursorMarker) {
+      *run_length = run + 1;
+      return true;
+    }
+    // A compaction cursor; not an entry.
+    uint64_t ignored;
+    if (end - *p < 1) return false;
+    ++*p;
+    if (!decode_varint(p, end, &ignored) || !decode_varint(p, end, &ignored) ||
+        end - *p < 5) {
+      return false;
+    }
+    *p += 5;
+  }
+}
+
+// Decodes the payloads of the batch, and emits its samples.
+template <typename Emit>
+void emit_batch(const uint8_t* const* payloads, int count, bool ignore_fill,
+                SampleBatch* batch, Emit& emit) {
+  DecodePayloadBatch(payloads, count, batch);
+  for (int i = 0; i < count; ++i) {
+    emit(batch->stream_id[i], batch->avg[i], batch->min[i], batch->max[i],
+         ignore_fill ? 0x2000 : batch->fill[i]);
+  }
+}
+
+// Same as read_samples, but decodes the mapped bytes at p, in batches.
+// Returns the end of the entry, or nullptr if it extends past the end.
+template <typename Accept, typename Emit>
+const uint8_t* decode_samples(const uint8_t* p, const uint8_t* end,
+                              uint64_t sample_count, bool has_directory,
+                              const std::vector<uint64_t>* dictionary,
+                              bool ignore_fill,
+                              std::vector<uint64_t>& directory, Accept accept,
+                              Emit emit) {
+  SampleBatch batch;
+  if (!has_directory) {
+    while (sample_count > 0) {
+      int count = std::min<uint64_t>(sample_count, kSampleBatchSize);
+      p = DecodeSampleBatch(p, end, count, &batch);
+      if (p == nullptr) return nullptr;
+      for (int i = 0; i < count; ++i) {
+        if (!accept(batch.stream_id[i])) continue;
+        emit(batch.stream_id[i], batch.avg[i], batch.min[i], batch.max[i],
+             ignore_fill ? 0x2000 : batch.fill[i]);
+      }
+      sample_count -= count;
+    }
+    return p;
+  }
+  // Each sample takes at least 9 bytes.
+  if (sample_count > (uint64_t)(end - p) / 9) return nullptr;
+  directory.resize(sample_count);
+  if (dictionary == nullptr) {
+    p = DecodeStreamIds(p, end, sample_count, directory.data());
+  } else {
+    p = DecodeStreamCodes(p, end, sample_count, dictionary->data(),
+                          dictionary->size(), directory.data());
+  }
+  if (p == nullptr || (uint64_t)(end - p) / 8 < sample_count) return nullptr;
+  // Only the payloads of accepted samples are decoded.
+  const uint8_t* payloads[kSampleBatchSize];
+  int count = 0;
+  for (uint64_t i = 0; i < sample_count; ++i) {
+    if (!accept(directory[i])) continue;
+    batch.stream_id[count] = directory[i];
+    payloads[count++] = p + 8 * i;
+    if (count == kSampleBatchSize) {
+      emit_batch(payloads, count, ignore_fill, &batch, emit);
+      count = 0;
+    }
+  }
+  emit_batch(payloads, count, ignore_fill, &batch, emit);
+  return p + 8 * sample_count;
+}
+
 }  // namespace
 
 VaultFileReader::VaultFileReader(const Collection* collection)
@@ -72,68 +380,164 @@ VaultFileReader::VaultFileReader(const Collection* collection)
       fs_(),
       reader_(),
       index_(0),
-      position_(0) {}
+      position_(0),
+      minor_version_(0),
+      flags_(0),
+      index_offset_(-1),
+      run_remaining_(0),
+      run_offset_(0),
+      mapped_(),
+      mapped_offset_(0),
+      mapped_status_(roo_io::kOk),
+      filter_(nullptr),
+      directory_(),
+      dictionary_(),
+      previous_avg_(),
+      delta_block_(-1),
+      stats_() {}
 
 bool VaultFileReader::open(const VaultFileRef& vault_ref, int index,
                            int64_t offset) {
-  String path;
+  FilePath path;
   ref_ = vault_ref;
+  index_ = index;
+  position_ = 0;
+  minor_version_ = 0;
+  index_offset_ = -1;
+  run_remaining_ = 0;
+  flags_ = 0;
+  dictionary_.clear();
+  delta_block_ = -1;
+  mapped_.unmap();
+  mapped_status_ = roo_io::kOk;
+  const Manifest* manifest = collection_->manifest();
+  if (manifest != nullptr && !manifest->hasVaultFile(vault_ref)) {
+    // Known not to exist; no need to probe the filesystem.
+    reader_.close();
+    ++stats_.files_missing;
+    return false;
+  }
   collection_->getVaultFilePath(vault_ref, &path);
   fs_ = collection_->fs().mount();
   if (!fs_.ok()) {
     return false;
   }
-  reader_.reset(fs_.fopen(path.c_str()));
-  index_ = index;
-  position_ = 0;
-  if (!reader_.isOpen()) {
-    if (reader_.status() == roo_io::kNotFound) {
-      MLOG(roo_monitoring_vault_reader)
-          << "Vault file " << path.c_str()
-          << " doesn't exist; treating as-if empty";
-    } else {
-      LOG(ERROR) << "Failed to open vault file for read: " << path.c_str()
-                 << ": " << roo_io::StatusAsString(reader_.status());
+  if (!openMapped(path.c_str())) {
+    reader_.reset(fs_.fopen(path.c_str()));
+    if (!reader_.isOpen()) {
+      if (reader_.status() == roo_io::kNotFound) {
+        ++stats_.files_missing;
+        MLOG(roo_monitoring_vault_reader)
+            << "Vault file " << path.c_str()
+            << " doesn't exist; treating as-if empty";
+      } else {
+        LOG(ERROR) << "Failed to open vault file for read: " << path.c_str()
+                   << ": " << roo_io::StatusAsString(reader_.status());
+      }
+      return false;
     }
-    return false;
-  }
-  if (offset == 0) {
-    if (!read_header(reader_)) {
+    ++stats_.files_opened;
+    // The header is read even when resuming at an offset, since the format
+    // of the entries depends on the version.
+    if (!read_header(reader_, &minor_version_, &flags_, &dictionary_)) {
       reader_.close();
       return false;
     }
-    position_ = reader_.position();
+  }
+  if (offset > 0 && (compressed() || has_index())) {
+    // Cannot resume decoding at a byte offset; or need not, since the file
+    // has been finished. (Finishing it may have moved the entries; see
+    // `VaultWriter::close()`.)
+    offset = 0;
+  }
+  if (offset == 0) {
+    position_ = read_position();
+    index_ = 0;
+    seek(index);
   } else if (offset < 0) {
     LOG(ERROR) << "Invalid offset: " << offset;
     return false;
   } else {
-    reader_.seek(offset);
-    if (reader_.status() != roo_io::kOk) {
+    setReadPosition(offset);
+    if (status() != roo_io::kOk) {
       LOG(ERROR) << "Error seeking in the vault file " << path.c_str() << ": "
-                 << roo_io::StatusAsString(reader_.status());
+                 << roo_io::StatusAsString(status());
       return false;
     }
     position_ = offset;
   }
   MLOG(roo_monitoring_vault_reader)
       << "Vault file " << path.c_str() << " opened for read at index " << index_
-      << " and position " << offset;
-  return reader_.status() == roo_io::kOk;
+      << " and position " << offset << (is_mapped() ? " (mapped)" : "");
+  return status() == roo_io::kOk;
+}
+
+bool VaultFileReader::openMapped(const char* path) {
+  const char* root = collection_->mapped_reads_root();
+  if (root == nullptr || !mapped_.map(root, path)) return false;
+  const uint8_t* data = mapped_.data();
+  size_t size = mapped_.size();
+  bool valid = size >= 2 + kVaultIndexSize && data[0] == 1 && data[1] >= 2 &&
+               data[1] <= kVaultFormatMinorVersion &&
+               decode_be32(data + size - 4) == kVaultIndexMagic;
+  // Entries are decoded mostly without bounds checks, so the index must be
+  // consistent, so that seeking by it stays within the data.
+  uint64_t index_offset = size - kVaultIndexSize;
+  uint32_t previous = 2;
+  for (int i = 0; valid && i < kRangeElementCount; ++i) {
+    uint32_t offset = decode_be32(data + index_offset + 4 * i);
+    valid = offset >= previous && offset < index_offset;
+    previous = offset;
+  }
+  const uint8_t* entries = data + 2;
+  if (valid && data[1] >= 7) flags_ = *entries++;
+  if (valid && data[1] >= 6) {
+    valid = decode_dictionary(&entries, data + index_offset, &dictionary_);
+  }
+  if (!valid) {
+    // Most likely a hot file; read it through the filesystem.
+    mapped_.unmap();
+    return false;
+  }
+  reader_.close();
+  ++stats_.files_opened;
+  minor_version_ = data[1];
+  index_offset_ = index_offset;
+  mapped_offset_ = entries - data;
+  return true;
+}
+
+void VaultFileReader::setReadPosition(uint64_t position) {
+  if (!mapped_.mapped()) {
+    reader_.seek(position);
+    return;
+  }
+  if (position < 2 || position > (uint64_t)index_offset_) {
+    LOG(ERROR) << "Invalid offset " << position << " in the vault file "
+               << roo_logging::hex << ref_;
+    mapped_status_ = roo_io::kSeekError;
+    mapped_.unmap();
+    return;
+  }
+  mapped_offset_ = position;
 }
 
 VaultFileReader::~VaultFileReader() { reader_.close(); }
 
 LogCursor VaultFileReader::tell() {
-  if (index_ == 0) {
-    // In this case, the file might have not existed, but that's OK;
-    // we will just return that we're at the beginning of it.
+  if (index_ == 0 || run_remaining_ > 0 || compressed()) {
+    // In the first case, the file might have not existed, but that's OK;
+    // we will just return that we're at the beginning of it. In the other
+    // cases, we're in the middle of a run of empty entries, or in a
+    // compressed file, which cannot be resumed from a byte offset; offset 0
+    // makes the reader seek to the entry index instead.
     return LogCursor(ref_.timestamp(), 0);
   }
   if (past_eof()) {
     LOG(FATAL) << "Attempt to read a position in a file that has been fully "
                   "read and is now closed.";
-  } else if (reader_.ok()) {
-    position_ = reader_.position();
+  } else if (readable()) {
+    position_ = read_position();
   } else if (reader_.status() == roo_io::kClosed) {
     LOG(FATAL) << "Attempt to read a position in a file that has been "
                   "unexpectedly closed at index "
@@ -142,60 +546,404 @@ LogCursor VaultFileReader::tell() {
   return LogCursor(ref_.timestamp(), position_);
 }
 
-bool VaultFileReader::next(std::vector<Sample>* sample) {
-  sample->clear();
+bool VaultFileReader::IgnoresFill(Resolution resolution) {
+  // TODO: make this configurable.
+  return resolution <= kResolution_65536_ms;
+}
+
+bool VaultFileReader::ignore_fill() const {
+  return IgnoresFill(ref_.resolution());
+}
+
+template <typename Accept, typename Emit>
+roo_io::Status VaultFileReader::readCompressedSamples(uint64_t sample_count,
+                                                      Accept accept,
+                                                      Emit emit) {
+  int block = index_ / kVaultDeltaBlockSize;
+  if (block != delta_block_) {
+    previous_avg_.assign(dictionary_.size(), kVaultNoDeltaBase);
+    delta_block_ = block;
+  }
+  if (mapped_.mapped()) {
+    const uint8_t* p = mapped_.data() + mapped_offset_;
+    const uint8_t* end = mapped_end();
+    bool ok = read_compressed_samples(
+        [&p, end](uint64_t* value) { return decode_varint(&p, end, value); },
+        sample_count, dictionary_, previous_avg_.data(), ignore_fill(),
+        accept, emit);
+    return finishMappedRead(ok ? p : nullptr);
+  }
+  bool ok = read_compressed_samples(
+      [this](uint64_t* value) {
+        *value = reader_.readVarU64();
+        return reader_.ok();
+      },
+      sample_count, dictionary_, previous_avg_.data(), ignore_fill(), accept,
+      emit);
+  if (!reader_.ok()) {
+    LOG(ERROR) << "Failed to read a sample from the vault file: "
+               << roo_io::StatusAsString(reader_.status());
+    return reader_.status();
+  }
+  return ok ? roo_io::kOk : roo_io::kEndOfStream;
+}
+
+template <typename Accept, typename Emit>
+bool VaultFileReader::readEntry(Accept accept, Emit emit) {
   if (past_eof()) {
     return false;
   }
-  if (!reader_.ok()) {
+  if (run_remaining_ > 0) {
+    --run_remaining_;
+    return finishNext(roo_io::kOk);
+  }
+  if (!readable()) {
     ++index_;
     return false;
   }
-  // TODO: make this configurable.
-  bool ignore_fill = (ref_.resolution() <= kResolution_65536_ms);
-  if (read_data(reader_, sample, ignore_fill) == roo_io::kOk) {
+  int64_t start = read_position();
+  uint64_t sample_count;
+  roo_io::Status status = readEntryHeader(&sample_count);
+  if (status == roo_io::kOk && compressed()) {
+    status = readCompressedSamples(sample_count, accept, emit);
+  } else if (status == roo_io::kOk && mapped_.mapped()) {
+    status = finishMappedRead(decode_samples(
+        mapped_.data() + mapped_offset_, mapped_end(), sample_count,
+        has_directory(), directory_dictionary(), ignore_fill(), directory_,
+        accept, emit));
+  } else if (status == roo_io::kOk) {
+    status = read_samples(reader_, sample_count, has_directory(),
+                          directory_dictionary(), ignore_fill(), directory_,
+                          accept, emit);
+  }
+  stats_.bytes_read += read_position() - start;
+  return finishNext(status);
+}
+
+bool VaultFileReader::next(std::vector<Sample>* sample) {
+  sample->clear();
+  bool result = readEntry(
+      [this](uint64_t stream_id) { return accepts(stream_id); },
+      [sample](uint64_t stream_id, uint16_t avg, uint16_t min, uint16_t max,
+               uint16_t fill) {
+        sample->emplace_back(stream_id, avg, min, max, fill);
+      });
+  stats_.samples_read += sample->size();
+  return result;
+}
+
+bool VaultFileReader::next(SampleColumns* columns, size_t step) {
+  uint64_t samples_read = 0;
+  bool result = readEntry(
+      [columns](uint64_t stream_id) { return columns->find(stream_id) >= 0; },
+      [columns, step, &samples_read](uint64_t stream_id, uint16_t avg,
+                                     uint16_t min, uint16_t max,
+                                     uint16_t fill) {
+        columns->set(columns->find(stream_id), step, avg, min, max, fill);
+        ++samples_read;
+      });
+  stats_.samples_read += samples_read;
+  return result;
+}
+
+void VaultFileReader::readStreamIds(std::vector<uint64_t>* stream_ids) {
+  stream_ids->clear();
+  // Collects the stream IDs as they are looked at, and decodes nothing.
+  // Duplicates are removed whenever the count doubles, to bound the memory
+  // used.
+  size_t distinct = 0;
+  bool done = false;
+  while (!done) {
+    done = !readEntry(
+        [stream_ids](uint64_t stream_id) {
+          stream_ids->push_back(stream_id);
+          return false;
+        },
+        [](uint64_t, uint16_t, uint16_t, uint16_t, uint16_t) {});
+    if (!done && stream_ids->size() < 2 * distinct + kRangeElementCount) {
+      continue;
+    }
+    std::sort(stream_ids->begin(), stream_ids->end());
+    stream_ids->erase(std::unique(stream_ids->begin(), stream_ids->end()),
+                      stream_ids->end());
+    distinct = stream_ids->size();
+  }
+  close();
+}
+
+roo_io::Status VaultFileReader::readEntryHeader(uint64_t* sample_count) {
+  run_offset_ = read_position();
+  int run_length;
+  roo_io::Status status;
+  if (mapped_.mapped()) {
+    const uint8_t* p = mapped_.data() + mapped_offset_;
+    status = roo_io::kOk;
+    if (!decode_entry_header(&p, mapped_end(), has_runs(), sample_count,
+                             &run_length)) {
+      LOG(ERROR) << "Failed to read data from the mapped vault file "
+                 << roo_logging::hex << ref_;
+      status = mapped_status_ = roo_io::kReadError;
+    }
+    mapped_offset_ = p - mapped_.data();
+  } else {
+    status = read_entry_header(reader_, has_runs(), sample_count, &run_length);
+  }
+  // The first entry of the run is the one being read.
+  if (status == roo_io::kOk) run_remaining_ = run_length - 1;
+  return status;
+}
+
+roo_io::Status VaultFileReader::finishMappedRead(const uint8_t* end) {
+  if (end == nullptr) {
+    LOG(ERROR) << "Failed to read a sample from the mapped vault file "
+               << roo_logging::hex << ref_;
+    mapped_status_ = roo_io::kReadError;
+    return mapped_status_;
+  }
+  mapped_offset_ = end - mapped_.data();
+  return roo_io::kOk;
+}
+
+int VaultFileReader::empty_run_remaining() const {
+  if (run_remaining_ > 0) return run_remaining_;
+  if (!readable() && !past_eof()) return kRangeElementCount - index_;
+  return 0;
+}
+
+bool VaultFileReader::finishNext(roo_io::Status status) {
+  if (status == roo_io::kOk) {
+    ++stats_.entries_read;
     ++index_;
     if (past_eof()) {
       MLOG(roo_monitoring_vault_reader)
           << "End of file reached after successfully scanning the entire "
              "vault file ";
-      position_ = reader_.position();
-      reader_.close();
+      position_ = read_position();
+      close();
     }
     return true;
   }
-  if (reader_.status() == roo_io::kEndOfStream) {
+  if (status == roo_io::kEndOfStream) {
     MLOG(roo_monitoring_vault_reader)
         << "End of file reached prematurely, while reading data at index "
         << index_;
     position_ = 0;
   } else {
-    position_ = reader_.position();
+    position_ = read_position();
     LOG(ERROR) << "Error reading data at index " << index_;
   }
   ++index_;
-  reader_.close();
+  close();
   return false;
 }
 
 void VaultFileReader::seekForward(int64_t timestamp) {
-  int skip = (timestamp - ref_.timestamp()) >> (ref_.resolution() << 1);
-  if (skip <= 0) return;
-  DCHECK_LE(skip + index_, kRangeElementCount);
-  MLOG(roo_monitoring_vault_reader) << "Skipping " << skip << " steps";
-  if (skip + index_ >= kRangeElementCount) {
+  int target = (timestamp - ref_.timestamp()) >> (ref_.resolution() << 1);
+  if (target <= index_) return;
+  DCHECK_LE(target, kRangeElementCount);
+  seek(target);
+}
+
+void VaultFileReader::seek(int index) {
+  if (index <= index_) return;
+  if (!compressed() || index >= kRangeElementCount) {
+    skipTo(index);
+    return;
+  }
+  // The values are delta-encoded against the preceding entries of the
+  // block, so these are decoded (and dropped).
+  skipTo(index - index % kVaultDeltaBlockSize);
+  auto reject = [](uint64_t) { return false; };
+  auto drop = [](uint64_t, uint16_t, uint16_t, uint16_t, uint16_t) {};
+  while (index_ < index && readEntry(reject, drop)) {
+  }
+  if (index_ < index) index_ = index;
+}
+
+void VaultFileReader::skipTo(int index) {
+  if (index <= index_) return;
+  MLOG(roo_monitoring_vault_reader)
+      << "Skipping " << (index - index_) << " steps";
+  if (index >= kRangeElementCount) {
     index_ = kRangeElementCount;
-    reader_.close();
+    run_remaining_ = 0;
+    close();
     return;
   }
-  if (reader_.ok()) {
-    std::vector<Sample> ignored;
-    for (; !past_eof() && skip > 0; --skip) {
-      next(&ignored);
+  if (run_remaining_ >= index - index_) {
+    // Within the current run of empty entries.
+    run_remaining_ -= index - index_;
+    index_ = index;
+    return;
+  }
+  index_ += run_remaining_;
+  run_remaining_ = 0;
+  if (!readable()) {
+    index_ = index;
+    return;
+  }
+  uint32_t offset;
+  if (lookupIndex(index, &offset)) {
+    setReadPosition(offset);
+    if (readable()) {
+      index_ = index;
+      if (has_runs()) enterRun(offset);
+      return;
+    }
+    LOG(ERROR) << "Error seeking to the entry " << index << " at " << offset
+               << ": " << roo_io::StatusAsString(status());
+  }
+  while (index_ < index && reader_.ok()) {
+    run_offset_ = reader_.position();
+    int run_length;
+    if (skip_data(reader_, has_runs(), has_directory(), compressed(),
+                  directory_dictionary(), &run_length) != roo_io::kOk) {
+      break;
+    }
+    index_ += run_length;
+  }
+  if (index_ > index) {
+    // Stopped within a run of empty entries.
+    run_remaining_ = index_ - index;
+    index_ = index;
+  }
+  if (!readable()) {
+    if (status() != roo_io::kEndOfStream) {
+      LOG(ERROR) << "Error skipping data at index " << index_;
     }
+    index_ = index;
+    position_ = 0;
+    close();
+  }
+}
+
+int VaultFileReader::scanEntryCount() {
+  int count = index_ + run_remaining_;
+  if (has_index()) {
+    count = kRangeElementCount;
   } else {
-    index_ += skip;
+    int run_length;
+    while (count < kRangeElementCount && reader_.ok() &&
+           skip_data(reader_, has_runs(), has_directory(), compressed(),
+                     directory_dictionary(), &run_length) == roo_io::kOk) {
+      count += run_length;
+    }
+  }
+  index_ = kRangeElementCount;
+  run_remaining_ = 0;
+  close();
+  return std::min(count, kRangeElementCount);
+}
+
+bool VaultFileReader::has_index() {
+  if (index_offset_ < 0) {
+    index_offset_ = 0;
+    if (minor_version_ < 2 || !reader_.ok()) return false;
+    uint64_t position = reader_.position();
+    uint64_t size = reader_.size();
+    if (size >= 2 + kVaultIndexSize) {
+      reader_.seek(size - 4);
+      if (reader_.readBeU32() == kVaultIndexMagic) {
+        index_offset_ = size - kVaultIndexSize;
+      }
+    }
+    reader_.seek(position);
+  }
+  return index_offset_ > 0;
+}
+
+bool VaultFileReader::readCompactionCursor(int* write_index,
+                                           LogCursor* source) {
+  if (minor_version_ < 4 || !reader_.ok()) return false;
+  uint64_t position = reader_.position();
+  uint64_t size = reader_.size();
+  bool found = false;
+  if (size >= 2 + 5) {
+    reader_.seek(size - 5);
+    uint8_t record_size = reader_.readU8();
+    if (reader_.readBeU32() == kVaultCursorMagic && record_size >= 5 &&
+        size >= 2u + record_size) {
+      reader_.seek(size - record_size);
+      uint64_t sample_count = reader_.readVarU64();
+      uint64_t marker = reader_.readVarU64();
+      int index = reader_.readU8();
+      int64_t file = reader_.readVarU64();
+      int64_t offset = reader_.readVarU64();
+      found = reader_.ok() && sample_count == 0 &&
+              marker == kVaultCursorMarker && index < kRangeElementCount &&
+              reader_.position() == size - 5;
+      if (found) {
+        *write_index = index;
+        *source = LogCursor(file, offset);
+      }
+    }
+  }
+  reader_.seek(position);
+  return found;
+}
+
+bool VaultFileReader::lookupIndex(int index, uint32_t* offset) {
+  if (!has_index()) return false;
+  if (mapped_.mapped()) {
+    // Validated when the file was mapped.
+    *offset = readIndexEntry(index);
+    return true;
+  }
+  uint64_t position = reader_.position();
+  *offset = readIndexEntry(index);
+  if (!reader_.ok() || *offset < 2 || *offset >= index_offset_) {
+    LOG(ERROR) << "Invalid entry-offset index in the vault file "
+               << roo_logging::hex << ref_ << "; ignoring";
+    index_offset_ = 0;
+    reader_.seek(position);
+    return false;
+  }
+  return true;
+}
+
+uint32_t VaultFileReader::readIndexEntry(int index) {
+  if (mapped_.mapped()) {
+    return decode_be32(mapped_.data() + index_offset_ + 4 * index);
+  }
+  reader_.seek(index_offset_ + 4 * index);
+  return reader_.readBeU32();
+}
+
+void VaultFileReader::enterRun(uint32_t offset) {
+  uint64_t sample_count;
+  int run_length;
+  bool is_run;
+  if (mapped_.mapped()) {
+    const uint8_t* p = mapped_.data() + offset;
+    is_run = decode_entry_header(&p, mapped_end(), true, &sample_count,
+                                 &run_length) &&
+             sample_count == 0;
+    if (is_run) mapped_offset_ = p - mapped_.data();
+  } else {
+    is_run = read_entry_header(reader_, true, &sample_count, &run_length) ==
+                 roo_io::kOk &&
+             sample_count == 0;
+    if (!is_run) reader_.seek(offset);
+  }
+  if (!is_run) return;
+  uint64_t position = read_position();
+  // The run starts at the first entry with the same offset; all entries
+  // before it have smaller offsets. Binary-search the index for it.
+  int lo = std::max(0, index_ - run_length + 1);
+  int hi = index_;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (readIndexEntry(mid) < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
+  setReadPosition(position);
+  if (!readable()) return;
+  run_offset_ = offset;
+  // Entries [lo, lo + run_length) form the run; index_ is within it.
+  run_remaining_ = lo + run_length - index_;
 }
 
 bool VaultFileReader::past_eof() const { return index_ >= kRangeElementCount; }
@@ -1,12 +1,17 @@
 #pragma once
 
 #include <ostream>
+#include <vector>
 
+#include "columns.h"
 #include "common.h"
 #include "log.h"  // for LogCursor.
+#include "mapped_file.h"
 #include "roo_io/data/multipass_input_stream_reader.h"
 #include "roo_logging.h"
 #include "sample.h"
+#include "stats.h"
+#include "stream_filter.h"
 
 namespace roo_monitoring {
 
@@ -84,25 +89,128 @@ class VaultFileRef {
 roo_logging::Stream& operator<<(roo_logging::Stream& os,
                                 const VaultFileRef& file_ref);
 
+/// Current minor version of the vault file format.
+static const uint8_t kVaultFormatMinorVersion = 7;
+
+/// Magic number terminating the entry-offset index of finished vault files.
+static const uint32_t kVaultIndexMagic = 0x52564958;  // "RVIX"
+
+/// Size, in bytes, of the entry-offset index footer.
+static const int kVaultIndexSize = 4 * kRangeElementCount + 4;
+
+/// Value of the run length field that marks a compaction cursor record.
+static const uint64_t kVaultCursorMarker = 0x3FFF;
+
+/// Magic number terminating compaction cursor records.
+static const uint32_t kVaultCursorMagic = 0x52564355;  // "RVCU"
+
+/// Vault file header flag: the values are stored in the compressed encoding.
+static const uint8_t kVaultFlagCompressed = 0x01;
+
+/// Number of consecutive entries (aligned) whose values are delta-encoded
+/// against each other in compressed vault files. When ROO_MONITORING_TESTING
+/// is defined, 4, so that a range spans several blocks.
+#ifdef ROO_MONITORING_TESTING
+static const int kVaultDeltaBlockSize = 4;
+#else
+static const int kVaultDeltaBlockSize = 16;
+#endif
+
+/// Delta-encoding state of a stream that has not appeared yet in the current
+/// block of a compressed vault file.
+static const uint32_t kVaultNoDeltaBase = 0x10000;
+
+/// Encodes the (wrapped) difference of two values as a small unsigned
+/// number (zigzag), for the compressed vault encoding.
+inline uint16_t VaultDeltaEncode(uint16_t value, uint16_t base) {
+  uint16_t delta = value - base;
+  return (uint16_t)(delta << 1) ^ ((delta & 0x8000) ? 0xFFFF : 0);
+}
+
+/// Inverse of `VaultDeltaEncode()`.
+inline uint16_t VaultDeltaDecode(uint64_t encoded, uint16_t base) {
+  return base + (uint16_t)((encoded >> 1) ^ -(encoded & 1));
+}
+
 /// Sequential reader for a single vault file.
 ///
 /// A single vault file has the following format:
 ///
 /// header:
 ///   major version (uint8): currently always 1
-///   minor version (uint8): currently always 1
+///   minor version (uint8): 1 to 7
+///   flags (uint8, minor version >= 7): kVaultFlagCompressed, if set
+///   dictionary (minor version >= 6):
+///     size        (varint)
+///     stream ID[] (varint): sorted, each stored as the delta to the
+///                 previous one
 /// entry[]:
 ///   sample count (varint)
-///   sample[]:
+///   run length   (varint, minor version >= 3, if sample count is zero):
+///                number of empty entries following this one
+///   sample[] (minor version <= 4):
 ///     stream ID (varint)
 ///     avg       (uint16)
 ///     min       (uint16)
 ///     max       (uint16)
 ///     fill      (uint16)
+///   stream ID[] (varint, minor version 5): the directory of the entry
+///   stream code[] (varint, minor version >= 6): the directory of the entry;
+///               either 1 + the index of the stream ID in the dictionary, or
+///               0 followed by the stream ID (varint)
+///   payload[]   (minor version >= 5): avg, min, max, and fill (uint16) of
+///               the sample of the corresponding directory stream
+///   compressed sample[] (if compressed, instead of the above):
+///     stream code (varint): as in the directory
+///     head        (varint): avg << 3 | flags. The avg is stored as
+///                 VaultDeltaEncode(avg, previous) if the stream is in the
+///                 dictionary and has appeared in an earlier entry of the
+///                 same block of kVaultDeltaBlockSize entries, previous
+///                 being its last avg value; otherwise, as is. Flag bits
+///                 mark the presence of the following fields.
+///     min         (varint, if flag bit 0): VaultDeltaEncode(min, avg)
+///     max         (varint, if flag bit 1): VaultDeltaEncode(max, avg)
+///     fill        (varint, if flag bit 2); otherwise 100% (0x2000)
+/// cursor (minor version >= 4, hot files only; may follow any entry;
+/// dropped when the file is finished):
+///   marker       (varint 0, varint kVaultCursorMarker)
+///   write index  (uint8): number of entries before the cursor
+///   source file  (varint): start timestamp of the file compacted into this
+///                one (a log file, or a lower-level vault file)
+///   source offset (varint): byte offset in the source file up to which the
+///                data has been compacted
+///   size         (uint8): size of the cursor record, in bytes
+///   magic        (uint32): kVaultCursorMagic
+/// index (minor version >= 2, finished files only):
+///   entry offset[] (uint32): byte offset of each of the 256 entries
+///   magic          (uint32): kVaultIndexMagic
 ///
 /// The file name of the vault file implies the start timestamp.
 /// The level implies the time resolution.
-/// The finished vault always has 256 entries.
+/// The finished vault always has 256 entries. Since version 1.2, finished
+/// files are terminated by the entry-offset index, which allows readers to
+/// seek to any entry directly. Hot (unfinished) files, and files in the 1.1
+/// format, are scanned sequentially instead. Since version 1.3, consecutive
+/// empty entries are stored as a single record (a run); all entries of a run
+/// share the same offset in the index. Since version 1.4, the compaction
+/// cursor of a hot file is appended to the file itself (see
+/// `readCompactionCursor()`); readers skip over cursor records, which
+/// finished files written by older versions may still have. Since version
+/// 1.5, the stream IDs of an entry precede its (fixed-width) payloads, so
+/// that readers restricted to a few streams (see
+/// `setStreamFilter()`) skip over the payloads of the others without
+/// decoding them. Since version 1.6, the header holds a dictionary of the
+/// streams expected in the file (the streams of the preceding file), and
+/// the directories refer to the streams by their (small) dictionary
+/// indices. Since version 1.7, the values may be compressed (see
+/// `Collection::enableVaultCompression()`): slowly changing values take a
+/// byte or two, instead of eight. Compressed entries cannot be resumed from
+/// a byte offset (`tell()` returns offset 0, which resumes by index), and
+/// seeking decodes the entries from the start of the block.
+///
+/// If the collection has mapped reads enabled (see
+/// `Collection::enableMappedReads()`), finished files are memory-mapped, and
+/// entries are decoded directly from the mapped bytes.
 class VaultFileReader {
  public:
   /// Creates a reader bound to the specified collection.
@@ -111,18 +219,49 @@ class VaultFileReader {
   // VaultFileReader(const VaultFileReader& other) = delete;
   // VaultFileReader& operator=(VaultFileReader&& other);
 
+  /// Returns true if the fill values stored in vault files of the specified
+  /// resolution are ignored, i.e. read as 100%.
+  static bool IgnoresFill(Resolution resolution);
+
   /// Opens the file and seeks to the specified index and byte offset.
+  ///
+  /// If offset is zero, the header is read, and the reader is positioned at
+  /// the specified entry index (using the entry-offset index if available).
+  /// The offset is also ignored if the file has been finished since, as
+  /// finishing it may move the entries.
   bool open(const VaultFileRef& ref, int index, int64_t offset);
   /// Returns true if a file is currently open.
-  bool is_open() const { return reader_.isOpen(); }
+  bool is_open() const { return mapped_.mapped() || reader_.isOpen(); }
+
+  /// Returns true if the open file is read through a memory mapping.
+  bool is_mapped() const { return mapped_.mapped(); }
 
   /// Closes the reader.
-  void close() { reader_.close(); }
+  void close() {
+    reader_.close();
+    mapped_.unmap();
+  }
+
+  /// Restricts the samples returned by `next()` to the streams matched by the
+  /// filter, or lifts the restriction if filter is nullptr. The filter must
+  /// outlive the reader, or the next call to this method.
+  void setStreamFilter(const StreamFilter* filter) { filter_ = filter; }
 
   /// Advances the cursor to the first entry at or after the timestamp.
   void seekForward(int64_t timestamp);
-  /// Reads the next entry and fills the sample vector.
+  /// Advances the cursor to the specified entry index.
+  ///
+  /// Uses the entry-offset index if the file has one; otherwise, skips over
+  /// the preceding entries without decoding them.
+  void seek(int index);
+  /// Reads the next entry and fills the sample vector (with the samples of
+  /// the streams matched by the stream filter, if set).
   bool next(std::vector<Sample>* sample);
+  /// Reads the next entry into the specified step of the columnar buffer.
+  ///
+  /// Only the streams requested by the buffer are decoded; others are
+  /// skipped. The step must have been cleared by the caller.
+  bool next(SampleColumns* columns, size_t step);
   /// Returns the current entry index.
   int index() const { return index_; }
   /// Returns true if the reader has passed the end of file.
@@ -133,12 +272,14 @@ class VaultFileReader {
   /// If open fails for any reason other than not found, or if read fails,
   /// this returns false.
   bool ok() const {
-    return reader_.status() == roo_io::kOk ||
-           reader_.status() == roo_io::kNotFound;
+    return status() == roo_io::kOk || status() == roo_io::kNotFound;
   }
 
   /// Returns the current reader status.
-  roo_io::Status status() const { return reader_.status(); }
+  roo_io::Status status() const {
+    if (mapped_.mapped()) return roo_io::kOk;
+    return mapped_status_ != roo_io::kOk ? mapped_status_ : reader_.status();
+  }
 
   /// Returns the vault file reference for this reader.
   const VaultFileRef& vault_ref() const { return ref_; }
@@ -146,15 +287,185 @@ class VaultFileReader {
   /// Returns the current log cursor.
   LogCursor tell();
 
+  /// Returns the byte offset of the record holding the next entry to be
+  /// read. (Within a run of empty entries, that is the offset of the run.)
+  int64_t position() const {
+    return run_remaining_ > 0 ? run_offset_ : read_position();
+  }
+
+  /// Returns the number of entries, starting at the current index, that are
+  /// known to be empty without reading anything: the rest of the current run
+  /// of empty entries or, if the file does not exist or has no more data,
+  /// all of the remaining ones.
+  int empty_run_remaining() const;
+
+  /// Returns the minor format version of the open file, or 0 if unknown.
+  uint8_t minor_version() const { return minor_version_; }
+
+  /// Returns true if the values in the open file are compressed.
+  bool compressed() const { return (flags_ & kVaultFlagCompressed) != 0; }
+
+  /// Returns the stream dictionary of the open file (sorted), or an empty
+  /// one if the file format is older than 1.6.
+  const std::vector<uint64_t>& dictionary() const { return dictionary_; }
+
+  /// Collects the distinct stream IDs (sorted) of the remaining entries of
+  /// the open file, without decoding the samples. Closes the reader
+  /// afterwards.
+  void readStreamIds(std::vector<uint64_t>* stream_ids);
+
+  /// Reads the compaction cursor of the open file: the number of entries in
+  /// the file, and the position in the source file up to which the data has
+  /// been compacted.
+  ///
+  /// The cursor is valid only if it is the last record in the file; any
+  /// later append invalidates it. Returns false if there is no valid cursor,
+  /// including if the file format is older than 1.4. Does not move the read
+  /// position.
+  bool readCompactionCursor(int* write_index, LogCursor* source);
+
+  /// Returns the number of complete entries in the file.
+  ///
+  /// Skips over the remaining entries without decoding them (or uses the
+  /// entry-offset index, if the file has one). Closes the reader afterwards.
+  int scanEntryCount();
+
+  /// Returns true if the open file has an entry-offset index.
+  ///
+  /// Looks up the index on first use.
+  bool has_index();
+
+  /// Returns the counters of reads done by this reader, across all files.
+  const VaultReadStats& stats() const { return stats_; }
+
   ~VaultFileReader();
 
  private:
+  // Tries to map the file at the specified path. Succeeds only for finished
+  // files with a valid entry-offset index.
+  bool openMapped(const char* path);
+
+  // Returns true if there is more data to read from the open file.
+  bool readable() const { return mapped_.mapped() || reader_.ok(); }
+
+  // Returns the byte offset of the read position in the open file.
+  uint64_t read_position() const {
+    return mapped_.mapped() ? mapped_offset_ : reader_.position();
+  }
+
+  // Moves the read position to the specified byte offset.
+  void setReadPosition(uint64_t position);
+
+  // Reads the byte offset of the specified entry from the index, which must
+  // exist. Moves the read position, unless the file is mapped.
+  uint32_t readIndexEntry(int index);
+
+  // Completes decoding of an entry from the mapping, given the end of the
+  // decoded data, or nullptr if the entry extends past the end.
+  roo_io::Status finishMappedRead(const uint8_t* end);
+
+  // Returns the entries' data of the mapped file, i.e. up to the index.
+  const uint8_t* mapped_end() const { return mapped_.data() + index_offset_; }
+
+  // Reads the byte offset of the specified entry from the index. Returns
+  // false if the file does not have an index.
+  bool lookupIndex(int index, uint32_t* offset);
+
+  // Returns true if the fill values stored in the file should be ignored.
+  bool ignore_fill() const;
+
+  // Completes reading of an entry, given the status of the read.
+  bool finishNext(roo_io::Status status);
+
+  // Reads the next entry. Calls accept(stream_id) to determine whether to
+  // decode a sample, and emit(stream_id, avg, min, max, fill) for each of
+  // the decoded ones.
+  template <typename Accept, typename Emit>
+  bool readEntry(Accept accept, Emit emit);
+
+  // Returns true if the open file may contain runs of empty entries.
+  bool has_runs() const { return minor_version_ >= 3; }
+
+  // Returns true if the entries of the open file have stream-ID directories.
+  bool has_directory() const { return minor_version_ >= 5 && !compressed(); }
+
+  // Same as seek(), but does not decode the entries of compressed files;
+  // the resulting position is valid only at the start of a block.
+  void skipTo(int index);
+
+  // Reads the samples of a compressed entry at the read position.
+  template <typename Accept, typename Emit>
+  roo_io::Status readCompressedSamples(uint64_t sample_count, Accept accept,
+                                       Emit emit);
+
+  // Returns the dictionary that the directories refer to, or nullptr if
+  // they hold stream IDs.
+  const std::vector<uint64_t>* directory_dictionary() const {
+    return minor_version_ >= 6 ? &dictionary_ : nullptr;
+  }
+
+  // Returns true if the sample of the specified stream is to be returned by
+  // next().
+  bool accepts(uint64_t stream_id) const {
+    return filter_ == nullptr || filter_->contains(stream_id);
+  }
+
+  // Reads the header of the next entry, and starts a run of empty entries if
+  // the entry begins one.
+  roo_io::Status readEntryHeader(uint64_t* sample_count);
+
+  // Called after seeking to the record at the specified offset, holding the
+  // entry at index_. If that record is a run of empty entries, reads it and
+  // positions within the run; otherwise, leaves the reader at the record.
+  void enterRun(uint32_t offset);
+
   const Collection* collection_;
   VaultFileRef ref_;
   roo_io::Mount fs_;
   roo_io::MultipassInputStreamReader reader_;
   int index_;
   int position_;
+
+  // Minor version of the open file, or 0 if unknown.
+  uint8_t minor_version_;
+
+  // Header flags of the open file.
+  uint8_t flags_;
+
+  // Byte offset of the entry-offset index; -1 if not yet looked up, and 0 if
+  // the file does not have one.
+  int64_t index_offset_;
+
+  // Number of empty entries left in the current run, starting at index_,
+  // and the byte offset of that run.
+  int run_remaining_;
+  uint32_t run_offset_;
+
+  // Mapping of the open file, if it is read that way, and the read position
+  // within it.
+  MappedFile mapped_;
+  uint64_t mapped_offset_;
+
+  // Error of a failed read from the mapping, kept after it is unmapped;
+  // kOk otherwise.
+  roo_io::Status mapped_status_;
+
+  // Not owned; nullptr if all streams are read.
+  const StreamFilter* filter_;
+
+  // The stream-ID directory of the entry being read; reused across entries.
+  std::vector<uint64_t> directory_;
+
+  // The stream dictionary of the open file.
+  std::vector<uint64_t> dictionary_;
+
+  // For compressed files: the last avg value of every dictionary stream
+  // within the current block of entries (or kVaultNoDeltaBase), and the
+  // index of that block (-1 if none).
+  std::vector<uint32_t> previous_avg_;
+  int delta_block_;
+
+  VaultReadStats stats_;
 };
 
 }  // namespace roo_monitoring
@@ -0,0 +1,102 @@
+#include "vault_cache.h"
+
+#include "roo_monitoring.h"
+
+namespace roo_monitoring {
+
+std::shared_ptr<const DecodedVaultFile> DecodedVaultFile::Load(
+    const Collection* collection, const VaultFileRef& ref) {
+  VaultFileReader reader(collection);
+  if (!reader.open(ref, 0, 0)) return nullptr;
+  std::shared_ptr<DecodedVaultFile> result(new DecodedVaultFile());
+  std::vector<Sample> samples;
+  while (!reader.past_eof() && reader.next(&samples)) {
+    result->samples_.insert(result->samples_.end(), samples.begin(),
+                            samples.end());
+    result->offsets_.push_back(result->samples_.size());
+  }
+  // Entries past the ones read (e.g. in a hot file) are treated as empty,
+  // the same way VaultFileReader treats them.
+  result->samples_.shrink_to_fit();
+  result->offsets_.shrink_to_fit();
+  return result;
+}
+
+VaultCache::VaultCache(size_t max_bytes)
+    : max_bytes_(max_bytes), bytes_(0), hits_(0), misses_(0), epoch_(0) {}
+
+std::shared_ptr<const DecodedVaultFile> VaultCache::get(
+    const Collection* collection, const VaultFileRef& ref) {
+  Key key = KeyOf(ref);
+  uint64_t epoch;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto i = index_.find(key);
+    if (i != index_.end()) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, i->second);
+      return i->second->file;
+    }
+    ++misses_;
+    epoch = epoch_;
+  }
+  // Decode outside of the lock. The result is only cached if nothing has
+  // been invalidated in the meantime, since it may predate a write. If
+  // another thread has cached the file in the meantime, its entry is kept.
+  std::shared_ptr<const DecodedVaultFile> file =
+      DecodedVaultFile::Load(collection, ref);
+  if (file == nullptr || file->bytes() > max_bytes_) return file;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (epoch != epoch_ || index_.find(key) != index_.end()) return file;
+  while (bytes_ + file->bytes() > max_bytes_) {
+    erase(std::prev(lru_.end()));
+  }
+  lru_.push_front(Entry{key, file});
+  index_[key] = lru_.begin();
+  bytes_ += file->bytes();
+  return file;
+}
+
+void VaultCache::invalidate(const VaultFileRef& ref) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++epoch_;
+  auto i = index_.find(KeyOf(ref));
+  if (i != index_.end()) erase(i->second);
+}
+
+void VaultCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++epoch_;
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
+
+size_t VaultCache::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+uint64_t VaultCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t VaultCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+float VaultCache::hit_rate() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t total = hits_ + misses_;
+  return total == 0 ? 0.0f : (float)hits_ / total;
+}
+
+void VaultCache::erase(std::list<Entry>::iterator entry) {
+  bytes_ -= entry->file->bytes();
+  index_.erase(entry->key);
+  lru_.erase(entry);
+}
+
+}  // namespace roo_monitoring
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "sample.h"
+#include "vault.h"
+
+namespace roo_monitoring {
+
+class Collection;
+
+/// All entries of a vault file, decoded.
+class DecodedVaultFile {
+ public:
+  /// Reads and decodes the specified vault file. Returns nullptr if the file
+  /// does not exist, or cannot be read.
+  static std::shared_ptr<const DecodedVaultFile> Load(
+      const Collection* collection, const VaultFileRef& ref);
+
+  /// Returns the number of entries (up to kRangeElementCount).
+  int entry_count() const { return (int)offsets_.size() - 1; }
+
+  /// Returns true if the file has all its entries, and thus never changes.
+  bool finished() const { return entry_count() == kRangeElementCount; }
+
+  /// Returns a pointer to the samples of the specified entry.
+  const Sample* entry_begin(int index) const {
+    return samples_.data() + offsets_[index];
+  }
+
+  /// Returns a pointer past the samples of the specified entry.
+  const Sample* entry_end(int index) const {
+    return samples_.data() + offsets_[index + 1];
+  }
+
+  /// Returns the (approximate) memory used, in bytes.
+  size_t bytes() const {
+    return sizeof(*this) + samples_.capacity() * sizeof(Sample) +
+           offsets_.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  DecodedVaultFile() : offsets_(1, 0) {}
+
+  // Samples of all entries, concatenated.
+  std::vector<Sample> samples_;
+
+  // Start of each entry in samples_, plus the past-end offset.
+  std::vector<uint32_t> offsets_;
+};
+
+/// LRU cache of decoded vault files, bounded by memory use.
+///
+/// Used by `VaultIterator`, so that repeated queries over the same time
+/// window do not re-read and re-decode the same vault files. Finished vault
+/// files never change, so they stay cached until evicted. Hot (unfinished)
+/// files are invalidated by `VaultWriter` whenever it writes to them.
+///
+/// Thread-safe. Cached files are shared with iterators via `shared_ptr`, so
+/// eviction and invalidation never affect iterators that are using them.
+class VaultCache {
+ public:
+  /// Creates a cache that uses at most max_bytes for decoded data.
+  explicit VaultCache(size_t max_bytes);
+
+  VaultCache(const VaultCache&) = delete;
+  VaultCache& operator=(const VaultCache&) = delete;
+
+  /// Returns the decoded vault file, loading (and caching) it on a miss.
+  /// Returns nullptr if the file does not exist or cannot be read.
+  std::shared_ptr<const DecodedVaultFile> get(const Collection* collection,
+                                              const VaultFileRef& ref);
+
+  /// Drops the specified file from the cache.
+  void invalidate(const VaultFileRef& ref);
+
+  /// Drops all files from the cache.
+  void clear();
+
+  /// Returns the memory used by the cached files, in bytes.
+  size_t bytes() const;
+
+  /// Returns the memory limit, in bytes.
+  size_t max_bytes() const { return max_bytes_; }
+
+  /// Returns the number of lookups served from the cache.
+  uint64_t hits() const;
+
+  /// Returns the number of lookups that needed reading the file.
+  uint64_t misses() const;
+
+  /// Returns hits / (hits + misses), or 0 if there have been no lookups.
+  float hit_rate() const;
+
+ private:
+  typedef std::pair<int, int64_t> Key;
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const DecodedVaultFile> file;
+  };
+
+  static Key KeyOf(const VaultFileRef& ref) {
+    return Key(ref.resolution(), ref.timestamp());
+  }
+
+  // Removes the entry; must be called with mutex_ held.
+  void erase(std::list<Entry>::iterator entry);
+
+  const size_t max_bytes_;
+
+  mutable std::mutex mutex_;
+
+  // Most recently used first.
+  std::list<Entry> lru_;
+  std::map<Key, std::list<Entry>::iterator> index_;
+  size_t bytes_;
+  uint64_t hits_;
+  uint64_t misses_;
+
+  // Incremented by every invalidation; loads that overlap one are not
+  // cached.
+  uint64_t epoch_;
+};
+
+}  // namespace roo_monitoring
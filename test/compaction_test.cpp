@@ -1,9 +1,15 @@
 #include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include "fakefs_reference.h"
 #include "gtest/gtest.h"
 #include "roo_monitoring.h"
+#include "roo_monitoring/compaction.h"
+#include "roo_monitoring/compaction_service.h"
+#include "roo_monitoring/manifest.h"
 
 namespace roo_monitoring {
 namespace {
@@ -50,13 +56,21 @@ TEST(VaultCompactionTest, AggregatesToParentVault) {
   EXPECT_EQ(samples[0].max_value(), expected_max);
   EXPECT_EQ(samples[0].fill(), 0x2000);
 
-  String parent_path;
-  collection.getVaultFilePath(parent_ref, &parent_path);
-  String cursor_path = parent_path + ".cursor";
+  // The parent file is hot; its compaction cursor is embedded in it, rather
+  // than in a separate cursor file.
+  reader.close();
+  ASSERT_TRUE(reader.open(parent_ref, 0, 0));
+  int write_index;
+  LogCursor source;
+  ASSERT_TRUE(reader.readCompactionCursor(&write_index, &source));
+  EXPECT_EQ(write_index, 1);
+  EXPECT_EQ(source.file(), 0);
+  EXPECT_GT(source.position(), 0);
+  FilePath cursor_path;
+  collection.getVaultFilePath(parent_ref, &cursor_path);
+  cursor_path.append(".cursor");
   roo_io::Mount mount = fs.mount();
-  roo_io::Stat cursor_stat = mount.stat(cursor_path.c_str());
-  EXPECT_EQ(cursor_stat.status(), roo_io::kOk);
-  EXPECT_TRUE(cursor_stat.isFile());
+  EXPECT_EQ(mount.stat(cursor_path.c_str()).status(), roo_io::kNotFound);
 }
 
 TEST(VaultCompactionTest, AggregatesAcrossTwoLevels) {
@@ -100,5 +114,477 @@ TEST(VaultCompactionTest, AggregatesAcrossTwoLevels) {
   EXPECT_EQ(samples[0].fill(), 0x2000);
 }
 
+// Writes samples at the steps for which `present` returns true, and checks
+// that flushing with a minimal budget (and optionally, fused compaction, or
+// compressed vault files) gives the same vault contents as flushAll(). Sets
+// `calls` to the number of flushFor() calls.
+void checkBudgetedFlushMatchesFlushAll(bool (*present)(int step), bool fused,
+                                       bool compressed, int* calls) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection reference(fs, "reference", kResolution_1_ms);
+  Collection budgeted(fs, "budgeted", kResolution_1_ms);
+  Writer reference_writer(&reference);
+  Writer budgeted_writer(&budgeted);
+  if (fused) budgeted_writer.enableFusedCompaction();
+  if (compressed) budgeted.enableVaultCompression();
+
+  for (Writer* writer : {&reference_writer, &budgeted_writer}) {
+    WriteTransaction tx(writer);
+    for (int i = 0; i < 43; ++i) {
+      if (!present(i)) continue;
+      tx.write(i, 1, static_cast<float>(i));
+      if (i % 3 == 0) tx.write(i, 2, static_cast<float>(100 - i));
+    }
+  }
+  reference_writer.flushAll();
+  reference_writer.flushAll();
+
+  // With the minimal budget, every call writes about one vault entry. The
+  // first loop flushes historical log files; the second one the hot one.
+  *calls = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    FlushBacklog backlog(0, false);
+    do {
+      backlog = budgeted_writer.flushFor(FlushBudget::Bytes(1));
+      ++*calls;
+      ASSERT_LT(*calls, 1000);
+    } while (!backlog.empty());
+  }
+  EXPECT_EQ(budgeted_writer.io_state(), Writer::IOSTATE_OK);
+
+  for (int level = 0; level < 3; ++level) {
+    Resolution resolution = Resolution(kResolution_1_ms + level);
+    VaultIterator expected(&reference, 0, resolution);
+    VaultIterator actual(&budgeted, 0, resolution);
+    std::vector<Sample> expected_samples;
+    std::vector<Sample> actual_samples;
+    for (int i = 0; i < 48; ++i) {
+      expected.next(&expected_samples);
+      actual.next(&actual_samples);
+      ASSERT_EQ(expected_samples.size(), actual_samples.size())
+          << "level " << level << ", step " << i;
+      for (size_t j = 0; j < expected_samples.size(); ++j) {
+        EXPECT_EQ(expected_samples[j].stream_id(),
+                  actual_samples[j].stream_id());
+        EXPECT_EQ(expected_samples[j].avg_value(),
+                  actual_samples[j].avg_value());
+        EXPECT_EQ(expected_samples[j].min_value(),
+                  actual_samples[j].min_value());
+        EXPECT_EQ(expected_samples[j].max_value(),
+                  actual_samples[j].max_value());
+        EXPECT_EQ(expected_samples[j].fill(), actual_samples[j].fill());
+      }
+    }
+  }
+}
+
+TEST(VaultCompactionTest, BudgetedFlushMatchesFlushAll) {
+  int calls;
+  checkBudgetedFlushMatchesFlushAll([](int step) { return true; }, false,
+                                    false, &calls);
+  EXPECT_GT(calls, 40);
+}
+
+TEST(VaultCompactionTest, BudgetedFusedFlushMatchesFlushAll) {
+  int calls;
+  checkBudgetedFlushMatchesFlushAll([](int step) { return true; }, true,
+                                    false, &calls);
+}
+
+TEST(VaultCompactionTest, BudgetedCompressedFlushMatchesFlushAll) {
+  // Every call appends to the vault files mid-block, so the writer resumes
+  // the delta encoding from the file.
+  int calls;
+  checkBudgetedFlushMatchesFlushAll([](int step) { return true; }, false, true,
+                                    &calls);
+  checkBudgetedFlushMatchesFlushAll([](int step) { return true; }, true, true,
+                                    &calls);
+  checkBudgetedFlushMatchesFlushAll(
+      [](int step) { return step < 3 || step == 21 || step > 38; }, false,
+      true, &calls);
+}
+
+TEST(VaultCompactionTest, BudgetedFlushOfSparseDataMatchesFlushAll) {
+  // Long gaps, stored as runs of empty entries, at all levels.
+  int calls;
+  checkBudgetedFlushMatchesFlushAll(
+      [](int step) { return step < 3 || step == 21 || step > 38; }, false,
+      false, &calls);
+}
+
+TEST(VaultCompactionTest, FusedCompactionMatchesLevelByLevel) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection reference(fs, "reference", kResolution_1_ms);
+  Collection fused(fs, "fused", kResolution_1_ms);
+  Writer reference_writer(&reference);
+  std::unique_ptr<Writer> fused_writer(new Writer(&fused));
+  fused_writer->enableFusedCompaction();
+
+  // Flushes after every round, so that hot ranges get compacted
+  // incrementally. Leaves a gap of more than a range in the log, and restarts
+  // the fused writer, both of which bring back level-by-level compaction for
+  // a range.
+  int step = 0;
+  for (int round = 0; round < 12; ++round) {
+    int end = step + 7 + 5 * round;
+    if (round == 4) step += 40;
+    for (Writer* writer : {&reference_writer, fused_writer.get()}) {
+      WriteTransaction tx(writer);
+      for (int i = step; i < end; ++i) {
+        tx.write(i, 1, static_cast<float>(i % 50));
+        if (i % 3 == 0) tx.write(i, 2, static_cast<float>(100 - i % 70));
+      }
+    }
+    reference_writer.flushAll();
+    fused_writer->flushAll();
+    if (round == 7) {
+      fused_writer.reset(new Writer(&fused));
+      fused_writer->enableFusedCompaction();
+    }
+    step = end;
+  }
+  EXPECT_EQ(fused_writer->io_state(), Writer::IOSTATE_OK);
+  // Ancestor levels need no cursors; only the hot base file does.
+  EXPECT_LT(fused_writer->stats().cursors_embedded,
+            reference_writer.stats().cursors_embedded / 2);
+
+  for (int level = 0; level < 5; ++level) {
+    Resolution resolution = Resolution(kResolution_1_ms + level);
+    VaultIterator expected(&reference, 0, resolution);
+    VaultIterator actual(&fused, 0, resolution);
+    std::vector<Sample> expected_samples;
+    std::vector<Sample> actual_samples;
+    for (int i = 0; i <= (step >> (2 * level)); ++i) {
+      expected.next(&expected_samples);
+      actual.next(&actual_samples);
+      ASSERT_EQ(expected_samples.size(), actual_samples.size())
+          << "level " << level << ", step " << i;
+      for (size_t j = 0; j < expected_samples.size(); ++j) {
+        EXPECT_EQ(expected_samples[j].stream_id(),
+                  actual_samples[j].stream_id());
+        EXPECT_EQ(expected_samples[j].avg_value(),
+                  actual_samples[j].avg_value());
+        EXPECT_EQ(expected_samples[j].min_value(),
+                  actual_samples[j].min_value());
+        EXPECT_EQ(expected_samples[j].max_value(),
+                  actual_samples[j].max_value());
+        EXPECT_EQ(expected_samples[j].fill(), actual_samples[j].fill());
+      }
+    }
+  }
+}
+
+TEST(ManifestTest, TracksFilesAndSkipsMissingVaults) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  ASSERT_EQ(collection.enableManifest(), roo_io::kOk);
+  {
+    Writer writer(&collection);
+    for (int64_t i = 0; i <= 2 * kRangeElementCount; ++i) {
+      WriteTransaction tx(&writer);
+      tx.write(i, 1, 10.0f);
+    }
+    writer.flushAll();
+    writer.flushAll();
+  }
+  // Only the hot log file remains.
+  EXPECT_EQ(collection.manifest()->logFiles(),
+            (std::vector<int64_t>{2 * kRangeElementCount}));
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  EXPECT_TRUE(collection.manifest()->hasVaultFile(ref));
+  EXPECT_TRUE(collection.manifest()->hasVaultFile(ref.parent()));
+  EXPECT_FALSE(collection.manifest()->hasVaultFile(ref.advance(3)));
+
+  // A vault file written behind the manifest's back is not seen, even after
+  // reloading the manifest; i.e. missing files are not probed for.
+  VaultFileRef hidden = ref.advance(3);
+  {
+    Collection unmanaged(fs, "test", kResolution_1_ms);
+    VaultWriter writer(&unmanaged, hidden);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    writer.writeLogData({LogSample(1, 7)});
+    writer.close();
+  }
+  std::vector<Sample> samples;
+  Collection reloaded(fs, "test", kResolution_1_ms);
+  ASSERT_EQ(reloaded.enableManifest(), roo_io::kOk);
+  EXPECT_EQ(reloaded.manifest()->logFiles(),
+            collection.manifest()->logFiles());
+  VaultIterator it(&reloaded, hidden.timestamp(), kResolution_1_ms);
+  it.next(&samples);
+  EXPECT_TRUE(samples.empty());
+  EXPECT_EQ(it.stats().files_opened, 0u);
+  EXPECT_EQ(it.stats().files_missing, 1u);
+
+  // Without the manifest file, it is rebuilt by a scan.
+  roo_io::Mount mount = fs.mount();
+  ASSERT_EQ(mount.remove("/monitoring/test/manifest"), roo_io::kOk);
+  Collection rebuilt(fs, "test", kResolution_1_ms);
+  ASSERT_EQ(rebuilt.enableManifest(), roo_io::kOk);
+  EXPECT_TRUE(rebuilt.manifest()->hasVaultFile(hidden));
+  EXPECT_TRUE(rebuilt.manifest()->hasVaultFile(ref.parent()));
+  EXPECT_EQ(rebuilt.manifest()->logFiles(),
+            collection.manifest()->logFiles());
+  VaultIterator rescanned(&rebuilt, hidden.timestamp(), kResolution_1_ms);
+  rescanned.next(&samples);
+  ASSERT_EQ(samples.size(), 1u);
+}
+
+#if ROO_MONITORING_HAS_THREADS
+
+TEST(CompactionServiceTest, FlushesRegisteredWriters) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  std::vector<std::unique_ptr<Collection>> collections;
+  std::vector<std::unique_ptr<Writer>> writers;
+  std::vector<std::unique_ptr<IngestQueue>> queues;
+  CompactionService service(CompactionService::Options()
+                                .set_thread_count(2)
+                                .set_slice_ms(1)
+                                .set_idle_poll_ms(5));
+  for (const char* name : {"a", "b", "c"}) {
+    collections.emplace_back(new Collection(fs, name, kResolution_1_ms));
+    writers.emplace_back(new Writer(collections.back().get()));
+    queues.emplace_back(new IngestQueue(256));
+    service.add(writers.back().get(), queues.back().get());
+  }
+  service.start();
+  {
+    // Direct writes need the lock. (Mixing them with queued writes is only
+    // safe if timestamps do not go back.)
+    CompactionService::Lock lock(service, writers[0].get());
+    WriteTransaction tx(writers[0].get());
+    tx.write(0, 2, 1.0f);
+  }
+  for (int t = 0; t < 40; ++t) {
+    for (int i = 0; i < 3; ++i) {
+      queues[i]->push(t, 1, static_cast<float>(t));
+    }
+  }
+  service.notify();
+
+  // Once the queues are drained, a Lock waits for the slice that drained them
+  // to finish, so the backlog reported afterwards is up to date.
+  bool done = false;
+  for (int attempt = 0; attempt < 500 && !done; ++attempt) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    done = true;
+    for (int i = 0; i < 3; ++i) {
+      if (queues[i]->size() > 0) {
+        done = false;
+        continue;
+      }
+      { CompactionService::Lock lock(service, writers[i].get()); }
+      if (!service.backlog(writers[i].get()).empty()) done = false;
+    }
+  }
+  service.stop();
+  ASSERT_TRUE(done);
+
+  // The historical ranges (up to the hot log file, starting at 32) have been
+  // flushed and compacted.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(writers[i]->io_state(), Writer::IOSTATE_OK);
+    VaultIterator it(collections[i].get(), 0, kResolution_4_ms);
+    std::vector<Sample> samples;
+    for (int step = 0; step < 8; ++step) {
+      it.next(&samples);
+      ASSERT_EQ(samples.size(), (i == 0 && step == 0) ? 2u : 1u)
+          << i << ", " << step;
+      EXPECT_EQ(samples[0].fill(), 0x2000);
+    }
+    service.remove(writers[i].get());
+  }
+}
+
+#endif  // ROO_MONITORING_HAS_THREADS
+
+TEST(AggregatorTest, MergesRaggedStreamSets) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  Aggregator aggregator;
+  for (int round = 0; round < 2; ++round) {
+    aggregator.clear();
+    aggregator.add(Sample(5, 100, 100, 100, 0x2000));
+    aggregator.add(Sample(9, 10, 10, 10, 0x2000));
+    // New run; inserts before and between existing streams.
+    aggregator.add(Sample(1, 7, 7, 7, 0x2000));
+    aggregator.add(Sample(5, 200, 150, 250, 0x2000));
+    aggregator.add(Sample(7, 3, 3, 3, 0x1000));
+    // Unsorted run.
+    aggregator.add(Sample(9, 30, 30, 30, 0x2000));
+    aggregator.add(Sample(1, 9, 9, 9, 0x2000));
+  }
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_4_ms);
+  VaultWriter writer(&collection, ref);
+  ASSERT_EQ(writer.openNew(), roo_io::kOk);
+  writer.writeAggregatedData(aggregator);
+  writer.close();
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  std::vector<Sample> samples;
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), 4u);
+  EXPECT_EQ(samples[0].stream_id(), 1u);
+  EXPECT_EQ(samples[0].avg_value(), 8);
+  EXPECT_EQ(samples[1].stream_id(), 5u);
+  EXPECT_EQ(samples[1].avg_value(), 150);
+  EXPECT_EQ(samples[1].min_value(), 100);
+  EXPECT_EQ(samples[1].max_value(), 250);
+  EXPECT_EQ(samples[2].stream_id(), 7u);
+  EXPECT_EQ(samples[2].avg_value(), 3);
+  EXPECT_EQ(samples[3].stream_id(), 9u);
+  EXPECT_EQ(samples[3].avg_value(), 20);
+}
+
+TEST(AggregatorTest, GroupMatchesAdd) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // Enough streams for the vectorized kernel, plus a remainder; some samples
+  // have zero fill, and stream 3 has zero fill in all entries.
+  std::vector<Sample> aligned[4];
+  for (int c = 0; c < 4; ++c) {
+    for (int s = 0; s < 21; ++s) {
+      uint16_t fill = (s == 3 || (s + c) % 5 == 0) ? 0 : 0x2000 - s * 100;
+      aligned[c].emplace_back(s * 1000, 65535 - s * c * 300, 1000 * c + s,
+                              60000 + c * s, fill);
+    }
+  }
+  std::vector<Sample> ragged[4] = {aligned[0], aligned[1], aligned[2],
+                                   aligned[3]};
+  ragged[2].erase(ragged[2].begin() + 7);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_4_ms);
+  VaultWriter writer(&collection, ref);
+  ASSERT_EQ(writer.openNew(), roo_io::kOk);
+  for (const auto* entries : {&aligned, &ragged}) {
+    Aggregator group;
+    group.addGroup(*entries);
+    writer.writeAggregatedData(group);
+    Aggregator single;
+    for (const std::vector<Sample>& entry : *entries) {
+      for (const Sample& sample : entry) {
+        if (sample.fill() > 0) single.add(sample);
+      }
+    }
+    writer.writeAggregatedData(single);
+  }
+  writer.close();
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  std::vector<Sample> expected;
+  std::vector<Sample> actual;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(reader.next(&actual));
+    ASSERT_TRUE(reader.next(&expected));
+    EXPECT_EQ(actual.size(), 20u);
+    ASSERT_EQ(actual.size(), expected.size());
+    for (size_t j = 0; j < actual.size(); ++j) {
+      EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id()) << i << j;
+      EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value()) << i << j;
+      EXPECT_EQ(actual[j].min_value(), expected[j].min_value()) << i << j;
+      EXPECT_EQ(actual[j].max_value(), expected[j].max_value()) << i << j;
+      EXPECT_EQ(actual[j].fill(), expected[j].fill()) << i << j;
+    }
+  }
+}
+
+TEST(QueryPlannerTest, PicksCoarsestLevelWithinBudget) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  QueryPlanner planner(&collection);
+
+  EXPECT_EQ(planner.pickResolution(0, 16, 16), kResolution_1_ms);
+  EXPECT_EQ(planner.pickResolution(0, 17, 16), kResolution_4_ms);
+  EXPECT_EQ(planner.pickResolution(0, 64, 4), kResolution_16_ms);
+}
+
+TEST(QueryPlannerTest, ServesHotTailFromFinerLevel) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+
+  {
+    WriteTransaction tx(&writer);
+    for (int i = 0; i < 43; ++i) {
+      tx.write(i, 1, static_cast<float>(i));
+    }
+  }
+  // The first pass flushes historical log files; the second one flushes the
+  // hot one.
+  writer.flushAll();
+  writer.flushAll();
+
+  // The base level contains entries up to 42 (exclusive), since the last one
+  // is still hot in the log. The 4 ms level has been compacted up to 40.
+  QueryPlanner planner(&collection);
+  std::vector<QuerySegment> plan = planner.plan(0, 44, 14);
+  ASSERT_EQ(plan.size(), 3u);
+  EXPECT_EQ(plan[0].start(), 0);
+  EXPECT_EQ(plan[0].end(), 40);
+  EXPECT_EQ(plan[0].resolution(), kResolution_4_ms);
+  EXPECT_EQ(plan[1].start(), 40);
+  EXPECT_EQ(plan[1].end(), 42);
+  EXPECT_EQ(plan[1].resolution(), kResolution_1_ms);
+  EXPECT_EQ(plan[2].start(), 42);
+  EXPECT_EQ(plan[2].end(), 44);
+  EXPECT_EQ(plan[2].resolution(), kResolution_1_ms);
+
+  // With a tighter budget, the tail stays at the coarse level.
+  plan = planner.plan(0, 44, 13);
+  ASSERT_EQ(plan.size(), 2u);
+  EXPECT_EQ(plan[0].end(), 40);
+  EXPECT_EQ(plan[1].start(), 40);
+  EXPECT_EQ(plan[1].end(), 44);
+  EXPECT_EQ(plan[1].resolution(), kResolution_4_ms);
+}
+
+TEST(QueryPlannerTest, MissingFileIsNotCovered) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+  {
+    WriteTransaction tx(&writer);
+    for (int i = 0; i < 43; ++i) {
+      tx.write(i, 1, static_cast<float>(i));
+    }
+  }
+  writer.flushAll();
+  writer.flushAll();
+
+  // The file covering the end of the query does not exist; the base level is
+  // covered only up to where the previous file ends.
+  QueryPlanner planner(&collection);
+  std::vector<QuerySegment> plan = planner.plan(0, 52, 52);
+  ASSERT_EQ(plan.size(), 2u);
+  EXPECT_EQ(plan[0].end(), 42);
+  EXPECT_EQ(plan[1].start(), 42);
+  EXPECT_EQ(plan[1].end(), 52);
+
+  // With the previous file missing too, nothing is known to be covered.
+  FilePath path;
+  collection.getVaultFilePath(VaultFileRef::Lookup(32, kResolution_1_ms),
+                              &path);
+  roo_io::Mount mount = fs.mount();
+  ASSERT_EQ(mount.remove(path.c_str()), roo_io::kOk);
+  plan = planner.plan(0, 52, 52);
+  ASSERT_EQ(plan.size(), 1u);
+  EXPECT_EQ(plan[0].start(), 0);
+  EXPECT_EQ(plan[0].end(), 52);
+}
+
 }  // namespace
 }  // namespace roo_monitoring
@@ -1,9 +1,23 @@
+#include <ftw.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "fakefs_reference.h"
 #include "gtest/gtest.h"
 #include "roo_monitoring.h"
+#include "roo_io/data/output_stream_writer.h"
+#include "roo_io/fs/fsutil.h"
+#include "roo_io/fs/posix/posix_filesystem.h"
 #include "roo_monitoring/compaction.h"
+#include "roo_monitoring/sample_decoder.h"
+#include "roo_monitoring/vault_cache.h"
 
 namespace roo_monitoring {
 namespace {
@@ -18,6 +32,35 @@ TEST(TransformTest, LinearRangeRoundTrip) {
   EXPECT_NEAR(transform.unapply(65535), 100.0f, 1e-2f);
 }
 
+TEST(TransformTest, ApplyBatchMatchesApply) {
+  Transform transform = Transform::LinearRange(-10.0f, 50.0f);
+  std::vector<float> values;
+  for (float v = -20.0f; v <= 60.0f; v += 0.037f) {
+    values.push_back(v);
+  }
+  std::vector<uint16_t> out(values.size());
+  transform.applyBatch(values.data(), out.data(), values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    EXPECT_EQ(out[i], transform.apply(values[i])) << values[i];
+  }
+}
+
+TEST(TransformTest, ApplyBatchRoundsTiesLikeApply) {
+  Transform transform = Transform::Linear(1.0f, 0.0f);
+  std::vector<float> values;
+  for (float v : {0.5f, 1.5f, 2.5f, 1000.5f, 65533.5f, 65534.5f}) {
+    values.push_back(nextafterf(v, 0.0f));
+    values.push_back(v);
+    values.push_back(nextafterf(v, 65536.0f));
+  }
+  std::vector<uint16_t> out(values.size());
+  transform.applyBatch(values.data(), out.data(), values.size());
+  EXPECT_EQ(out[0], 0u);  // 0.49999997
+  for (size_t i = 0; i < values.size(); ++i) {
+    EXPECT_EQ(out[i], transform.apply(values[i])) << values[i];
+  }
+}
+
 TEST(ResolutionTest, FloorCeilIncrement) {
   int64_t timestamp = 123;
   EXPECT_EQ(timestamp_ms_floor(timestamp, kResolution_4_ms), 120);
@@ -25,6 +68,52 @@ TEST(ResolutionTest, FloorCeilIncrement) {
   EXPECT_EQ(timestamp_increment(1, kResolution_4_ms), 4);
 }
 
+TEST(FilePathTest, VaultAndLogPaths) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  FilePath path;
+  collection.getVaultFilePath(
+      VaultFileRef::Lookup(0x12345, kResolution_16_ms), &path);
+  EXPECT_STREQ(path.c_str(),
+               "/monitoring/test/vault-02/000000010000/000000012300");
+  EXPECT_STREQ(filepath(kLogDir, 0xABC).c_str(), "/log/000000000ABC");
+  path.append(".cursor");
+  EXPECT_EQ(path.size(), strlen(path.c_str()));
+
+  String string_path;
+  collection.getVaultFilePath(
+      VaultFileRef::Lookup(0x12345, kResolution_16_ms), &string_path);
+  EXPECT_STREQ(string_path.c_str(),
+               "/monitoring/test/vault-02/000000010000/000000012300");
+}
+
+TEST(FilePathTest, TruncatesLongCollectionNames) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  std::string prefix(100, 'x');
+  Collection a(fs, (prefix + "a").c_str(), kResolution_1_ms);
+  Collection b(fs, (prefix + "b").c_str(), kResolution_1_ms);
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  FilePath a_path;
+  FilePath b_path;
+  a.getVaultFilePath(ref, &a_path);
+  b.getVaultFilePath(ref, &b_path);
+  EXPECT_STRNE(a_path.c_str(), b_path.c_str());
+  a_path.append(".cursor");
+  EXPECT_EQ(a_path.size(), strlen(a_path.c_str()));
+
+  // The collection is usable.
+  {
+    Writer writer(&a);
+    WriteTransaction tx(&writer);
+    tx.write(0, 1, 0.5f);
+  }
+  Writer writer(&a);
+  writer.flushAll();
+  EXPECT_EQ(writer.io_state(), Writer::IOSTATE_OK);
+}
+
 TEST(LogIoTest, WriteAndReadBack) {
   roo_io::fakefs::FakeFs fake_fs;
   roo_io::fakefs::FakeReferenceFs fs(fake_fs);
@@ -38,7 +127,7 @@ TEST(LogIoTest, WriteAndReadBack) {
 
   roo_io::Mount mount = fs.mount();
   LogFileReader reader(mount);
-  String path = filepath(String(kLogDir), 1000);
+  FilePath path = filepath(kLogDir, 1000);
   ASSERT_TRUE(reader.open(path.c_str(), 0));
 
   int64_t timestamp = 0;
@@ -59,6 +148,495 @@ TEST(LogIoTest, WriteAndReadBack) {
   EXPECT_EQ(samples[0].value(), 30u);
 }
 
+TEST(LogIoTest, WriteBatchMatchesWrites) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection single(fs, "single", kResolution_1_ms);
+  Collection batch(fs, "batch", kResolution_1_ms);
+  Writer single_writer(&single);
+  Writer batch_writer(&batch);
+
+  std::vector<uint64_t> stream_ids;
+  std::vector<float> values;
+  for (int i = 0; i < 100; ++i) {
+    stream_ids.push_back(1000 - i * 7);
+    values.push_back(i * 0.5f);
+  }
+  // Duplicate within the batch; the first value wins.
+  stream_ids.push_back(1000);
+  values.push_back(-1.0f);
+  for (int64_t t : {10, 11, 11}) {
+    {
+      WriteTransaction tx(&single_writer);
+      for (size_t i = 0; i < stream_ids.size(); ++i) {
+        tx.write(t, stream_ids[i], values[i]);
+      }
+    }
+    {
+      WriteTransaction tx(&batch_writer);
+      tx.writeBatch(t, stream_ids.data(), values.data(), stream_ids.size());
+    }
+  }
+
+  roo_io::Mount mount = fs.mount();
+  LogFileReader single_reader(mount);
+  LogFileReader batch_reader(mount);
+  ASSERT_TRUE(single_reader.open("/monitoring/single/log/00000000000A", 0));
+  ASSERT_TRUE(batch_reader.open("/monitoring/batch/log/00000000000A", 0));
+  int64_t single_timestamp, batch_timestamp;
+  std::vector<LogSample> single_samples, batch_samples;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(single_reader.next(&single_timestamp, &single_samples, false));
+    ASSERT_TRUE(batch_reader.next(&batch_timestamp, &batch_samples, false));
+    EXPECT_EQ(single_timestamp, batch_timestamp);
+    ASSERT_EQ(single_samples.size(), 100u);
+    ASSERT_EQ(batch_samples.size(), 100u);
+    for (size_t j = 0; j < single_samples.size(); ++j) {
+      EXPECT_EQ(single_samples[j].stream_id(), batch_samples[j].stream_id());
+      EXPECT_EQ(single_samples[j].value(), batch_samples[j].value());
+    }
+  }
+  EXPECT_FALSE(batch_reader.next(&batch_timestamp, &batch_samples, false));
+}
+
+TEST(LogIoTest, BufferedUntilCommit) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  CachedLogDir cache(fs, kLogDir);
+  LogWriter writer(fs, kLogDir, cache, kResolution_1_ms,
+                   LogCommitPolicy::BufferedBytes(12));
+
+  FilePath path = filepath(kLogDir, 1000);
+  roo_io::Mount mount = fs.mount();
+  writer.write(1000, 1, 10);
+  writer.maybeCommit();
+  EXPECT_GT(writer.buffered_bytes(), 0u);
+  EXPECT_EQ(mount.stat(path.c_str()).status(), roo_io::kNotFound);
+
+  writer.write(1001, 1, 20);
+  writer.write(1002, 1, 30);
+  writer.maybeCommit();
+  EXPECT_EQ(writer.buffered_bytes(), 0u);
+  EXPECT_EQ(mount.stat(path.c_str()).status(), roo_io::kOk);
+
+  writer.write(1003, 1, 40);
+  ASSERT_TRUE(writer.commit());
+
+  LogFileReader reader(mount);
+  ASSERT_TRUE(reader.open(path.c_str(), 0));
+  int64_t timestamp = 0;
+  std::vector<LogSample> samples;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(reader.next(&timestamp, &samples, false));
+    EXPECT_EQ(timestamp, 1000 + i);
+    ASSERT_EQ(samples.size(), 1u);
+    EXPECT_EQ(samples[0].value(), 10u * (i + 1));
+  }
+}
+
+TEST(LogIoTest, FailedCreateIsNotCached) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  CachedLogDir cache(fs, kLogDir);
+  LogWriter writer(fs, kLogDir, cache, kResolution_1_ms);
+  EXPECT_TRUE(cache.entries().empty());
+
+  // A directory in the way of the log file. At the end of the range, so that
+  // the file can't take the next name instead.
+  int64_t last =
+      timestamp_ms_ceil(1000, Resolution(kResolution_1_ms + kRangeLength));
+  FilePath path = filepath(kLogDir, last);
+  roo_io::Mount mount = fs.mount();
+  ASSERT_EQ(roo_io::MkParentDirRecursively(mount, path.c_str()), roo_io::kOk);
+  ASSERT_EQ(mount.mkdir(path.c_str()), roo_io::kOk);
+  writer.write(last, 1, 10);
+  EXPECT_FALSE(writer.commit());
+  EXPECT_TRUE(cache.entries().empty());
+
+  ASSERT_EQ(mount.remove(path.c_str()), roo_io::kOk);
+  writer.write(last, 1, 20);
+  ASSERT_TRUE(writer.commit());
+  EXPECT_EQ(cache.entries(), std::vector<int64_t>({last}));
+}
+
+TEST(LogIoTest, RestartInSameBucket) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  {
+    CachedLogDir cache(fs, kLogDir);
+    LogWriter writer(fs, kLogDir, cache, kResolution_1_ms);
+    writer.write(1000, 1, 10);
+    ASSERT_TRUE(writer.commit());
+  }
+  // After the restart, the log file of the bucket exists already.
+  CachedLogDir cache(fs, kLogDir);
+  LogWriter writer(fs, kLogDir, cache, kResolution_1_ms);
+  for (int i = 0; i < 3; ++i) {
+    writer.write(1000 + i, 1, 20 + i);
+    EXPECT_TRUE(writer.commit());
+  }
+  EXPECT_EQ(writer.first_timestamp(), 1000);
+  EXPECT_EQ(writer.file(), 1001);
+  EXPECT_EQ(cache.entries(), std::vector<int64_t>({1000, 1001}));
+
+  roo_io::Mount mount = fs.mount();
+  LogReader reader(mount, kLogDir, cache, kResolution_1_ms, 1001);
+  ASSERT_TRUE(reader.nextRange());
+  int64_t timestamp;
+  std::vector<LogSample> samples;
+  ASSERT_TRUE(reader.nextSample(&timestamp, &samples));
+  EXPECT_EQ(timestamp, 1000);
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].value(), 10u);
+  // The last bucket of the hot file may be incomplete.
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(reader.nextSample(&timestamp, &samples));
+    EXPECT_EQ(timestamp, 1000 + i);
+    ASSERT_EQ(samples.size(), 1u);
+    EXPECT_EQ(samples[0].value(), 20u + i);
+  }
+  EXPECT_FALSE(reader.nextSample(&timestamp, &samples));
+}
+
+TEST(LogIoTest, StreamDictionaryAndCheckpoints) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  CachedLogDir cache(fs, kLogDir);
+  LogWriter writer(fs, kLogDir, cache, kResolution_4_ms,
+                   LogCommitPolicy::Manual());
+
+  // Hashed stream IDs, taking 9 or 10 bytes as varints. Two files; the
+  // second one has the streams of the first one in its dictionary. It also
+  // has a sample of one more stream, which is not.
+  auto stream_id = [](int j) { return 0x9E3779B97F4A7C15ULL * (j + 1); };
+  int64_t step = timestamp_increment(1, kResolution_4_ms);
+  int64_t second = timestamp_increment(kRangeElementCount, kResolution_4_ms);
+  uint64_t bytes_committed[2];
+  for (int64_t file : {int64_t{0}, second}) {
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      for (int j = 0; j < (file != 0 && i == 5 ? 6 : 5); ++j) {
+        writer.write(file + i * step, stream_id(j), i * 10 + j);
+      }
+    }
+    EXPECT_EQ(writer.dictionary().size(), file == 0 ? 0u : 5u);
+    ASSERT_TRUE(writer.commit());
+    bytes_committed[file == 0 ? 0 : 1] = writer.bytes_committed();
+  }
+  writer.close();
+  // 3 bytes per sample instead of 13, plus the dictionary.
+  EXPECT_LT((bytes_committed[1] - bytes_committed[0]) * 5,
+            bytes_committed[0] * 2);
+
+  roo_io::Mount mount = fs.mount();
+  LogFileReader reader(mount);
+  ASSERT_TRUE(reader.open(filepath(kLogDir, second).c_str(), 0));
+  EXPECT_EQ(reader.version(), 2);
+  EXPECT_EQ(reader.dictionary().size(), 5u);
+  int64_t timestamp;
+  std::vector<LogSample> samples;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(reader.next(&timestamp, &samples, true));
+  }
+  // Resumes from the checkpoint, which needs the header.
+  int64_t checkpoint = reader.checkpoint();
+  ASSERT_TRUE(reader.open(filepath(kLogDir, second).c_str(), checkpoint));
+  for (int i = 3; i < kRangeElementCount - 1; ++i) {
+    ASSERT_TRUE(reader.next(&timestamp, &samples, true));
+    EXPECT_EQ(timestamp, second + i * step);
+    ASSERT_EQ(samples.size(), i == 5 ? 6u : 5u);
+    for (size_t j = 0; j < samples.size(); ++j) {
+      auto sample = std::find_if(samples.begin(), samples.end(),
+                                 [&](const LogSample& sample) {
+                                   return sample.stream_id() == stream_id(j);
+                                 });
+      ASSERT_NE(sample, samples.end());
+      EXPECT_EQ(sample->value(), i * 10 + j);
+    }
+  }
+  // The last bucket of a hot file may be incomplete.
+  EXPECT_FALSE(reader.next(&timestamp, &samples, true));
+}
+
+TEST(LogIoTest, CompactsVersion1Files) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // A log file written before the upgrade to version 2.
+  const char* log_dir = "/monitoring/test/log";
+  roo_io::Mount mount = fs.mount();
+  FilePath path = filepath(log_dir, 0);
+  roo_io::MkParentDirRecursively(mount, path.c_str());
+  {
+    auto out = roo_io::OpenDataFileForWrite(mount, path.c_str(),
+                                            roo_io::kFailIfExists);
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      out.writeU8(1);
+      out.writeVarU64(i);
+      out.writeU8(2);
+      out.writeVarU64(7);
+      out.writeBeU16(1000 + i);
+    }
+    out.close();
+  }
+
+  LogFileReader reader(mount);
+  ASSERT_TRUE(reader.open(path.c_str(), 0));
+  EXPECT_EQ(reader.version(), 1);
+  int64_t timestamp;
+  std::vector<LogSample> samples;
+  ASSERT_TRUE(reader.next(&timestamp, &samples, false));
+  ASSERT_TRUE(reader.next(&timestamp, &samples, false));
+  ASSERT_TRUE(reader.open(path.c_str(), reader.checkpoint()));
+  ASSERT_TRUE(reader.next(&timestamp, &samples, false));
+  EXPECT_EQ(timestamp, 2);
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].value(), 1002);
+  reader.close();
+
+  // Followed by a version 2 file, in the next range.
+  Writer writer(&collection);
+  {
+    WriteTransaction tx(&writer);
+    tx.write(kRangeElementCount, 7, 0.0f);
+  }
+  // The first pass flushes the historical log file; the second one the hot
+  // one.
+  writer.flushAll();
+  writer.flushAll();
+  EXPECT_EQ(writer.io_state(), Writer::IOSTATE_OK);
+  VaultIterator it(&collection, 0, kResolution_1_ms);
+  std::vector<Sample> vault_samples;
+  for (int i = 0; i < kRangeElementCount; ++i) {
+    it.next(&vault_samples);
+    ASSERT_EQ(vault_samples.size(), 1u) << i;
+    EXPECT_EQ(vault_samples[0].stream_id(), 7u);
+    EXPECT_EQ(vault_samples[0].avg_value(), 1000 + i);
+  }
+}
+
+TEST(CachedLogDirTest, StaysSortedWithoutRescanning) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  roo_io::Mount mount = fs.mount();
+  for (int64_t file : {300, 100}) {
+    FilePath path = filepath(kLogDir, file);
+    roo_io::MkParentDirRecursively(mount, path.c_str());
+    roo_io::OpenDataFileForWrite(mount, path.c_str(), roo_io::kFailIfExists)
+        .writeU8(0);
+  }
+  CachedLogDir cache(fs, kLogDir);
+  EXPECT_EQ(cache.entries(), (std::vector<int64_t>{100, 300}));
+
+  // Files created behind the cache's back are not picked up; the directory
+  // is only scanned once.
+  FilePath path = filepath(kLogDir, 50);
+  roo_io::OpenDataFileForWrite(mount, path.c_str(), roo_io::kFailIfExists)
+      .writeU8(0);
+  cache.insert(400);
+  cache.insert(200);
+  cache.insert(200);
+  EXPECT_EQ(cache.entries(), (std::vector<int64_t>{100, 200, 300, 400}));
+  EXPECT_TRUE(cache.contains(300));
+  EXPECT_FALSE(cache.contains(50));
+
+  cache.erase(300);
+  auto next = cache.erase(cache.entries().begin(), cache.entries().begin() + 2);
+  EXPECT_EQ(*next, 400);
+  EXPECT_EQ(cache.size(), 1u);
+}
+
+TEST(IngestQueueTest, DropPolicies) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+
+  IngestQueue newest(4, IngestQueue::kDropNewest);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(newest.push(i, i, 1.0f), i < 4);
+  }
+  EXPECT_EQ(newest.pushed(), 4u);
+  EXPECT_EQ(newest.dropped(), 2u);
+  EXPECT_EQ(newest.drain(&writer), 4u);
+  EXPECT_EQ(newest.size(), 0u);
+
+  IngestQueue oldest(4, IngestQueue::kDropOldest);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_TRUE(oldest.push(10 + i, i, 1.0f));
+  }
+  EXPECT_EQ(oldest.pushed(), 6u);
+  EXPECT_EQ(oldest.dropped(), 2u);
+  EXPECT_EQ(oldest.drain(&writer, 1), 1u);
+  EXPECT_EQ(oldest.drain(&writer), 3u);
+}
+
+TEST(IngestQueueTest, ConcurrentProducers) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection, LogCommitPolicy::Manual());
+
+  const int kThreads = 4;
+  const int kSamplesPerThread = 2000;
+  IngestQueue queue(256, IngestQueue::kDropNewest);
+  std::atomic<int> running(kThreads);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < kThreads; ++t) {
+    producers.emplace_back([&queue, &running, t]() {
+      for (int i = 0; i < kSamplesPerThread; ++i) {
+        while (!queue.push(i, t, 1.0f)) {
+          std::this_thread::yield();
+        }
+      }
+      --running;
+    });
+  }
+  size_t drained = 0;
+  while (running > 0 || queue.size() > 0) {
+    drained += queue.drain(&writer);
+  }
+  for (auto& t : producers) t.join();
+  drained += queue.drain(&writer);
+  EXPECT_EQ(drained, (size_t)(kThreads * kSamplesPerThread));
+  EXPECT_EQ(queue.pushed(), (uint64_t)(kThreads * kSamplesPerThread));
+}
+
+TEST(StatsTest, LatencyHistogramPercentiles) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.percentile(50), 0u);
+  for (uint32_t i = 1; i <= 100; ++i) histogram.record(i);
+  histogram.record(0);
+  EXPECT_EQ(histogram.count(), 101u);
+  EXPECT_EQ(histogram.total_us(), 5050u);
+  EXPECT_EQ(histogram.max_us(), 100u);
+  EXPECT_EQ(histogram.bucket(0), 1u);
+  EXPECT_EQ(histogram.bucket(1), 1u);
+  EXPECT_EQ(histogram.bucket(7), 37u);  // [64, 128)
+  EXPECT_EQ(histogram.percentile(50), 64u);
+  EXPECT_EQ(histogram.percentile(99), 100u);
+  histogram.record(0xFFFFFFFF);
+  EXPECT_EQ(histogram.bucket(LatencyHistogram::kBucketCount - 1), 1u);
+}
+
+TEST(StatsTest, WriterAndIteratorCounters) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+  {
+    WriteTransaction tx(&writer);
+    for (int i = 0; i < 20; ++i) {
+      tx.write(i, 1, 1.0f);
+      tx.write(i, 1, 2.0f);
+    }
+    uint64_t ids[] = {2, 3, 2};
+    float values[] = {1.0f, 2.0f, 3.0f};
+    tx.writeBatch(20, ids, values, 3);
+  }
+  // The first pass flushes the historical log file; the second one the hot
+  // one.
+  writer.flushAll();
+  writer.flushAll();
+
+  WriterStats stats = writer.stats();
+  EXPECT_EQ(stats.samples_written, 22u);
+  EXPECT_EQ(stats.samples_deduplicated, 21u);
+  EXPECT_GT(stats.log_bytes_written, 0u);
+  EXPECT_GT(stats.vault_bytes_written[kResolution_1_ms], 0u);
+  EXPECT_GT(stats.vault_bytes_written[kResolution_4_ms], 0u);
+  EXPECT_EQ(stats.vault_bytes_written[kMaxResolution], 0u);
+  // The log file of the first (historical) range.
+  EXPECT_GE(stats.files_removed, 1u);
+  EXPECT_GE(stats.cursors_embedded, 1u);
+  EXPECT_EQ(stats.cursor_files_written, 0u);
+  EXPECT_GE(stats.flush_latency.count(), 2u);
+  EXPECT_EQ(stats.write_to_vault_latency.count(), 2u);
+  EXPECT_GE(stats.compaction_latency.count(), 1u);
+
+  VaultIterator it(&collection, 0, kResolution_1_ms);
+  std::vector<Sample> samples;
+  for (int i = 0; i < kRangeElementCount + 1; ++i) it.next(&samples);
+  EXPECT_EQ(it.stats().files_opened, 2u);
+  EXPECT_EQ(it.stats().entries_read, kRangeElementCount + 1u);
+  EXPECT_GT(it.stats().bytes_read, 0u);
+}
+
+TEST(StatsTest, DropsOutOfOrderSamples) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+  {
+    WriteTransaction tx(&writer);
+    for (int i = 0; i < 20; ++i) {
+      tx.write(i, 1, 1.0f);
+    }
+    // The clock goes back.
+    tx.write(5, 1, 2.0f);
+    uint64_t ids[] = {2, 3};
+    float values[] = {2.0f, 3.0f};
+    tx.writeBatch(6, ids, values, 2);
+    // The last bucket stays hot.
+    tx.write(20, 1, 1.0f);
+    tx.write(21, 1, 1.0f);
+  }
+  writer.flushAll();
+  writer.flushAll();
+
+  WriterStats stats = writer.stats();
+  EXPECT_EQ(stats.samples_written, 22u);
+  EXPECT_EQ(stats.samples_dropped, 3u);
+  EXPECT_EQ(writer.io_state(), Writer::IOSTATE_OK);
+  // No log file has been started at the earlier timestamp.
+  roo_io::Mount mount = fs.mount();
+  FilePath log_dir = FilePath("/monitoring/test/").append(kLogSubPath);
+  EXPECT_EQ(listFiles(mount, log_dir.c_str()).size(), 1u);
+
+  VaultIterator it(&collection, 0, kResolution_1_ms);
+  std::vector<Sample> samples;
+  for (int i = 0; i <= 20; ++i) {
+    it.next(&samples);
+    ASSERT_EQ(samples.size(), 1u) << i;
+    EXPECT_EQ(samples[0].stream_id(), 1u);
+  }
+}
+
+TEST(StatsTest, AcceptsClockCorrection) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  Writer writer(&collection);
+  {
+    WriteTransaction tx(&writer);
+    for (int i = 0; i < 10; ++i) {
+      tx.write(i, 1, 1.0f);
+    }
+    // The clock jumps forward, and gets corrected.
+    tx.write(1000, 1, 2.0f);
+    for (int i = 10; i < 40; ++i) {
+      tx.write(i, 1, 1.0f);
+    }
+    // Reordered samples are still dropped.
+    tx.write(38, 1, 3.0f);
+  }
+  writer.flushAll();
+  writer.flushAll();
+
+  WriterStats stats = writer.stats();
+  EXPECT_EQ(stats.samples_written, 41u);
+  EXPECT_EQ(stats.samples_dropped, 1u);
+  EXPECT_EQ(writer.io_state(), Writer::IOSTATE_OK);
+
+  VaultIterator it(&collection, 0, kResolution_1_ms);
+  std::vector<Sample> samples;
+  for (int i = 0; i < 39; ++i) {
+    it.next(&samples);
+    ASSERT_EQ(samples.size(), 1u) << i;
+    EXPECT_EQ(samples[0].stream_id(), 1u);
+  }
+}
+
 TEST(VaultReaderTest, SeekForwardPositionsAtExpectedEntry) {
   roo_io::fakefs::FakeFs fake_fs;
   roo_io::fakefs::FakeReferenceFs fs(fake_fs);
@@ -85,5 +663,963 @@ TEST(VaultReaderTest, SeekForwardPositionsAtExpectedEntry) {
   EXPECT_EQ(samples[0].avg_value(), 2u);
 }
 
+TEST(VaultReaderTest, FinishedFileHasIndex) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  VaultWriter writer(&collection, ref);
+  ASSERT_EQ(writer.openNew(), roo_io::kOk);
+  for (uint16_t i = 0; i < kRangeElementCount; ++i) {
+    std::vector<LogSample> data;
+    for (uint16_t j = 0; j <= i; ++j) {
+      data.emplace_back(j, i);
+    }
+    writer.writeLogData(data);
+  }
+  writer.close();
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, kRangeElementCount - 3, 0));
+  EXPECT_TRUE(reader.has_index());
+
+  std::vector<Sample> samples;
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), kRangeElementCount - 2u);
+  EXPECT_EQ(samples[0].avg_value(), kRangeElementCount - 3u);
+  reader.seekForward(kRangeElementCount - 1);
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), (size_t)kRangeElementCount);
+  EXPECT_TRUE(reader.past_eof());
+}
+
+TEST(VaultReaderTest, IndexRecoveredAfterAppend) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    for (uint16_t i = 0; i < 5; ++i) {
+      std::vector<LogSample> data;
+      data.emplace_back(1, i);
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(5), roo_io::kOk);
+    for (uint16_t i = 5; i < kRangeElementCount; ++i) {
+      std::vector<LogSample> data;
+      data.emplace_back(1, i);
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  EXPECT_TRUE(reader.has_index());
+  reader.seekForward(7);
+  std::vector<Sample> samples;
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].avg_value(), 7u);
+}
+
+TEST(VaultReaderTest, ReadsLegacyFormat) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  FilePath path;
+  collection.getVaultFilePath(ref, &path);
+  roo_io::Mount mount = fs.mount();
+  roo_io::MkParentDirRecursively(mount, path.c_str());
+  {
+    auto out = roo_io::OpenDataFileForWrite(mount, path.c_str(),
+                                            roo_io::kFailIfExists);
+    out.writeU8(1);
+    out.writeU8(1);
+    for (uint16_t i = 0; i < kRangeElementCount; ++i) {
+      out.writeVarU64(1);
+      out.writeVarU64(1);
+      out.writeBeU16(i);
+      out.writeBeU16(i);
+      out.writeBeU16(i);
+      out.writeBeU16(0x2000);
+    }
+    out.close();
+  }
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  EXPECT_FALSE(reader.has_index());
+  reader.seekForward(9);
+  std::vector<Sample> samples;
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].avg_value(), 9u);
+}
+
+TEST(VaultReaderTest, RunsOfEmptyEntries) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // Data at entries 0, 7, and 12; the rest are empty. Written in two parts,
+  // so that the index has to be recovered.
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    writer.writeLogData({LogSample(1, 0)});
+    writer.writeEmptyData(6);
+    writer.writeLogData({LogSample(1, 7)});
+    writer.close();
+  }
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(8), roo_io::kOk);
+    writer.writeEmptyData(4);
+    writer.writeLogData({LogSample(1, 12)});
+    writer.writeLogData({});
+    writer.writeEmptyData(kRangeElementCount - 14);
+    writer.close();
+  }
+  auto expected = [](int index) {
+    return index == 0 || index == 7 || index == 12;
+  };
+
+  std::vector<Sample> samples;
+  for (int start = 0; start < kRangeElementCount; ++start) {
+    // Seeking via the index.
+    VaultFileReader reader(&collection);
+    ASSERT_TRUE(reader.open(ref, start, 0));
+    ASSERT_TRUE(reader.has_index());
+    for (int i = start; i < kRangeElementCount; ++i) {
+      ASSERT_TRUE(reader.next(&samples)) << start << ", " << i;
+      ASSERT_EQ(samples.size(), expected(i) ? 1u : 0u) << start << ", " << i;
+      if (expected(i)) {
+        EXPECT_EQ(samples[0].avg_value(), i);
+      }
+    }
+    EXPECT_TRUE(reader.past_eof());
+  }
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 1, 0));
+  EXPECT_EQ(reader.empty_run_remaining(), 6);
+  reader.seek(3);
+  EXPECT_EQ(reader.empty_run_remaining(), 4);
+  reader.seek(12);
+  EXPECT_EQ(reader.empty_run_remaining(), 0);
+  ASSERT_TRUE(reader.next(&samples));
+  EXPECT_EQ(samples.size(), 1u);
+  ASSERT_TRUE(reader.next(&samples));
+  EXPECT_EQ(reader.empty_run_remaining(), kRangeElementCount - 14);
+
+  // All the trailing empty entries are stored in a single record.
+  roo_io::Mount mount = fs.mount();
+  FilePath path;
+  collection.getVaultFilePath(ref, &path);
+  EXPECT_LT(mount.stat(path.c_str()).size(),
+            2u + 3 * 12 + 3 * 2 + kVaultIndexSize);
+}
+
+TEST(VaultReaderTest, SkipsEmbeddedCompactionCursors) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // Data at entries 0 and 9; a cursor after each of the two appends.
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    writer.writeLogData({LogSample(1, 0)});
+    writer.writeEmptyData(3);
+    writer.writeCompactionCursor(LogCursor(0x1234, 567));
+    writer.close();
+  }
+  VaultFileReader reader(&collection);
+  int write_index;
+  LogCursor source;
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  ASSERT_TRUE(reader.readCompactionCursor(&write_index, &source));
+  EXPECT_EQ(write_index, 4);
+  EXPECT_EQ(source.file(), 0x1234);
+  EXPECT_EQ(source.position(), 567);
+  reader.close();
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(4), roo_io::kOk);
+    writer.writeEmptyData(5);
+    writer.close();
+  }
+  // Appending invalidates the cursor.
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  EXPECT_FALSE(reader.readCompactionCursor(&write_index, &source));
+  reader.close();
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(9), roo_io::kOk);
+    writer.writeLogData({LogSample(1, 9)});
+    writer.writeCompactionCursor(LogCursor(0x1234, 890));
+    writer.close();
+  }
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(10), roo_io::kOk);
+    writer.writeEmptyData(kRangeElementCount - 10);
+    writer.close();
+  }
+
+  std::vector<Sample> samples;
+  for (int start = 0; start < kRangeElementCount; ++start) {
+    // Seeking via the index.
+    ASSERT_TRUE(reader.open(ref, start, 0));
+    ASSERT_TRUE(reader.has_index());
+    EXPECT_FALSE(reader.readCompactionCursor(&write_index, &source));
+    for (int i = start; i < kRangeElementCount; ++i) {
+      ASSERT_TRUE(reader.next(&samples)) << start << ", " << i;
+      ASSERT_EQ(samples.size(), (i == 0 || i == 9) ? 1u : 0u)
+          << start << ", " << i;
+    }
+    EXPECT_TRUE(reader.past_eof());
+  }
+}
+
+TEST(VaultReaderTest, FinishingDropsCompactionCursors) {
+  for (bool compressed : {false, true}) {
+    roo_io::fakefs::FakeFs fake_fs;
+    roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+    Collection appended(fs, "appended", kResolution_1_ms);
+    Collection reference(fs, "reference", kResolution_1_ms);
+    if (compressed) {
+      appended.enableVaultCompression();
+      reference.enableVaultCompression();
+    }
+    auto write = [](VaultWriter& writer, int index) {
+      if (index % 5 == 4) {
+        writer.writeEmptyData();
+      } else {
+        writer.writeLogData({LogSample(1, index), LogSample(2, 2 * index)});
+      }
+    };
+
+    // Appended three entries at a time, with a cursor after each append.
+    VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+    for (int i = 0; i < kRangeElementCount; i += 3) {
+      VaultWriter writer(&appended, ref);
+      ASSERT_EQ(i == 0 ? writer.openNew() : writer.openExisting(i),
+                roo_io::kOk);
+      for (int j = i; j < std::min(i + 3, kRangeElementCount); ++j) {
+        write(writer, j);
+      }
+      if (writer.write_index() < kRangeElementCount) {
+        writer.writeCompactionCursor(LogCursor(0x1234, i));
+      }
+      writer.close();
+      ASSERT_EQ(writer.status(), roo_io::kClosed);
+    }
+    {
+      VaultWriter writer(&reference, ref);
+      ASSERT_EQ(writer.openNew(), roo_io::kOk);
+      for (int j = 0; j < kRangeElementCount; ++j) write(writer, j);
+      writer.close();
+    }
+
+    roo_io::Mount mount = fs.mount();
+    FilePath appended_path;
+    FilePath reference_path;
+    appended.getVaultFilePath(ref, &appended_path);
+    reference.getVaultFilePath(ref, &reference_path);
+    EXPECT_EQ(mount.stat(appended_path.c_str()).size(),
+              mount.stat(reference_path.c_str()).size());
+    appended_path.append(".tmp");
+    EXPECT_EQ(mount.stat(appended_path.c_str()).status(), roo_io::kNotFound);
+
+    VaultFileReader expected(&reference);
+    VaultFileReader actual(&appended);
+    std::vector<Sample> expected_samples;
+    std::vector<Sample> actual_samples;
+    for (int start = 0; start < kRangeElementCount; ++start) {
+      ASSERT_TRUE(expected.open(ref, start, 0));
+      ASSERT_TRUE(actual.open(ref, start, 0));
+      ASSERT_TRUE(actual.has_index());
+      for (int i = start; i < kRangeElementCount; ++i) {
+        ASSERT_TRUE(expected.next(&expected_samples));
+        ASSERT_TRUE(actual.next(&actual_samples)) << start << ", " << i;
+        ASSERT_EQ(actual_samples.size(), expected_samples.size());
+        for (size_t j = 0; j < actual_samples.size(); ++j) {
+          EXPECT_EQ(actual_samples[j].stream_id(),
+                    expected_samples[j].stream_id());
+          EXPECT_EQ(actual_samples[j].avg_value(),
+                    expected_samples[j].avg_value());
+        }
+      }
+      expected.close();
+      actual.close();
+    }
+  }
+}
+
+#if ROO_MONITORING_HAS_MMAP
+
+int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return ::remove(path);
+}
+
+// Provides a temporary host directory, removed even if the test fails.
+class MappedReadsTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_NE(mkdtemp(root_), nullptr); }
+
+  void TearDown() override {
+    nftw(root_, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  void checkMappedReadsMatchStreamReads(bool compressed);
+
+  char root_[32] = "/tmp/roo_monitoring_test_XXXXXX";
+};
+
+void MappedReadsTest::checkMappedReadsMatchStreamReads(bool compressed) {
+  const char* root = root_;
+  roo_io::PosixFilesystem fs(root);
+  Collection streamed(fs, "test", kResolution_1_ms);
+  Collection mapped(fs, "test", kResolution_1_ms);
+  mapped.enableMappedReads(root);
+  if (compressed) streamed.enableVaultCompression();
+
+  // A finished file, with a run of empty entries and a compaction cursor, and
+  // a hot file. The finished file follows another one, to have a stream
+  // dictionary.
+  VaultFileRef seed = VaultFileRef::Lookup(0, kResolution_1_ms);
+  VaultFileRef finished = seed.next();
+  VaultFileRef hot = finished.next();
+  for (VaultFileRef ref : {seed, finished}) {
+    VaultWriter writer(&streamed, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      if (i == 3) writer.writeCompactionCursor(LogCursor(0x1234, 567));
+      std::vector<LogSample> data;
+      if (i < 5 || i >= 9) {
+        for (int j = (ref.timestamp() == 0 ? 1 : 0); j <= i % 7; ++j) {
+          data.emplace_back(j * 1000003, i * 100 + j);
+        }
+      }
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+  {
+    VaultWriter hot_writer(&streamed, hot);
+    ASSERT_EQ(hot_writer.openNew(), roo_io::kOk);
+    for (int i = 0; i < 5; ++i) {
+      hot_writer.writeLogData({LogSample(1, i)});
+    }
+    hot_writer.close();
+  }
+
+  VaultFileReader stream_reader(&streamed);
+  VaultFileReader mapped_reader(&mapped);
+  std::vector<Sample> expected;
+  std::vector<Sample> actual;
+  for (VaultFileRef ref : {seed, finished, hot}) {
+    for (int start : {0, 6, kRangeElementCount - 1}) {
+      // Past the data of the hot file, both fail to open.
+      ASSERT_EQ(mapped_reader.open(ref, start, 0),
+                stream_reader.open(ref, start, 0));
+      EXPECT_FALSE(stream_reader.is_mapped());
+      EXPECT_EQ(mapped_reader.is_mapped(), ref.timestamp() != hot.timestamp());
+      EXPECT_EQ(mapped_reader.dictionary(), stream_reader.dictionary());
+      for (int i = start; i < kRangeElementCount; ++i) {
+        EXPECT_EQ(mapped_reader.position(), stream_reader.position());
+        EXPECT_EQ(mapped_reader.empty_run_remaining(),
+                  stream_reader.empty_run_remaining());
+        EXPECT_EQ(mapped_reader.next(&actual), stream_reader.next(&expected));
+        ASSERT_EQ(actual.size(), expected.size()) << start << ", " << i;
+        for (size_t j = 0; j < actual.size(); ++j) {
+          EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+          EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+          EXPECT_EQ(actual[j].min_value(), expected[j].min_value());
+          EXPECT_EQ(actual[j].max_value(), expected[j].max_value());
+          EXPECT_EQ(actual[j].fill(), expected[j].fill());
+        }
+      }
+      EXPECT_TRUE(mapped_reader.past_eof());
+      EXPECT_FALSE(mapped_reader.is_open());
+    }
+  }
+  EXPECT_EQ(mapped_reader.stats().bytes_read,
+            stream_reader.stats().bytes_read);
+
+  // Columnar reads.
+  int64_t start = finished.timestamp();
+  int64_t end = hot.timestamp();
+  SampleColumns expected_columns({2000006, 0}, kRangeElementCount);
+  SampleColumns actual_columns({2000006, 0}, kRangeElementCount);
+  VaultIterator(&streamed, start, kResolution_1_ms)
+      .readRange(end, &expected_columns);
+  ASSERT_EQ(VaultIterator(&mapped, start, kResolution_1_ms)
+                .readRange(end, &actual_columns),
+            (size_t)kRangeElementCount);
+  for (size_t col = 0; col < 2; ++col) {
+    for (int step = 0; step < kRangeElementCount; ++step) {
+      EXPECT_EQ(actual_columns.avg(col)[step],
+                expected_columns.avg(col)[step]);
+      EXPECT_EQ(actual_columns.fill(col)[step],
+                expected_columns.fill(col)[step]);
+    }
+  }
+
+  // Reads restricted to a few streams.
+  std::vector<uint64_t> stream_ids = {5000015, 1000003, 42};
+  VaultIterator stream_it(&streamed, start, kResolution_1_ms, stream_ids);
+  VaultIterator mapped_it(&mapped, start, kResolution_1_ms, stream_ids);
+  for (int i = 0; i < kRangeElementCount; ++i) {
+    stream_it.next(&expected);
+    mapped_it.next(&actual);
+    ASSERT_EQ(actual.size(), expected.size()) << i;
+    for (size_t j = 0; j < actual.size(); ++j) {
+      EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+      EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+      EXPECT_EQ(actual[j].fill(), expected[j].fill());
+    }
+  }
+  EXPECT_EQ(mapped_it.stats().samples_read, stream_it.stats().samples_read);
+}
+
+TEST_F(MappedReadsTest, MatchStreamReads) {
+  checkMappedReadsMatchStreamReads(false);
+}
+
+TEST_F(MappedReadsTest, CompressedMatchStreamReads) {
+  checkMappedReadsMatchStreamReads(true);
+}
+
+TEST_F(MappedReadsTest, KeepsStatusOfFailedRead) {
+  roo_io::PosixFilesystem fs(root_);
+  Collection collection(fs, "test", kResolution_1_ms);
+  collection.enableMappedReads(root_);
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      writer.writeLogData({LogSample(1, i), LogSample(2, i)});
+    }
+    writer.close();
+  }
+
+  // Corrupts the last entry, keeping the entry-offset index valid: the
+  // varints no longer terminate.
+  FilePath path;
+  collection.getVaultFilePath(ref, &path);
+  std::string host_path = std::string(root_) + path.c_str();
+  FILE* f = fopen(host_path.c_str(), "r+b");
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fseek(f, -kVaultIndexSize, SEEK_END), 0);
+  long index_offset = ftell(f);
+  uint8_t offset[4];
+  ASSERT_EQ(fseek(f, 4 * (kRangeElementCount - 1), SEEK_CUR), 0);
+  ASSERT_EQ(fread(offset, 1, 4, f), 4u);
+  long last = (offset[0] << 24) | (offset[1] << 16) | (offset[2] << 8) |
+              offset[3];
+  ASSERT_EQ(fseek(f, last, SEEK_SET), 0);
+  for (long i = last; i < index_offset; ++i) fputc(0xFF, f);
+  fclose(f);
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, kRangeElementCount - 1, 0));
+  EXPECT_TRUE(reader.is_mapped());
+  std::vector<Sample> samples;
+  EXPECT_FALSE(reader.next(&samples));
+  EXPECT_FALSE(reader.is_open());
+  EXPECT_EQ(reader.status(), roo_io::kReadError);
+  EXPECT_FALSE(reader.ok());
+
+  // Reopening resets the status.
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  EXPECT_EQ(reader.status(), roo_io::kOk);
+}
+
+#endif  // ROO_MONITORING_HAS_MMAP
+
+// Appends a sample in the vault file encoding.
+void encodeSample(std::vector<uint8_t>& out, uint64_t stream_id, uint16_t avg,
+                  uint16_t min, uint16_t max, uint16_t fill) {
+  while (stream_id >= 0x80) {
+    out.push_back((stream_id & 0x7F) | 0x80);
+    stream_id >>= 7;
+  }
+  out.push_back(stream_id);
+  for (uint16_t v : {avg, min, max, fill}) {
+    out.push_back(v >> 8);
+    out.push_back(v & 0xFF);
+  }
+}
+
+TEST(SampleDecoderTest, MatchesScalarDecoding) {
+  std::vector<uint8_t> data;
+  uint64_t stream_ids[kSampleBatchSize];
+  for (int i = 0; i < kSampleBatchSize; ++i) {
+    // Stream IDs of 1 to 10 bytes.
+    stream_ids[i] = (i % 3 == 0) ? i : (0x5DEECE66DULL * (i + 1)) >> (i % 64);
+    encodeSample(data, stream_ids[i], i * 1001, i * 7, 65535 - i, 0x2000 - i);
+  }
+  for (int count = 1; count <= kSampleBatchSize; ++count) {
+    SampleBatch expected;
+    SampleBatch actual;
+    const uint8_t* begin = data.data();
+    const uint8_t* end = data.data() + data.size();
+    const uint8_t* scalar_end =
+        DecodeSampleBatchScalar(begin, end, count, &expected);
+    ASSERT_NE(scalar_end, nullptr);
+    ASSERT_EQ(DecodeSampleBatch(begin, end, count, &actual), scalar_end);
+    for (int i = 0; i < count; ++i) {
+      EXPECT_EQ(actual.stream_id[i], stream_ids[i]) << i;
+      EXPECT_EQ(expected.stream_id[i], stream_ids[i]) << i;
+      EXPECT_EQ(actual.avg[i], (uint16_t)(i * 1001)) << i;
+      EXPECT_EQ(expected.avg[i], (uint16_t)(i * 1001)) << i;
+      EXPECT_EQ(actual.min[i], expected.min[i]) << i;
+      EXPECT_EQ(actual.max[i], expected.max[i]) << i;
+      EXPECT_EQ(actual.fill[i], expected.fill[i]) << i;
+    }
+    // Truncated data.
+    EXPECT_EQ(DecodeSampleBatch(begin, scalar_end - 1, count, &actual),
+              nullptr);
+  }
+}
+
+TEST(VaultReaderTest, AppendsToLegacyFormatWithoutRuns) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  FilePath path;
+  collection.getVaultFilePath(ref, &path);
+  roo_io::Mount mount = fs.mount();
+  roo_io::MkParentDirRecursively(mount, path.c_str());
+  {
+    auto out = roo_io::OpenDataFileForWrite(mount, path.c_str(),
+                                            roo_io::kFailIfExists);
+    out.writeU8(1);
+    out.writeU8(2);
+    out.writeVarU64(0);
+    out.close();
+  }
+  {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(1), roo_io::kOk);
+    writer.writeEmptyData(2);
+    writer.writeLogData({LogSample(1, 3)});
+    writer.close();
+  }
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(ref, 0, 0));
+  EXPECT_EQ(reader.minor_version(), 2);
+  EXPECT_EQ(reader.scanEntryCount(), 4);
+  ASSERT_TRUE(reader.open(ref, 3, 0));
+  std::vector<Sample> samples;
+  ASSERT_TRUE(reader.next(&samples));
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].avg_value(), 3u);
+}
+
+TEST(VaultReaderTest, StreamDictionary) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // Hashed stream IDs, taking 9 or 10 bytes as varints. The second file has
+  // one more stream than the first one, so it is missing from the dictionary.
+  auto stream_id = [](int j) { return 0x9E3779B97F4A7C15ULL * (j + 1); };
+  VaultFileRef first = VaultFileRef::Lookup(0, kResolution_1_ms);
+  VaultFileRef second = first.next();
+  for (VaultFileRef ref : {first, second}) {
+    int stream_count = ref.timestamp() == 0 ? 20 : 21;
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    EXPECT_TRUE(writer.has_dictionary());
+    EXPECT_EQ(writer.dictionary().size(), ref.timestamp() == 0 ? 0u : 20u);
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      if (i == kRangeElementCount / 2) {
+        // Appends use the dictionary of the file.
+        writer.close();
+        ASSERT_EQ(writer.openExisting(i), roo_io::kOk);
+        EXPECT_EQ(writer.dictionary().size(), ref.timestamp() == 0 ? 0u : 20u);
+      }
+      std::vector<LogSample> data;
+      for (int j = 0; j < stream_count; ++j) {
+        data.emplace_back(stream_id(j), i + j);
+      }
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+
+  VaultFileReader reader(&collection);
+  ASSERT_TRUE(reader.open(second, 0, 0));
+  std::vector<uint64_t> expected_dictionary;
+  for (int j = 0; j < 20; ++j) expected_dictionary.push_back(stream_id(j));
+  std::sort(expected_dictionary.begin(), expected_dictionary.end());
+  EXPECT_EQ(reader.dictionary(), expected_dictionary);
+
+  uint64_t bytes_read[2];
+  for (VaultFileRef ref : {first, second}) {
+    VaultFileReader reader(&collection);
+    ASSERT_TRUE(reader.open(ref, 0, 0));
+    std::vector<Sample> samples;
+    for (int i = 0; i < kRangeElementCount; ++i) {
+      ASSERT_TRUE(reader.next(&samples));
+      ASSERT_EQ(samples.size(), ref.timestamp() == 0 ? 20u : 21u);
+      for (size_t j = 0; j < samples.size(); ++j) {
+        EXPECT_EQ(samples[j].stream_id(), stream_id(j));
+        EXPECT_EQ(samples[j].avg_value(), i + j);
+      }
+    }
+    bytes_read[ref.timestamp() == 0 ? 0 : 1] = reader.stats().bytes_read;
+  }
+  // 1 byte per stream ID instead of 10.
+  EXPECT_LT(bytes_read[1] * 10, bytes_read[0] * 6);
+
+  // Stream IDs are collected without decoding samples.
+  ASSERT_TRUE(reader.open(second, 5, 0));
+  std::vector<uint64_t> stream_ids;
+  reader.readStreamIds(&stream_ids);
+  EXPECT_EQ(stream_ids.size(), 21u);
+  EXPECT_TRUE(std::is_sorted(stream_ids.begin(), stream_ids.end()));
+  EXPECT_EQ(reader.stats().samples_read, 0u);
+}
+
+TEST(VaultReaderTest, WriteHistoryAvoidsReadingBack) {
+  for (bool compressed : {false, true}) {
+    roo_io::fakefs::FakeFs fake_fs;
+    roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+    Collection read_back(fs, "read_back", kResolution_1_ms);
+    Collection remembered(fs, "remembered", kResolution_1_ms);
+    if (compressed) {
+      read_back.enableVaultCompression();
+      remembered.enableVaultCompression();
+    }
+    VaultWriteHistory history;
+
+    // Two files, the second one paused in the middle of a delta block, with
+    // a stream missing from the first one.
+    VaultFileRef first = VaultFileRef::Lookup(0, kResolution_1_ms);
+    VaultFileRef second = first.next();
+    for (Collection* collection : {&read_back, &remembered}) {
+      VaultWriteHistory* h = collection == &remembered ? &history : nullptr;
+      for (VaultFileRef ref : {first, second}) {
+        VaultWriter writer(collection, ref, h);
+        ASSERT_EQ(writer.openNew(), roo_io::kOk);
+        if (ref.timestamp() != 0) {
+          EXPECT_EQ(writer.dictionary().size(), 3u);
+          EXPECT_EQ(writer.bytes_read() == 0, h != nullptr);
+        }
+        for (int i = 0; i < kRangeElementCount; ++i) {
+          if (ref.timestamp() != 0 && i == kRangeElementCount / 2 + 1) {
+            writer.close();
+            ASSERT_EQ(writer.openExisting(i), roo_io::kOk);
+            // Only compressed files have entries to read back.
+            EXPECT_EQ(writer.bytes_read() > 0, compressed && h == nullptr);
+          }
+          std::vector<LogSample> data;
+          for (int j = 1; j <= (i == 5 ? 3 : 4); ++j) {
+            if (ref.timestamp() == 0 && j == 4) continue;
+            data.emplace_back(j * 1000003, i * 10 + j);
+          }
+          writer.writeLogData(data);
+        }
+        writer.close();
+      }
+    }
+    // The next file's dictionary has all 4 streams.
+    VaultWriter writer(&remembered, second.next(), &history);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    EXPECT_EQ(writer.dictionary().size(), 4u);
+    EXPECT_EQ(writer.bytes_read(), 0u);
+    writer.close();
+
+    for (VaultFileRef ref : {first, second}) {
+      VaultFileReader expected_reader(&read_back);
+      VaultFileReader actual_reader(&remembered);
+      ASSERT_TRUE(expected_reader.open(ref, 0, 0));
+      ASSERT_TRUE(actual_reader.open(ref, 0, 0));
+      EXPECT_EQ(actual_reader.dictionary(), expected_reader.dictionary());
+      std::vector<Sample> expected;
+      std::vector<Sample> actual;
+      for (int i = 0; i < kRangeElementCount; ++i) {
+        ASSERT_TRUE(expected_reader.next(&expected));
+        ASSERT_TRUE(actual_reader.next(&actual));
+        ASSERT_EQ(actual.size(), expected.size());
+        for (size_t j = 0; j < actual.size(); ++j) {
+          EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+          EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+        }
+      }
+      EXPECT_EQ(actual_reader.stats().bytes_read,
+                expected_reader.stats().bytes_read);
+    }
+  }
+}
+
+TEST(VaultReaderTest, CompressedMatchesUncompressed) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection plain(fs, "plain", kResolution_1_ms);
+  Collection compressed(fs, "compressed", kResolution_1_ms);
+  compressed.enableVaultCompression();
+
+  // Slowly changing values, with missing samples and a gap. The second file
+  // has a stream dictionary, with one stream missing from it. Both files are
+  // appended to mid-block.
+  VaultFileRef first = VaultFileRef::Lookup(0, kResolution_1_ms);
+  VaultFileRef second = first.next();
+  for (Collection* collection : {&plain, &compressed}) {
+    for (VaultFileRef ref : {first, second}) {
+      int stream_count = ref.timestamp() == 0 ? 8 : 9;
+      VaultWriter writer(collection, ref);
+      ASSERT_EQ(writer.openNew(), roo_io::kOk);
+      for (int i = 0; i < kRangeElementCount; ++i) {
+        if (i == kVaultDeltaBlockSize + 2) {
+          writer.close();
+          ASSERT_EQ(writer.openExisting(i), roo_io::kOk);
+        }
+        EXPECT_EQ(writer.compressed(), collection == &compressed);
+        std::vector<LogSample> data;
+        if (i < 9 || i > 11) {
+          for (int j = 0; j < stream_count; ++j) {
+            if ((i + j) % 5 == 0) continue;
+            data.emplace_back(j * 7919,
+                              30000 + j * 1000 + i * (j - 4) + (i * j) % 3);
+          }
+        }
+        writer.writeLogData(data);
+      }
+      writer.close();
+    }
+  }
+
+  VaultFileReader expected_reader(&plain);
+  VaultFileReader actual_reader(&compressed);
+  std::vector<Sample> expected;
+  std::vector<Sample> actual;
+  for (VaultFileRef ref : {first, second}) {
+    // Seeks to any entry.
+    for (int start = 0; start < kRangeElementCount; ++start) {
+      ASSERT_TRUE(expected_reader.open(ref, start, 0));
+      ASSERT_TRUE(actual_reader.open(ref, start, 0));
+      EXPECT_TRUE(actual_reader.compressed());
+      for (int i = start; i < kRangeElementCount; ++i) {
+        EXPECT_TRUE(actual_reader.next(&actual));
+        EXPECT_TRUE(expected_reader.next(&expected));
+        ASSERT_EQ(actual.size(), expected.size()) << start << ", " << i;
+        for (size_t j = 0; j < actual.size(); ++j) {
+          EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+          EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+          EXPECT_EQ(actual[j].min_value(), expected[j].min_value());
+          EXPECT_EQ(actual[j].max_value(), expected[j].max_value());
+          EXPECT_EQ(actual[j].fill(), expected[j].fill());
+        }
+        // Resumed by the entry index.
+        EXPECT_EQ(actual_reader.tell().position(), 0);
+      }
+    }
+  }
+
+  // Sizes of the second file. Mostly 2 bytes per sample instead of 9; more
+  // at the start of every block, and for the stream missing from the
+  // dictionary.
+  uint64_t bytes_read[2];
+  for (Collection* collection : {&plain, &compressed}) {
+    VaultFileReader reader(collection);
+    ASSERT_TRUE(reader.open(second, 0, 0));
+    while (reader.next(&actual)) {
+    }
+    bytes_read[collection == &plain ? 0 : 1] = reader.stats().bytes_read;
+  }
+  EXPECT_LT(bytes_read[1] * 5, bytes_read[0] * 2);
+
+  std::vector<uint64_t> stream_ids;
+  ASSERT_TRUE(actual_reader.open(second, 0, 0));
+  actual_reader.readStreamIds(&stream_ids);
+  EXPECT_EQ(stream_ids.size(), 9u);
+
+  // Reads restricted to a few streams.
+  std::vector<uint64_t> filter = {3 * 7919, 8 * 7919, 42};
+  VaultIterator expected_it(&plain, 3, kResolution_1_ms, filter);
+  VaultIterator actual_it(&compressed, 3, kResolution_1_ms, filter);
+  for (int i = 3; i < 2 * kRangeElementCount; ++i) {
+    expected_it.next(&expected);
+    actual_it.next(&actual);
+    ASSERT_EQ(actual.size(), expected.size()) << i;
+    for (size_t j = 0; j < actual.size(); ++j) {
+      EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+      EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+    }
+  }
+}
+
+TEST(VaultIteratorTest, ReadRangeMatchesNext) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+
+  // Two files with data, separated by a missing one.
+  VaultFileRef first = VaultFileRef::Lookup(0, kResolution_1_ms);
+  for (VaultFileRef ref : {first, first.advance(2)}) {
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openNew(), roo_io::kOk);
+    for (uint16_t i = 0; i < kRangeElementCount; ++i) {
+      std::vector<LogSample> data;
+      if (i % 3 != 0) data.emplace_back(1, i);
+      data.emplace_back(2, i + 100);
+      if (i % 2 == 0) data.emplace_back(3, i + 200);
+      writer.writeLogData(data);
+    }
+    writer.close();
+  }
+
+  int64_t start = 3;
+  int64_t end = first.advance(3).timestamp() - 2;
+  SampleColumns columns({3, 1}, 10);
+  VaultIterator batch(&collection, start, kResolution_1_ms);
+  VaultIterator single(&collection, start, kResolution_1_ms);
+  std::vector<Sample> samples;
+  int64_t total = 0;
+  while (size_t n = batch.readRange(end, &columns)) {
+    for (size_t step = 0; step < n; ++step) {
+      ASSERT_EQ(columns.timestamps()[step], single.cursor());
+      single.next(&samples);
+      for (size_t col = 0; col < columns.stream_count(); ++col) {
+        auto i = std::find_if(samples.begin(), samples.end(),
+                              [&](const Sample& s) {
+                                return s.stream_id() == columns.stream_id(col);
+                              });
+        if (i == samples.end()) {
+          EXPECT_EQ(columns.fill(col)[step], 0);
+        } else {
+          EXPECT_EQ(columns.avg(col)[step], i->avg_value());
+          EXPECT_EQ(columns.fill(col)[step], i->fill());
+        }
+      }
+      ++total;
+    }
+  }
+  EXPECT_EQ(total, end - start);
+  EXPECT_EQ(batch.cursor(), end);
+}
+
+TEST(VaultIteratorTest, StreamFilterMatchesUnfilteredReads) {
+  // Entries with and without stream-ID directories.
+  for (uint8_t minor_version : {4, 5}) {
+    roo_io::fakefs::FakeFs fake_fs;
+    roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+    Collection collection(fs, "test", kResolution_1_ms);
+
+    VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+    FilePath path;
+    collection.getVaultFilePath(ref, &path);
+    roo_io::Mount mount = fs.mount();
+    roo_io::MkParentDirRecursively(mount, path.c_str());
+    {
+      auto out = roo_io::OpenDataFileForWrite(mount, path.c_str(),
+                                              roo_io::kFailIfExists);
+      out.writeU8(1);
+      out.writeU8(minor_version);
+      out.writeVarU64(0);
+      out.writeVarU64(0);
+      out.close();
+    }
+    VaultWriter writer(&collection, ref);
+    ASSERT_EQ(writer.openExisting(1), roo_io::kOk);
+    EXPECT_EQ(writer.has_directory(), minor_version >= 5);
+    for (int i = 1; i < kRangeElementCount; ++i) {
+      std::vector<LogSample> data;
+      for (int j = i % 3; j < 40; j += 1 + i % 4) {
+        data.emplace_back(j * 131, i * 100 + j);
+      }
+      writer.writeLogData(data);
+    }
+    writer.close();
+
+    StreamFilter filter({393, 0, 2000, 393});
+    std::vector<Sample> expected;
+    std::vector<Sample> actual;
+    for (bool cached : {false, true}) {
+      if (cached) collection.enableVaultCache(1 << 20);
+      VaultIterator all(&collection, 0, kResolution_1_ms);
+      VaultIterator some(&collection, 0, kResolution_1_ms, {393, 0, 2000});
+      for (int i = 0; i < kRangeElementCount; ++i) {
+        all.next(&expected);
+        some.next(&actual);
+        expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                      [&](const Sample& s) {
+                                        return !filter.contains(s.stream_id());
+                                      }),
+                       expected.end());
+        ASSERT_EQ(actual.size(), expected.size()) << i;
+        for (size_t j = 0; j < actual.size(); ++j) {
+          EXPECT_EQ(actual[j].stream_id(), expected[j].stream_id());
+          EXPECT_EQ(actual[j].avg_value(), expected[j].avg_value());
+        }
+      }
+      if (!cached) {
+        EXPECT_LT(some.stats().samples_read * 5, all.stats().samples_read);
+        EXPECT_EQ(some.stats().bytes_read, all.stats().bytes_read);
+      }
+    }
+  }
+}
+
+TEST(VaultIteratorTest, CachedReadsMatchAndSeeAppends) {
+  roo_io::fakefs::FakeFs fake_fs;
+  roo_io::fakefs::FakeReferenceFs fs(fake_fs);
+  Collection collection(fs, "test", kResolution_1_ms);
+  collection.enableVaultCache(1 << 20);
+
+  VaultFileRef ref = VaultFileRef::Lookup(0, kResolution_1_ms);
+  VaultWriter writer(&collection, ref);
+  ASSERT_EQ(writer.openNew(), roo_io::kOk);
+  for (uint16_t i = 0; i < 4; ++i) {
+    writer.writeLogData({LogSample(1, i), LogSample(2, i + 100)});
+  }
+  writer.close();
+
+  std::vector<Sample> samples;
+  for (int pass = 0; pass < 2; ++pass) {
+    VaultIterator it(&collection, 2, kResolution_1_ms);
+    it.next(&samples);
+    ASSERT_EQ(samples.size(), 2u);
+    EXPECT_EQ(samples[1].avg_value(), 102u);
+    it.next(&samples);
+    it.next(&samples);
+    EXPECT_TRUE(samples.empty());
+    EXPECT_EQ(it.cursor(), 5);
+  }
+  EXPECT_EQ(collection.vault_cache()->misses(), 1u);
+  EXPECT_EQ(collection.vault_cache()->hits(), 1u);
+  EXPECT_GT(collection.vault_cache()->bytes(), 0u);
+
+  // Appending to the (hot) file invalidates it.
+  ASSERT_EQ(writer.openExisting(4), roo_io::kOk);
+  writer.writeLogData({LogSample(3, 7)});
+  writer.close();
+  VaultIterator it(&collection, 4, kResolution_1_ms);
+  it.next(&samples);
+  ASSERT_EQ(samples.size(), 1u);
+  EXPECT_EQ(samples[0].stream_id(), 3u);
+  EXPECT_EQ(collection.vault_cache()->misses(), 2u);
+}
+
 }  // namespace
 }  // namespace roo_monitoring